@@ -0,0 +1,87 @@
+#ifndef __AUTOTUNE_C__
+#define __AUTOTUNE_C__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+/*
+ * Picks the number of workers and shards for the machine the tools run on.
+ * Needs _GNU_SOURCE for sched_getaffinity() and the cache size queries.
+ */
+
+// Used when the cache size can't be queried
+#define AUTOTUNE_DEFAULT_CACHE_SIZE (8ULL * 1024 * 1024)
+
+/* CPUs the process may run on, so that taskset and cgroup limits are honoured */
+uint32_t autotune_threads(void) {
+	cpu_set_t set;
+	long cpus;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return cpus > 0 ? cpus : 1;
+}
+
+/* Size of the last level cache shared by the workers, in bytes */
+uint64_t autotune_cache_size(void) {
+	long size;
+
+	size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	if (size <= 0)
+		size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if (size <= 0)
+		return AUTOTUNE_DEFAULT_CACHE_SIZE;
+
+	return size;
+}
+
+/*
+ * Number of shards for the state of the given size, a power of two. There are
+ * at least min_per_thread shards per worker to keep the lock contention low,
+ * and more if needed for a shard to fit in the cache share of a single worker,
+ * which keeps the working set of shard owners cache resident.
+ */
+uint32_t autotune_shards(uint64_t state_size, uint32_t threads, uint32_t min_per_thread,
+		uint32_t max_shards) {
+	uint64_t cache_share = autotune_cache_size() / (threads ? threads : 1);
+	uint64_t wanted = (uint64_t)threads * min_per_thread;
+	uint64_t shards = 1;
+
+	if (cache_share > 0 && state_size / cache_share > wanted)
+		wanted = state_size / cache_share;
+
+	while (shards < wanted && shards * 2 <= max_shards)
+		shards *= 2;
+
+	return shards;
+}
+
+/*
+ * Parses a -t/-s style argument, either a number between 1 and max or "auto",
+ * which is returned as 0. Returns 1 if the argument is invalid.
+ */
+int autotune_parse(const char *arg, uint32_t *value, uint32_t max) {
+	char *end;
+	unsigned long parsed;
+
+	if (strcmp(arg, "auto") == 0) {
+		*value = 0;
+		return 0;
+	}
+
+	parsed = strtoul(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0' || parsed < 1 || parsed > max)
+		return 1;
+
+	*value = parsed;
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,394 @@
+#ifndef __URING_READER_C__
+#define __URING_READER_C__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Sequential reader of a file range keeping several reads in flight with
+ * io_uring, so the next buffers are being read while the current one is
+ * processed. Buffers are handed out in file order. If io_uring can't be set
+ * up the reader falls back to plain pread.
+ *
+ * The ring is driven with raw system calls, there is no liburing dependency.
+ */
+
+#define URING_READER_MAX_DEPTH 64
+
+enum uring_slot_state {
+	URING_SLOT_IDLE,
+	URING_SLOT_IN_FLIGHT,
+	URING_SLOT_DONE,
+};
+
+struct uring_slot {
+	char *buffer;
+	struct iovec iov;
+	uint64_t offset;
+	uint32_t length;
+	int result;
+	enum uring_slot_state state;
+};
+
+struct uring_ring {
+	int fd;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct uring_reader {
+	int fd;
+	uint64_t next_offset;
+	uint64_t end;
+	uint32_t buffer_size;
+	unsigned depth;
+
+	int use_uring;
+	struct uring_ring ring;
+	struct uring_slot slots[URING_READER_MAX_DEPTH];
+	// Slot to be handed out next and the one handed out by the previous call
+	unsigned head;
+	int delivered;
+
+	// Time spent blocked waiting for the data
+	uint64_t wait_ns;
+};
+
+static uint64_t uring_reader_now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int uring_ring_setup(struct uring_ring *ring, unsigned entries) {
+	struct io_uring_params params;
+	int fd;
+
+	memset(&params, 0, sizeof(params));
+
+	fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd < 0)
+		return 1;
+
+	ring->fd = fd;
+	ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = 0;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		goto close_ring;
+
+	if (ring->cq_size) {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED)
+			goto unmap_sq;
+	} else {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto unmap_cq;
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+
+	ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+
+	return 0;
+
+unmap_cq:
+	if (ring->cq_size)
+		munmap(ring->cq_ptr, ring->cq_size);
+unmap_sq:
+	munmap(ring->sq_ptr, ring->sq_size);
+close_ring:
+	close(fd);
+
+	return 1;
+}
+
+static void uring_ring_teardown(struct uring_ring *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_size)
+		munmap(ring->cq_ptr, ring->cq_size);
+	munmap(ring->sq_ptr, ring->sq_size);
+	close(ring->fd);
+}
+
+static int uring_ring_enter(struct uring_ring *ring, unsigned to_submit, unsigned min_complete) {
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+				min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+/* Queues a read of the next part of the range into the slot */
+static int uring_reader_submit(struct uring_reader *reader, unsigned slot_id) {
+	struct uring_slot *slot = &reader->slots[slot_id];
+	struct uring_ring *ring = &reader->ring;
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+	uint64_t remaining = reader->end - reader->next_offset;
+
+	if (remaining == 0) {
+		slot->state = URING_SLOT_IDLE;
+		return 0;
+	}
+
+	slot->offset = reader->next_offset;
+	slot->length = remaining < reader->buffer_size ? remaining : reader->buffer_size;
+	slot->iov.iov_base = slot->buffer;
+	slot->iov.iov_len = slot->length;
+	slot->state = URING_SLOT_IN_FLIGHT;
+	reader->next_offset += slot->length;
+
+	if (!reader->use_uring)
+		return 0;
+
+	tail = *ring->sq_tail;
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READV;
+	sqe->fd = reader->fd;
+	sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+	sqe->len = 1;
+	sqe->off = slot->offset;
+	sqe->user_data = slot_id;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (uring_ring_enter(ring, 1, 0) < 0)
+		return 1;
+
+	return 0;
+}
+
+static void uring_reader_reap(struct uring_reader *reader) {
+	struct uring_ring *ring = &reader->ring;
+	struct io_uring_cqe *cqe;
+	unsigned head = *ring->cq_head;
+
+	while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+
+		assert(cqe->user_data < reader->depth);
+		reader->slots[cqe->user_data].result = cqe->res;
+		reader->slots[cqe->user_data].state = URING_SLOT_DONE;
+
+		head++;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Reads what is missing from the slot synchronously, used for short reads and the fallback */
+static int uring_reader_complete_with_pread(struct uring_reader *reader, struct uring_slot *slot,
+		uint32_t done) {
+	uint64_t start = uring_reader_now_ns();
+	ssize_t ret;
+
+	while (done < slot->length) {
+		ret = pread(reader->fd, slot->buffer + done, slot->length - done, slot->offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+
+	reader->wait_ns += uring_reader_now_ns() - start;
+
+	return done;
+}
+
+void uring_reader_deinit(struct uring_reader *reader) {
+	unsigned i;
+
+	if (reader->use_uring) {
+		// The kernel may still write into buffers of reads we didn't wait for
+		for (i = 0; i < reader->depth; i++) {
+			while (reader->slots[i].state == URING_SLOT_IN_FLIGHT) {
+				uring_reader_reap(reader);
+				// Submits whatever may have been left queued as well
+				if (reader->slots[i].state == URING_SLOT_IN_FLIGHT &&
+						uring_ring_enter(&reader->ring, reader->depth, 1) < 0)
+					break;
+			}
+		}
+		uring_ring_teardown(&reader->ring);
+	}
+
+	for (i = 0; i < reader->depth; i++)
+		free(reader->slots[i].buffer);
+}
+
+int uring_reader_init(struct uring_reader *reader, int fd, uint64_t start, uint64_t end,
+		uint32_t buffer_size, unsigned depth) {
+	unsigned i;
+
+	memset(reader, 0, sizeof(*reader));
+
+	if (depth == 0)
+		depth = 1;
+	if (depth > URING_READER_MAX_DEPTH)
+		depth = URING_READER_MAX_DEPTH;
+
+	reader->fd = fd;
+	reader->next_offset = start;
+	reader->end = end;
+	reader->buffer_size = buffer_size;
+	reader->depth = depth;
+	reader->delivered = -1;
+	reader->use_uring = uring_ring_setup(&reader->ring, depth) == 0;
+
+	for (i = 0; i < depth; i++) {
+		// Page aligned, so the buffers can be used for O_DIRECT reads too
+		if (posix_memalign((void **)&reader->slots[i].buffer, 4096, buffer_size) != 0)
+			goto err;
+	}
+
+	for (i = 0; i < depth; i++) {
+		if (uring_reader_submit(reader, i) != 0)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	uring_reader_deinit(reader);
+
+	return 1;
+}
+
+/*
+ * Starts reading another range with the same ring and buffers. The previous
+ * range must have been read up to the end, i.e. uring_reader_next() returned 0.
+ */
+int uring_reader_restart(struct uring_reader *reader, uint64_t start, uint64_t end) {
+	unsigned i;
+
+	for (i = 0; i < reader->depth; i++)
+		assert(reader->slots[i].state == URING_SLOT_IDLE);
+	assert(reader->delivered < 0);
+
+	reader->next_offset = start;
+	reader->end = end;
+	reader->head = 0;
+
+	for (i = 0; i < reader->depth; i++) {
+		if (uring_reader_submit(reader, i) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Hands out the next part of the range in file order. Returns the number of
+ * bytes in *buffer, 0 once the whole range was read and -1 on error. The buffer
+ * stays valid until the next call.
+ */
+int64_t uring_reader_next(struct uring_reader *reader, char **buffer, uint64_t *offset) {
+	struct uring_slot *slot;
+	uint64_t start;
+	int ret;
+
+	// The buffer handed out previously isn't used anymore, read ahead into it
+	if (reader->delivered >= 0) {
+		ret = uring_reader_submit(reader, reader->delivered);
+		reader->delivered = -1;
+		if (ret != 0)
+			return -1;
+	}
+
+	slot = &reader->slots[reader->head];
+	if (slot->state == URING_SLOT_IDLE)
+		return 0;
+
+	if (!reader->use_uring) {
+		slot->result = uring_reader_complete_with_pread(reader, slot, 0);
+		slot->state = URING_SLOT_DONE;
+	}
+
+	while (slot->state != URING_SLOT_DONE) {
+		uring_reader_reap(reader);
+		if (slot->state == URING_SLOT_DONE)
+			break;
+
+		start = uring_reader_now_ns();
+		ret = uring_ring_enter(&reader->ring, 0, 1);
+		reader->wait_ns += uring_reader_now_ns() - start;
+		if (ret < 0)
+			return -1;
+	}
+
+	if (slot->result < 0)
+		return -1;
+
+	// The reads queued behind this one expect it to be complete
+	if ((uint32_t)slot->result < slot->length)
+		slot->result = uring_reader_complete_with_pread(reader, slot, slot->result);
+
+	*buffer = slot->buffer;
+	*offset = slot->offset;
+
+	reader->delivered = reader->head;
+	reader->head = (reader->head + 1) % reader->depth;
+
+	return slot->result;
+}
+
+/* Time spent waiting for the reads, in seconds */
+double uring_reader_wait_time(struct uring_reader *reader) {
+	return reader->wait_ns / 1e9;
+}
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef __ADAPTIVE_C__
+#define __ADAPTIVE_C__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sched.h>
+
+#include "popcount.c"
+
+/*
+ * Containers of the adaptive layout, in the spirit of roaring bitmaps. Every
+ * container covers 2^16 consecutive values of a shard. While it holds few
+ * values it's a sorted array of (low 16 bits << 1 | seen twice) entries, once
+ * the array reaches ADAPTIVE_SPARSE_MAX entries it's converted to a dense
+ * bitmap with both bits of a value interleaved, which takes the same memory.
+ * Containers nobody inserted to take no memory besides the descriptor.
+ */
+
+#define ADAPTIVE_CHUNK_BITS 16
+#define ADAPTIVE_CHUNK_MASK ((1U << ADAPTIVE_CHUNK_BITS) - 1)
+#define ADAPTIVE_DENSE_WORDS ((2U << ADAPTIVE_CHUNK_BITS) / 64)
+#define ADAPTIVE_SPARSE_MAX (ADAPTIVE_DENSE_WORDS * sizeof(uint64_t) / sizeof(uint32_t))
+#define ADAPTIVE_SPARSE_MIN_CAPACITY 16
+
+struct adaptive_container {
+	uint32_t *entries;
+	uint64_t *cells;
+	uint32_t count;
+	uint32_t capacity;
+	// Taken by the engines sharing the shard between threads
+	char lock;
+};
+
+static inline void adaptive_lock(struct adaptive_container *container) {
+	while (__atomic_test_and_set(&container->lock, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&container->lock, __ATOMIC_RELAXED))
+			sched_yield();
+	}
+}
+
+static inline void adaptive_unlock(struct adaptive_container *container) {
+	__atomic_clear(&container->lock, __ATOMIC_RELEASE);
+}
+
+/* Sets the "seen once" bit or, if it was set already, the "seen twice" bit */
+static inline int adaptive_dense_insert(uint64_t *cells, uint32_t low) {
+	uint64_t *cell = &cells[low >> 5];
+	uint32_t bit = (low & 31) * 2;
+
+	if (*cell & (2ULL << bit))
+		return 0;
+
+	*cell |= (*cell & (1ULL << bit)) ? (2ULL << bit) : (1ULL << bit);
+
+	return 1;
+}
+
+static void adaptive_convert_to_dense(struct adaptive_container *container) {
+	uint32_t i, low;
+
+	container->cells = calloc(ADAPTIVE_DENSE_WORDS, sizeof(uint64_t));
+	assert(container->cells != NULL);
+
+	for (i = 0; i < container->count; i++) {
+		low = container->entries[i] >> 1;
+		container->cells[low >> 5] |= (uint64_t)(1 | (container->entries[i] & 1) << 1)
+			<< ((low & 31) * 2);
+	}
+
+	free(container->entries);
+	container->entries = NULL;
+	container->count = 0;
+	container->capacity = 0;
+}
+
+/*
+ * Records an occurrence of the value with the given low 16 bits. Returns 1 if
+ * the container changed, 0 if the value was seen twice already.
+ */
+int adaptive_insert(struct adaptive_container *container, uint32_t low) {
+	uint32_t begin = 0, end = container->count, middle;
+	uint32_t *entries;
+
+	if (container->cells)
+		return adaptive_dense_insert(container->cells, low);
+
+	while (begin < end) {
+		middle = (begin + end) / 2;
+		if ((container->entries[middle] >> 1) < low)
+			begin = middle + 1;
+		else
+			end = middle;
+	}
+
+	if (begin < container->count && (container->entries[begin] >> 1) == low) {
+		if (container->entries[begin] & 1)
+			return 0;
+
+		container->entries[begin] |= 1;
+		return 1;
+	}
+
+	if (container->count == ADAPTIVE_SPARSE_MAX) {
+		adaptive_convert_to_dense(container);
+		return adaptive_dense_insert(container->cells, low);
+	}
+
+	if (container->count == container->capacity) {
+		container->capacity = container->capacity ? container->capacity * 2 :
+			ADAPTIVE_SPARSE_MIN_CAPACITY;
+		entries = realloc(container->entries, container->capacity * sizeof(uint32_t));
+		assert(entries != NULL);
+		container->entries = entries;
+	}
+
+	memmove(&container->entries[begin + 1], &container->entries[begin],
+			(container->count - begin) * sizeof(uint32_t));
+	container->entries[begin] = low << 1;
+	container->count++;
+
+	return 1;
+}
+
+void adaptive_count(struct adaptive_container *container, uint64_t *present, uint64_t *only_once) {
+	uint32_t i;
+
+	if (container->cells) {
+		popcount_interleaved(container->cells, ADAPTIVE_DENSE_WORDS, present, only_once);
+		return;
+	}
+
+	*present += container->count;
+	for (i = 0; i < container->count; i++)
+		*only_once += !(container->entries[i] & 1);
+}
+
+/* Memory taken by the values of the container, in bytes */
+uint64_t adaptive_memory(struct adaptive_container *container) {
+	if (container->cells)
+		return ADAPTIVE_DENSE_WORDS * sizeof(uint64_t);
+
+	return container->capacity * sizeof(uint32_t);
+}
+
+void adaptive_free(struct adaptive_container *container) {
+	free(container->entries);
+	free(container->cells);
+	memset(container, 0, sizeof(*container));
+}
+
+#endif
@@ -0,0 +1,316 @@
+#ifndef __APPROX_C__
+#define __APPROX_C__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+/*
+ * Approximate counting in bounded memory, for when trends are enough. Every
+ * worker keeps its own sketch, which are merged at the end.
+ *
+ * The number of unique values is estimated with HyperLogLog: the value is
+ * hashed, the top "precision" bits pick a register and the register keeps the
+ * maximum position of the first set bit in the rest of the hash. The estimate
+ * is the improved raw estimator of Ertl (2017), which unlike the original
+ * one with linear counting for small cardinalities isn't biased anywhere.
+ *
+ * The number of values seen only once is estimated from a hash based sample:
+ * only the values whose hash has its low "level" bits clear are counted, each
+ * exactly (up to 2), in a hash table. Once the sample holds more than
+ * 2 / error^2 values seen once the level is raised, which halves the sample
+ * and leaves at least 1 / error^2 of them.
+ * The error of the estimate only depends on the values seen once, the table
+ * grows for the repeated ones up to APPROX_SAMPLE_SPREAD times that before the
+ * level is raised regardless. The same value is always either sampled or not,
+ * so the samples of the workers can be merged. The estimate is the number of
+ * sampled values seen once times 2^level.
+ */
+
+#define APPROX_MIN_PRECISION 4
+#define APPROX_MAX_PRECISION 18
+// Relative standard error of HyperLogLog is APPROX_HLL_ERROR / sqrt(registers)
+#define APPROX_HLL_ERROR 1.04
+#define APPROX_DEFAULT_ERROR 0.01
+// The lowest error the registers at APPROX_MAX_PRECISION deliver, about 0.002
+#define APPROX_MIN_ERROR (APPROX_HLL_ERROR / (1 << (APPROX_MAX_PRECISION / 2)))
+#define APPROX_MAX_ERROR 0.5
+// The table holds up to half of its slots, so probing stays short
+#define APPROX_SAMPLE_LOAD 2
+// Sampled values at most per value seen once the sample may hold, keeps it within 32 MB
+#define APPROX_SAMPLE_SPREAD 4
+
+struct approx_sketch {
+	uint32_t precision;
+	uint8_t *registers;
+
+	uint32_t level;
+	// (value << 2 | count) per slot, 0 if the slot is free
+	uint64_t *sample;
+	uint64_t sample_slots;
+	uint64_t sample_size;
+	// Sampled values seen once so far
+	uint64_t sample_once;
+	// Of the values seen once
+	uint64_t sample_capacity;
+};
+
+/* fmix64 of MurmurHash3 */
+static inline uint64_t approx_hash(uint32_t value) {
+	uint64_t h = value;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/*
+ * Sizes the sketch for the given relative standard error of both estimates.
+ * The sample keeps at least 1 / error^2 values seen once if there are as
+ * many, unless the values seen more often outnumber them by far. Returns 1
+ * if the memory can't be allocated.
+ */
+int approx_init(struct approx_sketch *sketch, double error) {
+	uint64_t registers = ceil(pow(APPROX_HLL_ERROR / error, 2));
+
+	memset(sketch, 0, sizeof(*sketch));
+
+	sketch->precision = APPROX_MIN_PRECISION;
+	while ((1ULL << sketch->precision) < registers && sketch->precision < APPROX_MAX_PRECISION)
+		sketch->precision++;
+
+	sketch->sample_capacity = ceil(2 / (error * error));
+	// Grows as the repeated values come
+	sketch->sample_slots = 1;
+	while (sketch->sample_slots < sketch->sample_capacity * APPROX_SAMPLE_LOAD)
+		sketch->sample_slots *= 2;
+
+	sketch->registers = calloc(1ULL << sketch->precision, sizeof(uint8_t));
+	sketch->sample = calloc(sketch->sample_slots, sizeof(uint64_t));
+	if (!sketch->registers || !sketch->sample) {
+		free(sketch->registers);
+		free(sketch->sample);
+		return 1;
+	}
+
+	return 0;
+}
+
+void approx_deinit(struct approx_sketch *sketch) {
+	free(sketch->registers);
+	free(sketch->sample);
+	memset(sketch, 0, sizeof(*sketch));
+}
+
+/* Memory taken by the sketch, in bytes */
+uint64_t approx_memory(struct approx_sketch *sketch) {
+	return (1ULL << sketch->precision) + sketch->sample_slots * sizeof(uint64_t);
+}
+
+static inline int approx_sampled(uint64_t hash, uint32_t level) {
+	return (hash & ((1ULL << level) - 1)) == 0;
+}
+
+/* Records count occurrences (1 or 2, more are the same as 2) of a sampled value */
+static void approx_sample_insert(struct approx_sketch *sketch, uint32_t value, uint64_t hash,
+		uint32_t count) {
+	uint64_t mask = sketch->sample_slots - 1;
+	// The low bits are the sampling ones, the slot comes from the high ones
+	uint64_t slot = (hash >> 32) & mask;
+	uint64_t *entry;
+
+	for (;; slot = (slot + 1) & mask) {
+		entry = &sketch->sample[slot];
+
+		if (*entry == 0) {
+			*entry = (uint64_t)value << 2 | (count > 1 ? 2 : 1);
+			sketch->sample_size++;
+			sketch->sample_once += count == 1;
+			return;
+		}
+
+		if ((*entry >> 2) == value) {
+			sketch->sample_once -= (*entry & 3) == 1;
+			*entry = (*entry & ~3ULL) | 2;
+			return;
+		}
+	}
+}
+
+/*
+ * Moves the sample into slots slots, dropping the values not sampled at the
+ * given, higher level. Returns 1 if the memory can't be allocated, the sample
+ * is left as it was.
+ */
+static int approx_sample_rebuild(struct approx_sketch *sketch, uint32_t level, uint64_t slots) {
+	uint64_t *old = sketch->sample;
+	uint64_t old_slots = sketch->sample_slots;
+	uint32_t value;
+	uint64_t i;
+
+	sketch->sample = calloc(slots, sizeof(uint64_t));
+	if (!sketch->sample) {
+		sketch->sample = old;
+		return 1;
+	}
+	sketch->level = level;
+	sketch->sample_slots = slots;
+	sketch->sample_size = 0;
+	sketch->sample_once = 0;
+
+	for (i = 0; i < old_slots; i++) {
+		value = old[i] >> 2;
+		if (old[i] && approx_sampled(approx_hash(value), level))
+			approx_sample_insert(sketch, value, approx_hash(value), old[i] & 3);
+	}
+
+	free(old);
+
+	return 0;
+}
+
+static inline int approx_sample_add(struct approx_sketch *sketch, uint32_t value, uint64_t hash,
+		uint32_t count) {
+	approx_sample_insert(sketch, value, hash, count);
+
+	// Halves the sample until it fits
+	while (sketch->sample_once > sketch->sample_capacity ||
+			sketch->sample_size > sketch->sample_capacity * APPROX_SAMPLE_SPREAD) {
+		if (approx_sample_rebuild(sketch, sketch->level + 1, sketch->sample_slots) != 0)
+			return 1;
+	}
+
+	if (sketch->sample_size * APPROX_SAMPLE_LOAD > sketch->sample_slots)
+		return approx_sample_rebuild(sketch, sketch->level, sketch->sample_slots * 2);
+
+	return 0;
+}
+
+/*
+ * Returns 1 if the sample can't be resized. The sketch can still be estimated
+ * or merged, but the sample may be over its bounds and the table fuller than
+ * it should be, it shouldn't take more numbers.
+ */
+int approx_add(struct approx_sketch *sketch, const uint32_t *values, uint64_t count) {
+	uint32_t precision = sketch->precision;
+	uint64_t hash, rest;
+	uint8_t rank;
+	uint64_t i;
+
+	for (i = 0; i < count; i++) {
+		hash = approx_hash(values[i]);
+
+		// A sentinel bit keeps the rank bounded when the rest of the hash is 0
+		rest = (hash << precision) | (1ULL << (precision - 1));
+		rank = __builtin_clzll(rest) + 1;
+		if (sketch->registers[hash >> (64 - precision)] < rank)
+			sketch->registers[hash >> (64 - precision)] = rank;
+
+		if (approx_sampled(hash, sketch->level) &&
+				approx_sample_add(sketch, values[i], hash, 1) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Merges src into dst, both must have been initialized with the same error.
+ * Returns 1 if the sample of dst can't be resized, as with approx_add().
+ */
+int approx_merge(struct approx_sketch *dst, struct approx_sketch *src) {
+	uint64_t i, value;
+
+	assert(dst->precision == src->precision);
+	assert(dst->sample_capacity == src->sample_capacity);
+
+	for (i = 0; i < (1ULL << dst->precision); i++) {
+		if (dst->registers[i] < src->registers[i])
+			dst->registers[i] = src->registers[i];
+	}
+
+	if (dst->level < src->level && approx_sample_rebuild(dst, src->level, dst->sample_slots) != 0)
+		return 1;
+
+	for (i = 0; i < src->sample_slots; i++) {
+		value = src->sample[i] >> 2;
+		if (src->sample[i] && approx_sampled(approx_hash(value), dst->level) &&
+				approx_sample_add(dst, value, approx_hash(value), src->sample[i] & 3) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* sigma and tau of the improved raw estimator, series summed until they converge */
+static double approx_sigma(double x) {
+	double y = 1, z = x, previous;
+
+	if (x == 1)
+		return INFINITY;
+
+	do {
+		x *= x;
+		previous = z;
+		z += x * y;
+		y *= 2;
+	} while (z != previous);
+
+	return z;
+}
+
+static double approx_tau(double x) {
+	double y = 1, z = 1 - x, previous;
+
+	if (x == 0 || x == 1)
+		return 0;
+
+	do {
+		x = sqrt(x);
+		previous = z;
+		y *= 0.5;
+		z -= (1 - x) * (1 - x) * y;
+	} while (z != previous);
+
+	return z / 3;
+}
+
+/*
+ * Estimates the number of unique values and of values seen only once, along
+ * with the relative standard error of both estimates.
+ */
+void approx_estimate(struct approx_sketch *sketch, uint64_t *unique, double *unique_error,
+		uint64_t *only_once, double *only_once_error) {
+	uint64_t registers = 1ULL << sketch->precision;
+	// Ranks go up to the bits below the register index plus one
+	uint32_t max_rank = 64 - sketch->precision + 1;
+	uint64_t ranks[64 + 1] = {}, sampled_once = sketch->sample_once, i;
+	double z;
+	int k;
+
+	for (i = 0; i < registers; i++)
+		ranks[sketch->registers[i]]++;
+
+	z = registers * approx_tau(1 - (double)ranks[max_rank] / registers);
+	for (k = max_rank - 1; k > 0; k--)
+		z = 0.5 * (z + ranks[k]);
+	z += registers * approx_sigma((double)ranks[0] / registers);
+
+	*unique = llround(registers * registers / (2 * M_LN2) / z);
+	*unique_error = APPROX_HLL_ERROR / sqrt(registers);
+
+	*only_once = sampled_once << sketch->level;
+	// At level 0 every value is in the sample and the count is exact
+	if (sketch->level == 0)
+		*only_once_error = 0;
+	else
+		*only_once_error = sampled_once ? 1 / sqrt(sampled_once) : 1;
+}
+
+#endif
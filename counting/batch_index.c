@@ -0,0 +1,253 @@
+#ifndef __BATCH_INDEX_C__
+#define __BATCH_INDEX_C__
+
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <immintrin.h>
+
+/*
+ * Kernels translating a batch of numbers into the id of their shard and the
+ * offset within it. The shard size isn't a power of two, so instead of the
+ * division the number is multiplied by magic = floor(2^32 / shard_size). The
+ * estimate is off by at most one, which is fixed up by comparing the
+ * remainder. The last shard extends up to COUNTING_MAX_INPUT, numbers past
+ * shards_count * shard_size are moved back into it.
+ *
+ * The best kernel for the CPU is chosen at runtime.
+ */
+
+enum index_isa {
+	INDEX_ISA_SCALAR,
+	INDEX_ISA_SSE42,
+	INDEX_ISA_AVX2,
+	INDEX_ISA_AVX512,
+	INDEX_ISA_MAX,
+};
+
+struct index_params {
+	uint32_t shard_size;
+	uint32_t magic;
+	uint32_t last_shard;
+};
+
+typedef void (*index_batch_fn)(const uint32_t *values, uint32_t count,
+		const struct index_params *params, uint32_t *shard_ids, uint32_t *offsets);
+
+void index_params_init(struct index_params *params, uint64_t shards_count, uint64_t shard_size) {
+	// The fix-up steps rely on the remainder never exceeding two shard sizes
+	assert(shard_size > shards_count);
+	assert(shard_size <= UINT32_MAX);
+
+	params->shard_size = shard_size;
+	params->magic = (1ULL << 32) / shard_size;
+	params->last_shard = shards_count - 1;
+}
+
+static void index_batch_scalar(const uint32_t *values, uint32_t count,
+		const struct index_params *params, uint32_t *shard_ids, uint32_t *offsets) {
+	uint32_t i, q, r;
+
+	for (i = 0; i < count; i++) {
+		q = ((uint64_t)values[i] * params->magic) >> 32;
+		r = values[i] - q * params->shard_size;
+
+		if (r >= params->shard_size) {
+			q++;
+			r -= params->shard_size;
+		}
+
+		if (q > params->last_shard) {
+			q--;
+			r += params->shard_size;
+		}
+
+		shard_ids[i] = q;
+		offsets[i] = r;
+	}
+}
+
+__attribute__((target("sse4.2")))
+static void index_batch_sse42(const uint32_t *values, uint32_t count,
+		const struct index_params *params, uint32_t *shard_ids, uint32_t *offsets) {
+	const __m128i magic = _mm_set1_epi32(params->magic);
+	const __m128i shard_size = _mm_set1_epi32(params->shard_size);
+	const __m128i last_shard = _mm_set1_epi32(params->last_shard);
+	__m128i v, even, odd, q, r, mask;
+	uint32_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		v = _mm_loadu_si128((const __m128i *)&values[i]);
+
+		// High halves of the 32x32 bit products, even and odd lanes separately
+		even = _mm_srli_epi64(_mm_mul_epu32(v, magic), 32);
+		odd = _mm_mul_epu32(_mm_srli_epi64(v, 32), magic);
+		q = _mm_blend_epi16(even, odd, 0xcc);
+
+		r = _mm_sub_epi32(v, _mm_mullo_epi32(q, shard_size));
+
+		mask = _mm_cmpeq_epi32(_mm_max_epu32(r, shard_size), r);
+		q = _mm_sub_epi32(q, mask);
+		r = _mm_sub_epi32(r, _mm_and_si128(mask, shard_size));
+
+		mask = _mm_cmpgt_epi32(q, last_shard);
+		q = _mm_add_epi32(q, mask);
+		r = _mm_add_epi32(r, _mm_and_si128(mask, shard_size));
+
+		_mm_storeu_si128((__m128i *)&shard_ids[i], q);
+		_mm_storeu_si128((__m128i *)&offsets[i], r);
+	}
+
+	index_batch_scalar(&values[i], count - i, params, &shard_ids[i], &offsets[i]);
+}
+
+__attribute__((target("avx2")))
+static void index_batch_avx2(const uint32_t *values, uint32_t count,
+		const struct index_params *params, uint32_t *shard_ids, uint32_t *offsets) {
+	const __m256i magic = _mm256_set1_epi32(params->magic);
+	const __m256i shard_size = _mm256_set1_epi32(params->shard_size);
+	const __m256i last_shard = _mm256_set1_epi32(params->last_shard);
+	__m256i v, even, odd, q, r, mask;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		v = _mm256_loadu_si256((const __m256i *)&values[i]);
+
+		even = _mm256_srli_epi64(_mm256_mul_epu32(v, magic), 32);
+		odd = _mm256_mul_epu32(_mm256_srli_epi64(v, 32), magic);
+		q = _mm256_blend_epi32(even, odd, 0xaa);
+
+		r = _mm256_sub_epi32(v, _mm256_mullo_epi32(q, shard_size));
+
+		mask = _mm256_cmpeq_epi32(_mm256_max_epu32(r, shard_size), r);
+		q = _mm256_sub_epi32(q, mask);
+		r = _mm256_sub_epi32(r, _mm256_and_si256(mask, shard_size));
+
+		mask = _mm256_cmpgt_epi32(q, last_shard);
+		q = _mm256_add_epi32(q, mask);
+		r = _mm256_add_epi32(r, _mm256_and_si256(mask, shard_size));
+
+		_mm256_storeu_si256((__m256i *)&shard_ids[i], q);
+		_mm256_storeu_si256((__m256i *)&offsets[i], r);
+	}
+
+	index_batch_scalar(&values[i], count - i, params, &shard_ids[i], &offsets[i]);
+}
+
+__attribute__((target("avx512f")))
+static void index_batch_avx512(const uint32_t *values, uint32_t count,
+		const struct index_params *params, uint32_t *shard_ids, uint32_t *offsets) {
+	const __m512i magic = _mm512_set1_epi32(params->magic);
+	const __m512i shard_size = _mm512_set1_epi32(params->shard_size);
+	const __m512i last_shard = _mm512_set1_epi32(params->last_shard);
+	const __m512i one = _mm512_set1_epi32(1);
+	__m512i v, even, odd, q, r;
+	__mmask16 mask;
+	uint32_t i;
+
+	for (i = 0; i + 16 <= count; i += 16) {
+		v = _mm512_loadu_si512(&values[i]);
+
+		even = _mm512_srli_epi64(_mm512_mul_epu32(v, magic), 32);
+		odd = _mm512_mul_epu32(_mm512_srli_epi64(v, 32), magic);
+		q = _mm512_mask_blend_epi32(0xaaaa, even, odd);
+
+		r = _mm512_sub_epi32(v, _mm512_mullo_epi32(q, shard_size));
+
+		mask = _mm512_cmpge_epu32_mask(r, shard_size);
+		q = _mm512_mask_add_epi32(q, mask, q, one);
+		r = _mm512_mask_sub_epi32(r, mask, r, shard_size);
+
+		mask = _mm512_cmpgt_epu32_mask(q, last_shard);
+		q = _mm512_mask_sub_epi32(q, mask, q, one);
+		r = _mm512_mask_add_epi32(r, mask, r, shard_size);
+
+		_mm512_storeu_si512(&shard_ids[i], q);
+		_mm512_storeu_si512(&offsets[i], r);
+	}
+
+	index_batch_scalar(&values[i], count - i, params, &shard_ids[i], &offsets[i]);
+}
+
+static const char *index_isa_names[INDEX_ISA_MAX] = {
+	[INDEX_ISA_SCALAR] = "scalar",
+	[INDEX_ISA_SSE42] = "sse4.2",
+	[INDEX_ISA_AVX2] = "avx2",
+	[INDEX_ISA_AVX512] = "avx512",
+};
+
+static const index_batch_fn index_kernels[INDEX_ISA_MAX] = {
+	[INDEX_ISA_SCALAR] = index_batch_scalar,
+	[INDEX_ISA_SSE42] = index_batch_sse42,
+	[INDEX_ISA_AVX2] = index_batch_avx2,
+	[INDEX_ISA_AVX512] = index_batch_avx512,
+};
+
+static enum index_isa index_selected_isa = INDEX_ISA_MAX;
+
+int index_isa_supported(enum index_isa isa) {
+	__builtin_cpu_init();
+
+	switch (isa) {
+	case INDEX_ISA_SCALAR:
+		return 1;
+	case INDEX_ISA_SSE42:
+		return __builtin_cpu_supports("sse4.2");
+	case INDEX_ISA_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case INDEX_ISA_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		return 0;
+	}
+}
+
+/* Forces the given kernel, returns 1 if the CPU doesn't support it */
+int index_select(enum index_isa isa) {
+	if (isa >= INDEX_ISA_MAX || !index_isa_supported(isa))
+		return 1;
+
+	index_selected_isa = isa;
+
+	return 0;
+}
+
+enum index_isa index_get_isa(void) {
+	int isa;
+
+	if (index_selected_isa != INDEX_ISA_MAX)
+		return index_selected_isa;
+
+	for (isa = INDEX_ISA_MAX - 1; isa > INDEX_ISA_SCALAR; isa--) {
+		if (index_isa_supported(isa))
+			break;
+	}
+	index_selected_isa = isa;
+
+	return index_selected_isa;
+}
+
+const char *index_isa_name(enum index_isa isa) {
+	assert(isa < INDEX_ISA_MAX);
+
+	return index_isa_names[isa];
+}
+
+/* Returns INDEX_ISA_MAX if there is no kernel with the given name */
+enum index_isa index_isa_from_name(const char *name) {
+	int i;
+
+	for (i = 0; i < INDEX_ISA_MAX; i++) {
+		if (strcmp(name, index_isa_names[i]) == 0)
+			return i;
+	}
+
+	return INDEX_ISA_MAX;
+}
+
+void index_batch(const uint32_t *values, uint32_t count, const struct index_params *params,
+		uint32_t *shard_ids, uint32_t *offsets) {
+	index_kernels[index_get_isa()](values, count, params, shard_ids, offsets);
+}
+
+#endif
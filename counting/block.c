@@ -0,0 +1,370 @@
+#ifndef __BLOCK_C__
+#define __BLOCK_C__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <immintrin.h>
+
+/*
+ * Compressed input format. The file is a sequence of BLOCK_BYTES blocks, only
+ * the last one may be shorter, so a worker can start at any multiple of the
+ * block size. A block holds a header and the zigzag encoded differences of its
+ * numbers, the first one is the base and its difference is 0. The differences
+ * are either packed with the bit width of the largest one or stored as LEB128
+ * varints, whichever takes more numbers into the block.
+ *
+ * The packed differences are laid out in BLOCK_LANES lanes: difference i goes
+ * to lane i % BLOCK_LANES, every lane packs its differences into 32-bit words
+ * starting from the lowest bit and word k of lane l is word
+ * k * BLOCK_LANES + l of the payload. The AVX2 decoder unpacks a row of 8
+ * differences with a shift and a mask, then decodes and sums them up in the
+ * vector. It's picked at runtime if the CPU supports it.
+ *
+ * The header carries a CRC32C of itself and the payload, so a corrupted block
+ * is rejected instead of decoding into wrong numbers. It's computed with the
+ * crc32 instruction of SSE4.2 if the CPU supports it.
+ */
+
+#define BLOCK_BYTES (64 * 1024)
+#define BLOCK_MAGIC 0x424e5443
+// Blocks of version 0 had no checksum
+#define BLOCK_VERSION 1
+#define BLOCK_LANES 8
+// Numbers of a block at most, a multiple of the lanes
+#define BLOCK_MAX_VALUES (1U << 18)
+
+enum block_encoding {
+	BLOCK_ENCODING_PACKED,
+	BLOCK_ENCODING_VARINT,
+	BLOCK_ENCODING_MAX,
+};
+
+struct block_header {
+	uint32_t magic;
+	uint32_t count;
+	uint32_t base;
+	uint8_t encoding;
+	// Width of the packed differences, 0 to 32
+	uint8_t bits;
+	uint16_t version;
+	uint32_t payload_size;
+	// CRC32C of the header with the checksum zeroed and of the payload
+	uint32_t checksum;
+};
+
+#define BLOCK_PAYLOAD_SIZE (BLOCK_BYTES - sizeof(struct block_header))
+
+static inline uint32_t block_zigzag(uint32_t value, uint32_t previous) {
+	int32_t delta = (int32_t)(value - previous);
+
+	return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+}
+
+static inline uint32_t block_width(uint32_t value) {
+	return value ? 32 - __builtin_clz(value) : 0;
+}
+
+static inline uint32_t block_varint_size(uint32_t value) {
+	return value < (1U << 7) ? 1 : value < (1U << 14) ? 2 : value < (1U << 21) ? 3 :
+		value < (1U << 28) ? 4 : 5;
+}
+
+#define BLOCK_CRC32C_POLYNOMIAL 0x82f63b78
+
+static uint32_t block_crc32c_scalar(uint32_t crc, const uint8_t *data, uint64_t size) {
+	uint64_t i;
+	int bit;
+
+	for (i = 0; i < size; i++) {
+		crc ^= data[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (BLOCK_CRC32C_POLYNOMIAL & -(crc & 1));
+	}
+
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t block_crc32c_sse42(uint32_t crc, const uint8_t *data, uint64_t size) {
+	uint64_t word, wide = crc, i;
+
+	for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+		memcpy(&word, &data[i], sizeof(word));
+		wide = _mm_crc32_u64(wide, word);
+	}
+	crc = wide;
+
+	for (; i < size; i++)
+		crc = _mm_crc32_u8(crc, data[i]);
+
+	return crc;
+}
+
+/* Checksum of the block whose header says how large its payload is */
+static uint32_t block_checksum(const char *block) {
+	uint32_t (*crc32c)(uint32_t, const uint8_t *, uint64_t) = block_crc32c_scalar;
+	struct block_header header;
+	uint32_t crc = UINT32_MAX;
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c = block_crc32c_sse42;
+
+	memcpy(&header, block, sizeof(header));
+	header.checksum = 0;
+
+	crc = crc32c(crc, (const uint8_t *)&header, sizeof(header));
+	crc = crc32c(crc, (const uint8_t *)block + sizeof(header), header.payload_size);
+
+	return ~crc;
+}
+
+/* Bytes of count packed differences of the given width */
+static inline uint64_t block_packed_size(uint64_t count, uint32_t bits) {
+	uint64_t rows = (count + BLOCK_LANES - 1) / BLOCK_LANES;
+
+	return (rows * bits + 31) / 32 * BLOCK_LANES * sizeof(uint32_t);
+}
+
+static void block_pack(const uint32_t *values, uint32_t count, uint32_t bits, uint32_t *words) {
+	uint32_t i, lane, offset, zigzag, previous = values[0];
+	uint64_t position;
+
+	memset(words, 0, block_packed_size(count, bits));
+	if (bits == 0)
+		return;
+
+	for (i = 0; i < count; i++) {
+		zigzag = block_zigzag(values[i], previous);
+		previous = values[i];
+
+		lane = i % BLOCK_LANES;
+		position = (uint64_t)(i / BLOCK_LANES) * bits;
+		offset = position % 32;
+
+		words[position / 32 * BLOCK_LANES + lane] |= zigzag << offset;
+		if (offset + bits > 32)
+			words[(position / 32 + 1) * BLOCK_LANES + lane] |= zigzag >> (32 - offset);
+	}
+}
+
+static uint32_t block_varint(const uint32_t *values, uint32_t count, uint8_t *payload) {
+	uint32_t i, zigzag, size = 0, previous = values[0];
+
+	for (i = 0; i < count; i++) {
+		zigzag = block_zigzag(values[i], previous);
+		previous = values[i];
+
+		while (zigzag >= 0x80) {
+			payload[size++] = (zigzag & 0x7f) | 0x80;
+			zigzag >>= 7;
+		}
+		payload[size++] = zigzag;
+	}
+
+	return size;
+}
+
+/*
+ * Encodes as many of the count numbers as fit into a block and returns how
+ * many it took, at least one. The block takes the header size plus the
+ * payload_size of the header.
+ */
+uint32_t block_encode(const uint32_t *values, uint64_t count, char *block) {
+	struct block_header *header = (struct block_header *)block;
+	uint32_t packed = 0, varint = 0, bits = 0, packed_bits = 0;
+	uint64_t varint_size = 0;
+	uint32_t i, zigzag, width;
+
+	// The longest prefixes fitting in either encoding
+	for (i = 0; i < count && i < BLOCK_MAX_VALUES; i++) {
+		zigzag = i ? block_zigzag(values[i], values[i - 1]) : 0;
+
+		width = block_width(zigzag);
+		bits = width > bits ? width : bits;
+		if (packed == i && block_packed_size(i + 1, bits) <= BLOCK_PAYLOAD_SIZE) {
+			packed = i + 1;
+			packed_bits = bits;
+		}
+
+		varint_size += block_varint_size(zigzag);
+		if (varint == i && varint_size <= BLOCK_PAYLOAD_SIZE)
+			varint = i + 1;
+
+		if (packed <= i && varint <= i)
+			break;
+	}
+
+	memset(header, 0, sizeof(*header));
+	header->magic = BLOCK_MAGIC;
+	header->version = BLOCK_VERSION;
+	header->base = values[0];
+
+	// The packed ones decode faster
+	if (packed >= varint) {
+		header->count = packed;
+		header->encoding = BLOCK_ENCODING_PACKED;
+		header->bits = packed_bits;
+		header->payload_size = block_packed_size(packed, packed_bits);
+		block_pack(values, packed, packed_bits, (uint32_t *)(block + sizeof(*header)));
+	} else {
+		header->count = varint;
+		header->encoding = BLOCK_ENCODING_VARINT;
+		header->payload_size = block_varint(values, varint,
+				(uint8_t *)(block + sizeof(*header)));
+	}
+	header->checksum = block_checksum(block);
+
+	return header->count;
+}
+
+static inline uint32_t block_unzigzag(uint32_t zigzag) {
+	return (zigzag >> 1) ^ -(zigzag & 1);
+}
+
+static void block_unpack_scalar(const uint32_t *words, uint32_t count, uint32_t bits,
+		uint32_t base, uint32_t *values) {
+	uint32_t mask = bits == 32 ? UINT32_MAX : (1U << bits) - 1;
+	uint32_t i, lane, offset, zigzag;
+	uint64_t position;
+
+	for (i = 0; i < count; i++) {
+		zigzag = 0;
+
+		if (bits > 0) {
+			lane = i % BLOCK_LANES;
+			position = (uint64_t)(i / BLOCK_LANES) * bits;
+			offset = position % 32;
+
+			zigzag = words[position / 32 * BLOCK_LANES + lane] >> offset;
+			if (offset + bits > 32)
+				zigzag |= words[(position / 32 + 1) * BLOCK_LANES + lane] << (32 - offset);
+			zigzag &= mask;
+		}
+
+		base += block_unzigzag(zigzag);
+		values[i] = base;
+	}
+}
+
+/* Decodes whole rows, values must have room for count rounded up to the lanes */
+__attribute__((target("avx2")))
+static void block_unpack_avx2(const uint32_t *words, uint32_t count, uint32_t bits,
+		uint32_t base, uint32_t *values) {
+	const __m256i mask = _mm256_set1_epi32(bits == 32 ? UINT32_MAX : (1U << bits) - 1);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i last = _mm256_set1_epi32(7);
+	const __m256i fourth = _mm256_set1_epi32(3);
+	uint32_t rows = (count + BLOCK_LANES - 1) / BLOCK_LANES;
+	uint32_t words_count = ((uint64_t)rows * bits + 31) / 32;
+	__m256i current = zero, next, v, sum = _mm256_set1_epi32(base);
+	uint32_t row, word = 0, offset = 0;
+
+	if (bits > 0)
+		current = _mm256_loadu_si256((const __m256i *)words);
+
+	for (row = 0; row < rows; row++) {
+		v = zero;
+
+		if (bits > 0) {
+			v = _mm256_srl_epi32(current, _mm_cvtsi32_si128(offset));
+			offset += bits;
+
+			if (offset >= 32) {
+				offset -= 32;
+				if (++word < words_count) {
+					next = _mm256_loadu_si256((const __m256i *)&words[word * BLOCK_LANES]);
+					if (offset > 0) {
+						v = _mm256_or_si256(v, _mm256_sll_epi32(next,
+									_mm_cvtsi32_si128(bits - offset)));
+					}
+					current = next;
+				}
+			}
+			v = _mm256_and_si256(v, mask);
+		}
+
+		v = _mm256_xor_si256(_mm256_srli_epi32(v, 1),
+				_mm256_sub_epi32(zero, _mm256_and_si256(v, one)));
+
+		// Prefix sums of both halves, then the low half is carried into the high one
+		v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+		v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+		v = _mm256_add_epi32(v, _mm256_blend_epi32(zero,
+					_mm256_permutevar8x32_epi32(v, fourth), 0xf0));
+
+		v = _mm256_add_epi32(v, sum);
+		sum = _mm256_permutevar8x32_epi32(v, last);
+
+		_mm256_storeu_si256((__m256i *)&values[row * BLOCK_LANES], v);
+	}
+}
+
+static int block_decode_varint(const uint8_t *payload, uint32_t size, uint32_t count,
+		uint32_t base, uint32_t *values) {
+	uint32_t i, zigzag, shift, position = 0;
+
+	for (i = 0; i < count; i++) {
+		zigzag = 0;
+		for (shift = 0; ; shift += 7) {
+			if (position == size || shift > 28)
+				return 1;
+
+			zigzag |= (uint32_t)(payload[position] & 0x7f) << shift;
+			if (!(payload[position++] & 0x80))
+				break;
+		}
+
+		base += block_unzigzag(zigzag);
+		values[i] = base;
+	}
+
+	return position != size;
+}
+
+/*
+ * Decodes the block of size bytes into values, which must have room for
+ * BLOCK_MAX_VALUES numbers, and stores how many there were to *count. Returns
+ * 1 if it isn't a valid block or its checksum doesn't match.
+ */
+int block_decode(const char *block, uint64_t size, uint32_t *values, uint32_t *count) {
+	struct block_header header;
+
+	if (size < sizeof(header))
+		return 1;
+	memcpy(&header, block, sizeof(header));
+
+	if (header.magic != BLOCK_MAGIC || header.version != BLOCK_VERSION ||
+			header.count > BLOCK_MAX_VALUES || header.payload_size > size - sizeof(header) ||
+			header.encoding >= BLOCK_ENCODING_MAX)
+		return 1;
+
+	if (block_checksum(block) != header.checksum)
+		return 1;
+
+	*count = header.count;
+
+	if (header.encoding == BLOCK_ENCODING_VARINT) {
+		return block_decode_varint((const uint8_t *)block + sizeof(header),
+				header.payload_size, header.count, header.base, values);
+	}
+
+	if (header.bits > 32 || header.payload_size != block_packed_size(header.count, header.bits))
+		return 1;
+
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		block_unpack_avx2((const uint32_t *)(block + sizeof(header)), header.count,
+				header.bits, header.base, values);
+	} else {
+		block_unpack_scalar((const uint32_t *)(block + sizeof(header)), header.count,
+				header.bits, header.base, values);
+	}
+
+	return 0;
+}
+
+#endif
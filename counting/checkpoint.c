@@ -0,0 +1,209 @@
+#ifndef __CHECKPOINT_C__
+#define __CHECKPOINT_C__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "counting.h"
+
+/*
+ * Checkpoints of the bitmaps of the split, interleaved and counters layouts.
+ * The file starts with a header, the bitmaps follow at a page boundary laid
+ * out the same way as the region of the mapped allocation strategies, so a
+ * checkpoint is loaded by mapping it privately, the pages are read in on the
+ * first access. Blocks of the bitmaps which are all zeroes are left as holes.
+ * A checkpoint is written to a temporary file which replaces the previous
+ * one, a crash while writing it leaves the previous one intact.
+ */
+
+#define CHECKPOINT_MAGIC "CNTCKPT"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_DATA_OFFSET 4096
+#define CHECKPOINT_BLOCK_SIZE (64 * 1024)
+
+struct checkpoint_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t layout;
+	uint32_t counter_bits;
+	uint32_t shards_count;
+	uint64_t shard_size;
+	// Size of the input and the bytes of it already counted, always a prefix
+	uint64_t input_size;
+	uint64_t consumed;
+	// Bytes of the bitmaps following the header
+	uint64_t data_size;
+};
+
+/* Size of the bitmaps of the shards described by the header */
+static uint64_t checkpoint_data_size(struct checkpoint_header *header) {
+	struct tree_owner shard = {
+		.layout = header->layout,
+		.counter_bits = header->counter_bits,
+	};
+	uint64_t i, size = 0;
+
+	for (i = 0; i < header->shards_count; i++) {
+		shard.shard_range_min = header->shard_size * i;
+		shard.shard_range_max = i + 1 < header->shards_count ?
+			header->shard_size * (i + 1) - 1 : COUNTING_MAX_INPUT;
+		size += counting_mapping_size(counting_words(&shard));
+	}
+
+	return size;
+}
+
+/* Writes the non-zero blocks of the bitmap at the given offset of the data */
+static int checkpoint_write_bitmap(int fd, const uint64_t *bitmap, uint64_t words, uint64_t offset) {
+	const char *bytes = (const char *)bitmap;
+	uint64_t size = words * sizeof(uint64_t);
+	uint64_t position, block, i;
+	ssize_t written;
+
+	for (position = 0; position < size; position += block) {
+		block = size - position < CHECKPOINT_BLOCK_SIZE ? size - position : CHECKPOINT_BLOCK_SIZE;
+
+		for (i = 0; i < block / sizeof(uint64_t); i++) {
+			if (bitmap[position / sizeof(uint64_t) + i])
+				break;
+		}
+		if (i == block / sizeof(uint64_t))
+			continue;
+
+		written = pwrite(fd, bytes + position, block, CHECKPOINT_DATA_OFFSET + offset + position);
+		if (written != (ssize_t)block)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Saves the bitmaps of the shards, consumed bytes of the input of input_size
+ * bytes must have been counted into them. The shards must not change until it
+ * returns. Returns 1 if the checkpoint can't be written.
+ */
+int checkpoint_save(const char *path, struct tree_owner ctx[], uint32_t shards_count,
+		uint64_t input_size, uint64_t consumed) {
+	struct checkpoint_header header = {
+		.magic = CHECKPOINT_MAGIC,
+		.version = CHECKPOINT_VERSION,
+		.layout = ctx[0].layout,
+		.counter_bits = ctx[0].counter_bits,
+		.shards_count = shards_count,
+		.shard_size = ctx[0].index.shard_size,
+		.input_size = input_size,
+		.consumed = consumed,
+		.data_size = counting_region_size(ctx, shards_count),
+	};
+	char tmp_path[4096];
+	uint64_t offset = 0, cells;
+	uint32_t i;
+	int fd, res = 0;
+
+	if (ctx[0].layout == COUNTING_LAYOUT_ADAPTIVE)
+		return 1;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	fd = open(tmp_path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0)
+		return 1;
+
+	if (ftruncate(fd, CHECKPOINT_DATA_OFFSET + header.data_size) != 0)
+		res = 1;
+
+	for (i = 0; i < shards_count && res == 0; i++) {
+		cells = counting_cells(&ctx[i]);
+
+		res = checkpoint_write_bitmap(fd, ctx[i].added_once, cells, offset);
+		// The second bitmap of the split layout follows the first one
+		if (res == 0 && ctx[i].layout == COUNTING_LAYOUT_SPLIT)
+			res = checkpoint_write_bitmap(fd, ctx[i].added_twice, cells,
+					offset + cells * sizeof(uint64_t));
+
+		offset += counting_mapping_size(counting_words(&ctx[i]));
+	}
+
+	if (res == 0 && pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+		res = 1;
+	if (res == 0 && fsync(fd) != 0)
+		res = 1;
+	if (close(fd) != 0)
+		res = 1;
+
+	if (res == 0 && rename(tmp_path, path) != 0)
+		res = 1;
+	if (res != 0)
+		unlink(tmp_path);
+
+	return res;
+}
+
+/* Reads and checks the header of the checkpoint, returns 1 if it isn't a valid one */
+int checkpoint_read_header(const char *path, struct checkpoint_header *header) {
+	struct stat st;
+	int fd, res = 1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) || fstat(fd, &st) != 0)
+		goto close_file;
+
+	if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != CHECKPOINT_VERSION)
+		goto close_file;
+
+	if (header->layout >= COUNTING_LAYOUT_MAX || header->layout == COUNTING_LAYOUT_ADAPTIVE ||
+			(header->counter_bits != 2 && header->counter_bits != 4 &&
+			 header->counter_bits != 8) ||
+			header->shards_count < 1 || header->shards_count > COUNTING_MAX_SHARDS ||
+			header->shard_size != COUNTING_MAX_INPUT / header->shards_count ||
+			header->consumed > header->input_size)
+		goto close_file;
+
+	if (header->data_size != checkpoint_data_size(header) ||
+			(uint64_t)st.st_size < CHECKPOINT_DATA_OFFSET + header->data_size)
+		goto close_file;
+
+	res = 0;
+
+close_file:
+	close(fd);
+
+	return res;
+}
+
+/*
+ * Maps the bitmaps of the checkpoint into the shards, which must be an array
+ * of header->shards_count entries. The pages are copied on the first write, the
+ * file doesn't change. Returns 1 if it can't be mapped or the shards can't be
+ * allocated.
+ */
+int checkpoint_load(const char *path, struct checkpoint_header *header, struct tree_owner ctx[]) {
+	void *region;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	region = mmap(NULL, header->data_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+			CHECKPOINT_DATA_OFFSET);
+	close(fd);
+	if (region == MAP_FAILED)
+		return 1;
+
+	// The region is unmapped if the shards can't be prepared
+	return prepare_shards_region(ctx, header->shards_count, header->shard_size,
+			header->layout, header->counter_bits, region);
+}
+
+#endif
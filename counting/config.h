@@ -0,0 +1,17 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+/*
+ * Defaults of the counting tool, used when -t and -s aren't given. Both can be
+ * overridden at build time with -DTHREAD_COUNT=... and -DSHARDS=...
+ */
+
+#ifndef THREAD_COUNT
+#define THREAD_COUNT 4
+#endif
+
+#ifndef SHARDS
+#define SHARDS 16
+#endif
+
+#endif
@@ -1,20 +1,96 @@
 #ifndef __COUNTING_H__
 #define __COUNTING_H__
+// MAP_ANONYMOUS and the huge page flags of the allocator aren't POSIX
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include <stdint.h>
 #include <assert.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include "config.h"
+#include "popcount.c"
+#include "batch_index.c"
+#include "adaptive.c"
+#include "histogram.c"
+#include "sets.c"
 
 #define COUNTING_MAX_INPUT (0xffffffffUL)
 #define SHARD_SIZE (COUNTING_MAX_INPUT / SHARDS)
+// The shard size must stay above the shards count, see index_params_init()
+#define COUNTING_MAX_SHARDS 65535
+
+/*
+ * How the "seen once" and "seen twice" bits are stored.
+ *
+ * COUNTING_LAYOUT_SPLIT keeps them in two separate bitmaps, added_once and
+ * added_twice. COUNTING_LAYOUT_INTERLEAVED stores both bits of a value next to
+ * each other in the same 64-bit word (bit 2n is "seen once" and bit 2n + 1 is
+ * "seen twice"), so checking and updating a value touches a single cache line.
+ * In the latter case added_once and added_twice point to the same array.
+ *
+ * COUNTING_LAYOUT_ADAPTIVE doesn't allocate the bitmaps upfront. Every 2^16
+ * values of a shard are kept in a container (see adaptive.c) which is a sorted
+ * array while sparse and an interleaved bitmap once dense, so the memory
+ * follows the input instead of the 2^32 domain. added_once and added_twice
+ * are NULL then.
+ *
+ * COUNTING_LAYOUT_COUNTERS keeps a saturating counter of counter_bits (2, 4 or
+ * 8) bits per value instead of the two bits, so the finalized shard also has
+ * the histogram of how many values were seen exactly k times. The counters are
+ * packed into added_once, added_twice points to the same array.
+ */
+enum counting_layout {
+	COUNTING_LAYOUT_SPLIT,
+	COUNTING_LAYOUT_INTERLEAVED,
+	COUNTING_LAYOUT_ADAPTIVE,
+	COUNTING_LAYOUT_COUNTERS,
+	COUNTING_LAYOUT_MAX,
+};
+
+#define COUNTING_DEFAULT_COUNTER_BITS 4
+#define COUNTING_MAX_COUNTER_BITS 8
+
+/*
+ * Where the bitmaps of the split and interleaved layouts come from.
+ *
+ * COUNTING_ALLOC_CALLOC allocates every bitmap separately. COUNTING_ALLOC_THP
+ * reserves one contiguous region for all of them with mmap(MAP_NORESERVE),
+ * aligned to and advised for transparent huge pages, so the random accesses
+ * take far fewer TLB misses. COUNTING_ALLOC_HUGETLB maps the region from the
+ * explicit 2 MB huge page pool and falls back to COUNTING_ALLOC_THP if the pool
+ * is too small. In both mapped cases every shard takes a 2 MB aligned slice
+ * and the memory is only faulted in on the first access, see
+ * counting_first_touch().
+ *
+ * COUNTING_ALLOC_FILE is a private mapping of a checkpoint laid out the same
+ * way, see prepare_shards_region(). It can't be requested by name.
+ */
+enum counting_alloc {
+	COUNTING_ALLOC_CALLOC,
+	COUNTING_ALLOC_THP,
+	COUNTING_ALLOC_HUGETLB,
+	COUNTING_ALLOC_FILE,
+	COUNTING_ALLOC_MAX,
+};
+
+#define COUNTING_HUGE_PAGE_SIZE (2ULL << 20)
 
 struct tree_owner {
+	/*
+	 * Computed from the bitmaps by counting_finalize(), the engines don't
+	 * maintain them. "stale" is set once the bitmaps change afterwards.
+	 */
 	uint64_t elements_in_map;
 	uint64_t repeated_elements;
+	int stale;
 
 	uint64_t shard_range_min;
 	uint64_t shard_range_max;
@@ -22,18 +98,64 @@ struct tree_owner {
 	uint64_t *added_once;
 	uint64_t *added_twice;
 
+	struct adaptive_container *containers;
+	uint64_t containers_count;
+
+	enum counting_alloc alloc;
+	// Size of the slice of the mapped region starting at added_once
+	uint64_t mapping_size;
+
+	enum counting_layout layout;
+
+	// Width of the counters of the counters layout, a power of two
+	uint32_t counter_bits;
+	// Computed by counting_finalize() in the counters layout, 1 << counter_bits buckets
+	uint64_t *histogram;
+
+	// Same in every shard, lets the engines compute shard ids in batches
+	struct index_params index;
+
 	pthread_rwlock_t lock;
 
 	pthread_rwlock_t visited_lock;
+
+	// Position in the shards array, indexes the per-shard statistics
+	uint32_t id;
 };
 
+/*
+ * Statistics of a single worker, collected while a thread is attached to them
+ * with counting_stats_attach(). The counters are plain thread-local fields, so
+ * they cost a branch per number when detached and an increment when attached.
+ * The lock wait time is only measured when the rwlock was taken by someone
+ * else already, the uncontended path only tries the lock once.
+ */
+struct counting_shard_stats {
+	uint64_t values;
+	uint64_t lock_acquisitions;
+	uint64_t lock_contended;
+	uint64_t lock_wait_ns;
+};
+
+struct counting_stats {
+	// Numbers which didn't need to change the bitmaps, seen twice already
+	uint64_t fast_path;
+	// Numbers which were recorded for the first or the second time
+	uint64_t slow_path;
+	uint64_t shards_count;
+	struct counting_shard_stats *shards;
+};
+
+static __thread struct counting_stats *counting_thread_stats;
+
 struct tree_owner *get_shard(struct tree_owner ctx[], uint64_t number) {
-	uint64_t shard_id = number / SHARD_SIZE;
+	uint64_t shard_id = number / ctx[0].index.shard_size;
+	uint64_t last_shard = ctx[0].index.last_shard;
 	struct tree_owner *tmp;
 
-	if (shard_id == SHARDS) {
-		assert(number >= ctx[SHARDS - 1].shard_range_min);
-		shard_id = SHARDS - 1;
+	if (shard_id > last_shard) {
+		assert(number >= ctx[last_shard].shard_range_min);
+		shard_id = last_shard;
 	}
 
 	tmp = &ctx[shard_id];
@@ -47,20 +169,159 @@ struct tree_owner *get_shard(struct tree_owner ctx[], uint64_t number) {
 	return tmp;
 }
 
-void prepare_shards(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size) {
+/*
+ * Number of 64-bit words of the bitmap(s) of a shard, 0 in the adaptive layout.
+ * In the split layout it's the size of each of the two bitmaps.
+ */
+uint64_t counting_cells(struct tree_owner *shard) {
+	uint64_t cells = (shard->shard_range_max - shard->shard_range_min) / 64 + 1;
+
+	if (shard->layout == COUNTING_LAYOUT_ADAPTIVE)
+		return 0;
+
+	if (shard->layout == COUNTING_LAYOUT_INTERLEAVED)
+		cells *= 2;
+	else if (shard->layout == COUNTING_LAYOUT_COUNTERS)
+		cells *= shard->counter_bits;
+
+	return cells;
+}
+
+/* Words taken by all the bitmaps of a shard */
+static uint64_t counting_words(struct tree_owner *shard) {
+	if (shard->layout == COUNTING_LAYOUT_SPLIT)
+		return 2 * counting_cells(shard);
+
+	return counting_cells(shard);
+}
+
+static uint64_t counting_mapping_size(uint64_t words) {
+	return (words * sizeof(uint64_t) + COUNTING_HUGE_PAGE_SIZE - 1) & ~(COUNTING_HUGE_PAGE_SIZE - 1);
+}
+
+/*
+ * Reserves a huge page aligned region, *alloc is updated if the huge page pool
+ * can't be used. Returns NULL if it can't be reserved.
+ */
+static char *counting_map_region(uint64_t size, enum counting_alloc *alloc) {
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	char *region, *aligned;
+
+	if (*alloc == COUNTING_ALLOC_HUGETLB) {
+		// Without MAP_NORESERVE, so that a short pool fails here and not with SIGBUS later
+		region = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+		if (region != MAP_FAILED)
+			return region;
+
+		*alloc = COUNTING_ALLOC_THP;
+	}
+
+	region = mmap(NULL, size + COUNTING_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			flags | MAP_NORESERVE, -1, 0);
+	if (region == MAP_FAILED)
+		return NULL;
+
+	aligned = (char *)(((uintptr_t)region + COUNTING_HUGE_PAGE_SIZE - 1) &
+			~(COUNTING_HUGE_PAGE_SIZE - 1));
+	if (aligned != region)
+		munmap(region, aligned - region);
+	if (aligned - region != COUNTING_HUGE_PAGE_SIZE)
+		munmap(aligned + size, COUNTING_HUGE_PAGE_SIZE - (aligned - region));
+
+	madvise(aligned, size, MADV_HUGEPAGE);
+
+	return aligned;
+}
+
+/* Size of the region taking the bitmaps of the mapped allocation strategies */
+uint64_t counting_region_size(struct tree_owner ctx[], uint64_t shards_count) {
+	uint64_t i, size = 0;
+
+	for (i = 0; i < shards_count; i++)
+		size += counting_mapping_size(counting_words(&ctx[i]));
+
+	return size;
+}
+
+void destroy_shards(struct tree_owner ctx[], uint64_t shards_count) {
+	uint64_t i, j;
+
+	for (i = 0; i < shards_count; i++) {
+		assert(pthread_rwlock_destroy(&ctx[i].lock) == 0);
+		assert(pthread_rwlock_destroy(&ctx[i].visited_lock) == 0);
+
+		for (j = 0; j < ctx[i].containers_count; j++)
+			adaptive_free(&ctx[i].containers[j]);
+		free(ctx[i].containers);
+		free(ctx[i].histogram);
+
+		// Every shard unmaps its own slice of the region
+		if (ctx[i].alloc != COUNTING_ALLOC_CALLOC) {
+			munmap(ctx[i].added_once, ctx[i].mapping_size);
+			continue;
+		}
+
+		if (ctx[i].added_twice != ctx[i].added_once)
+			free(ctx[i].added_twice);
+		free(ctx[i].added_once);
+	}
+
+}
+
+/*
+ * Returns 1 if the bitmaps can't be allocated, the shards are destroyed then and
+ * the region, if any, is unmapped.
+ */
+static int prepare_shards_full(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size,
+		enum counting_layout layout, enum counting_alloc alloc, uint32_t counter_bits,
+		char *region) {
 	uint64_t i;
 	ssize_t allocation_size;
 
+	assert(layout < COUNTING_LAYOUT_MAX);
+	assert(alloc < COUNTING_ALLOC_MAX);
+	assert(counter_bits == 2 || counter_bits == 4 || counter_bits == 8);
+
+	// The containers are small and allocated on demand anyway
+	if (layout == COUNTING_LAYOUT_ADAPTIVE)
+		alloc = COUNTING_ALLOC_CALLOC;
+
 	for (i = 0; i < shards_count; i++) {
 		ctx[i].shard_range_min = shard_size * i;
 		ctx[i].shard_range_max = shard_size * (i+1) - 1;
 
+		ctx[i].layout = layout;
+		ctx[i].counter_bits = counter_bits;
+		ctx[i].histogram = NULL;
+		ctx[i].elements_in_map = 0;
+		ctx[i].repeated_elements = 0;
+		// A checkpoint comes with bitmaps which were never finalized
+		ctx[i].stale = alloc == COUNTING_ALLOC_FILE;
+		index_params_init(&ctx[i].index, shards_count, shard_size);
+		ctx[i].id = i;
+
+		// Owning nothing until the bitmaps are allocated below
+		ctx[i].containers = NULL;
+		ctx[i].containers_count = 0;
+		ctx[i].added_once = NULL;
+		ctx[i].added_twice = NULL;
+		ctx[i].alloc = COUNTING_ALLOC_CALLOC;
+		ctx[i].mapping_size = 0;
+
 		assert(pthread_rwlock_init(&ctx[i].lock, 0) == 0);
 		assert(pthread_rwlock_init(&ctx[i].visited_lock, 0) == 0);
 	}
 
 	ctx[shards_count - 1].shard_range_max = COUNTING_MAX_INPUT;
 
+	if (alloc != COUNTING_ALLOC_CALLOC && alloc != COUNTING_ALLOC_FILE) {
+		region = counting_map_region(counting_region_size(ctx, shards_count), &alloc);
+		if (!region) {
+			i = 0;
+			goto unwind;
+		}
+	}
+
 	for (i = 0; i < shards_count; i++) {
 		assert(ctx[i].shard_range_max > ctx[i].shard_range_min);
 		assert(ctx[i].shard_range_max - ctx[i].shard_range_min + 1 >= shard_size);
@@ -68,134 +329,1057 @@ void prepare_shards(struct tree_owner ctx[], uint64_t shards_count, uint64_t sha
 		allocation_size = (ctx[i].shard_range_max - ctx[i].shard_range_min) / 64;
 		allocation_size += 1; // To not to bother with rounding up/down etc
 
-		ctx[i].added_once = calloc(allocation_size, sizeof(uint64_t));
-		assert(ctx[i].added_once != NULL);
+		if (layout == COUNTING_LAYOUT_COUNTERS) {
+			ctx[i].histogram = calloc(1U << counter_bits, sizeof(uint64_t));
+			if (!ctx[i].histogram)
+				goto unwind;
+		}
+
+		if (alloc != COUNTING_ALLOC_CALLOC) {
+			ctx[i].alloc = alloc;
+			ctx[i].mapping_size = counting_mapping_size(counting_words(&ctx[i]));
+			ctx[i].added_once = (uint64_t *)region;
+			ctx[i].added_twice = layout == COUNTING_LAYOUT_SPLIT ?
+				ctx[i].added_once + allocation_size : ctx[i].added_once;
 
+			region += ctx[i].mapping_size;
+			continue;
+		}
+
+		if (layout == COUNTING_LAYOUT_ADAPTIVE) {
+			ctx[i].containers_count = ((ctx[i].shard_range_max - ctx[i].shard_range_min) >>
+					ADAPTIVE_CHUNK_BITS) + 1;
+			ctx[i].containers = calloc(ctx[i].containers_count, sizeof(struct adaptive_container));
+			if (!ctx[i].containers) {
+				ctx[i].containers_count = 0;
+				goto unwind;
+			}
+			continue;
+		}
+
+		if (layout != COUNTING_LAYOUT_SPLIT) {
+			ctx[i].added_once = calloc(counting_cells(&ctx[i]), sizeof(uint64_t));
+			if (!ctx[i].added_once)
+				goto unwind;
+
+			ctx[i].added_twice = ctx[i].added_once;
+			continue;
+		}
+
+		ctx[i].added_once = calloc(allocation_size, sizeof(uint64_t));
 		ctx[i].added_twice = calloc(allocation_size, sizeof(uint64_t));
-		assert(ctx[i].added_twice != NULL);
+		if (!ctx[i].added_once || !ctx[i].added_twice)
+			goto unwind;
 	}
+
+	return 0;
+
+unwind:
+	// The shards from i on don't have their slices of the region yet
+	if (region)
+		munmap(region, counting_region_size(&ctx[i], shards_count - i));
+
+	destroy_shards(ctx, shards_count);
+
+	return 1;
 }
 
-void destroy_shards(struct tree_owner ctx[], uint64_t shards_count) {
-	uint64_t i;
+int prepare_shards_alloc(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size,
+		enum counting_layout layout, enum counting_alloc alloc) {
+	return prepare_shards_full(ctx, shards_count, shard_size, layout, alloc,
+			COUNTING_DEFAULT_COUNTER_BITS, NULL);
+}
 
-	for (i = 0; i < shards_count; i++) {
-		assert(pthread_rwlock_destroy(&ctx[i].lock) == 0);
-		assert(pthread_rwlock_destroy(&ctx[i].visited_lock) == 0);
+/* Shards of the counters layout with counters of the given width, 2, 4 or 8 bits */
+int prepare_shards_counters(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size,
+		uint32_t counter_bits, enum counting_alloc alloc) {
+	return prepare_shards_full(ctx, shards_count, shard_size, COUNTING_LAYOUT_COUNTERS, alloc,
+			counter_bits, NULL);
+}
 
-		free(ctx[i].added_once);
-		free(ctx[i].added_twice);
+/*
+ * Shards of the split, interleaved or counters layout whose bitmaps are the
+ * given region, mapped by the caller and laid out as by the mapped allocation
+ * strategies. Every shard unmaps its slice in destroy_shards().
+ */
+int prepare_shards_region(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size,
+		enum counting_layout layout, uint32_t counter_bits, void *region) {
+	assert(layout != COUNTING_LAYOUT_ADAPTIVE);
+
+	return prepare_shards_full(ctx, shards_count, shard_size, layout, COUNTING_ALLOC_FILE,
+			counter_bits, region);
+}
+
+
+int prepare_shards_layout(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size,
+		enum counting_layout layout) {
+	return prepare_shards_alloc(ctx, shards_count, shard_size, layout, COUNTING_ALLOC_CALLOC);
+}
+
+int prepare_shards(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size) {
+	return prepare_shards_layout(ctx, shards_count, shard_size, COUNTING_LAYOUT_SPLIT);
+}
+
+struct counting_touch_part {
+	pthread_t thread;
+	struct tree_owner *ctx;
+	uint64_t shards;
+	uint32_t part_id;
+	uint32_t parts;
+};
+
+static void counting_touch(uint64_t *bitmap, uint64_t size, uint64_t page_size) {
+	volatile char *bytes = (volatile char *)bitmap;
+	uint64_t offset;
+
+	for (offset = 0; offset < size; offset += page_size)
+		bytes[offset] = 0;
+}
+
+/* Writes to every page of the bitmaps of the shards the part owns */
+static void *counting_touch_part(void *param) {
+	struct counting_touch_part *part = param;
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+	struct tree_owner *shard;
+	uint64_t i, size;
+
+	for (i = 0; i < part->shards; i++) {
+		shard = &part->ctx[i];
+
+		// Same assignment of the shards as in the shard-owned processing
+		if (i * part->parts / part->shards != part->part_id)
+			continue;
+		if (shard->layout == COUNTING_LAYOUT_ADAPTIVE)
+			continue;
+
+		if (shard->alloc != COUNTING_ALLOC_CALLOC) {
+			counting_touch(shard->added_once, shard->mapping_size, page_size);
+			continue;
+		}
+
+		size = counting_cells(shard) * sizeof(uint64_t);
+		counting_touch(shard->added_once, size, page_size);
+		if (shard->added_twice != shard->added_once)
+			counting_touch(shard->added_twice, size, page_size);
+	}
+
+	return NULL;
+}
+
+/*
+ * Faults the bitmaps in ahead of the counting, in parallel. Shard i is touched
+ * by thread i * threads / shards, so with the first-touch policy its memory
+ * ends up local to the worker owning it.
+ */
+int counting_first_touch(struct tree_owner ctx[], uint64_t shards, uint32_t threads) {
+	struct counting_touch_part *parts;
+	uint32_t j;
+	int res;
+
+	if (threads == 0)
+		threads = 1;
+
+	parts = calloc(threads, sizeof(struct counting_touch_part));
+	if (!parts)
+		return 1;
+
+	for (j = 0; j < threads; j++) {
+		parts[j].ctx = ctx;
+		parts[j].shards = shards;
+		parts[j].part_id = j;
+		parts[j].parts = threads;
 	}
 
+	for (j = 1; j < threads; j++) {
+		if (pthread_create(&parts[j].thread, NULL, counting_touch_part, &parts[j]) != 0) {
+			counting_touch_part(&parts[j]);
+			parts[j].thread = 0;
+		}
+	}
+	counting_touch_part(&parts[0]);
+
+	for (j = 1; j < threads; j++) {
+		if (parts[j].thread != 0) {
+			res = pthread_join(parts[j].thread, NULL);
+			assert(res == 0);
+		}
+	}
+
+	free(parts);
+
+	return 0;
 }
 
+
+// 0 for the split layout, 1 if every value takes two bits of the same word
+#define COUNTING_LAYOUT_SHIFT(__shard) \
+	((__shard)->layout == COUNTING_LAYOUT_INTERLEAVED)
+
+#define COUNTING_CELL_ID(__shard, __val_id) \
+	((__val_id) >> (6 - COUNTING_LAYOUT_SHIFT(__shard)))
+
+#define COUNTING_BIT_ID(__shard, __val_id) \
+	((__val_id) & (63 >> COUNTING_LAYOUT_SHIFT(__shard)))
+
+#define COUNTING_EXISTS_MASK(__shard, __bit_id) \
+	((uint64_t)1 << ((__bit_id) << COUNTING_LAYOUT_SHIFT(__shard)))
+
+#define COUNTING_WAS_VISITED_MASK(__shard, __bit_id) \
+	((uint64_t)1 << (((__bit_id) << COUNTING_LAYOUT_SHIFT(__shard)) + COUNTING_LAYOUT_SHIFT(__shard)))
+
 #define COUNTING_VALUE_EXISTS(__shard, __cell_id, __bit_id) \
-	(__shard->added_once[__cell_id] & (uint64_t)((uint64_t)1 << __bit_id))
+	(__shard->added_once[__cell_id] & COUNTING_EXISTS_MASK(__shard, __bit_id))
 
 #define COUNTING_VALUE_WAS_VISITED(__shard, __cell_id, __bit_id) \
-	(__shard->added_twice[__cell_id] & (uint64_t)((uint64_t)1 << __bit_id))
+	(__shard->added_twice[__cell_id] & COUNTING_WAS_VISITED_MASK(__shard, __bit_id))
 
 #define COUNTING_SET_EXISTS(__shard, __cell_id, __bit_id) \
-	(__shard->added_once[__cell_id] |= (uint64_t)((uint64_t)1 << __bit_id))
+	(__shard->added_once[__cell_id] |= COUNTING_EXISTS_MASK(__shard, __bit_id))
 
 #define COUNTING_SET_WAS_VISITED(__shard, __cell_id, __bit_id) \
-	(__shard->added_twice[__cell_id] |= (uint64_t)((uint64_t)1 << __bit_id))
+	(__shard->added_twice[__cell_id] |= COUNTING_WAS_VISITED_MASK(__shard, __bit_id))
 
-int count_numbers(uint32_t *arr, int count, struct tree_owner ctx[]) {
-	int i;
+// Checked first so that the cache line isn't written for every number
+#define COUNTING_MARK_STALE(__shard) do { \
+	if (!__atomic_load_n(&(__shard)->stale, __ATOMIC_RELAXED)) \
+		__atomic_store_n(&(__shard)->stale, 1, __ATOMIC_RELAXED); \
+} while (0)
+
+/*
+ * Atomic counterparts of the COUNTING_SET_* macros. They return the word as
+ * it was before the update, so the caller can tell whether it was the one that
+ * flipped the bit.
+ */
+#define COUNTING_FETCH_SET_EXISTS(__shard, __cell_id, __bit_id) \
+	__atomic_fetch_or(&__shard->added_once[__cell_id], \
+			COUNTING_EXISTS_MASK(__shard, __bit_id), __ATOMIC_RELAXED)
+
+/*
+ * The locked engine sets the bits with these too. In the interleaved layout
+ * "lock" and "visited_lock" guard different bits of the same word.
+ */
+#define COUNTING_FETCH_SET_WAS_VISITED(__shard, __cell_id, __bit_id) \
+	__atomic_fetch_or(&__shard->added_twice[__cell_id], \
+			COUNTING_WAS_VISITED_MASK(__shard, __bit_id), __ATOMIC_RELAXED)
+
+int counting_stats_init(struct counting_stats *stats, uint64_t shards_count) {
+	memset(stats, 0, sizeof(*stats));
+
+	stats->shards = calloc(shards_count, sizeof(struct counting_shard_stats));
+	if (!stats->shards)
+		return 1;
+	stats->shards_count = shards_count;
+
+	return 0;
+}
+
+void counting_stats_deinit(struct counting_stats *stats) {
+	free(stats->shards);
+	memset(stats, 0, sizeof(*stats));
+}
+
+/* Counts the numbers of the calling thread into stats from now on, NULL detaches */
+void counting_stats_attach(struct counting_stats *stats) {
+	counting_thread_stats = stats;
+}
+
+#define COUNTING_STAT_PATH(__changed) do { \
+	if (counting_thread_stats) { \
+		if (__changed) \
+			counting_thread_stats->slow_path++; \
+		else \
+			counting_thread_stats->fast_path++; \
+	} \
+} while (0)
+
+static inline uint64_t counting_now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Takes the rwlock of the shard for reading or writing, the wait is recorded if attached */
+static inline void counting_rwlock(struct tree_owner *shard, pthread_rwlock_t *lock, int write) {
+	struct counting_stats *stats = counting_thread_stats;
+	struct counting_shard_stats *shard_stats;
+	uint64_t start;
+	int res;
+
+	if (!stats) {
+		res = write ? pthread_rwlock_wrlock(lock) : pthread_rwlock_rdlock(lock);
+		assert(res == 0);
+		return;
+	}
+
+	shard_stats = &stats->shards[shard->id];
+	shard_stats->lock_acquisitions++;
+
+	res = write ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock);
+	if (res == 0)
+		return;
+
+	start = counting_now_ns();
+	res = write ? pthread_rwlock_wrlock(lock) : pthread_rwlock_rdlock(lock);
+	assert(res == 0);
+
+	shard_stats->lock_contended++;
+	shard_stats->lock_wait_ns += counting_now_ns() - start;
+}
+
+/*
+ * The engines process the input in tiles. Shard ids and offsets of a whole tile
+ * are computed by the vectorized kernel first, then the bitmap words of the
+ * values COUNTING_PREFETCH_DISTANCE positions ahead are prefetched while the
+ * current one is updated, so several cache misses are in flight at once.
+ */
+#define COUNTING_TILE_SIZE 256
+#define COUNTING_PREFETCH_DISTANCE 16
+
+typedef void (*counting_insert_fn)(struct tree_owner *shard, uint32_t val_id_in_shard);
+
+// log2 of the number of counters per word
+#define COUNTING_COUNTERS_SHIFT(__shard) (6 - __builtin_ctz((__shard)->counter_bits))
+
+static inline void counting_prefetch(struct tree_owner *shard, uint32_t val_id_in_shard) {
+	uint32_t cell_id_in_array = COUNTING_CELL_ID(shard, val_id_in_shard);
+
+	if (shard->layout == COUNTING_LAYOUT_ADAPTIVE) {
+		__builtin_prefetch(&shard->containers[val_id_in_shard >> ADAPTIVE_CHUNK_BITS], 1);
+		return;
+	}
+
+	if (shard->layout == COUNTING_LAYOUT_COUNTERS) {
+		__builtin_prefetch(&shard->added_once[val_id_in_shard >> COUNTING_COUNTERS_SHIFT(shard)], 1);
+		return;
+	}
+
+	__builtin_prefetch(&shard->added_once[cell_id_in_array], 1);
+	if (shard->added_twice != shard->added_once)
+		__builtin_prefetch(&shard->added_twice[cell_id_in_array], 1);
+}
+
+/* Inlined into every engine, so that the insert function is called directly */
+static inline __attribute__((always_inline))
+void counting_process(uint32_t *arr, int count, struct tree_owner ctx[], counting_insert_fn insert) {
+	struct counting_stats *stats = counting_thread_stats;
+	uint32_t shard_ids[COUNTING_TILE_SIZE];
+	uint32_t offsets[COUNTING_TILE_SIZE];
+	int i, base, len;
+
+	for (base = 0; base < count; base += len) {
+		len = count - base < COUNTING_TILE_SIZE ? count - base : COUNTING_TILE_SIZE;
+
+		index_batch(&arr[base], len, &ctx[0].index, shard_ids, offsets);
+
+		if (stats) {
+			for (i = 0; i < len; i++)
+				stats->shards[shard_ids[i]].values++;
+		}
+
+		for (i = 0; i < len && i < COUNTING_PREFETCH_DISTANCE; i++)
+			counting_prefetch(&ctx[shard_ids[i]], offsets[i]);
+
+		for (i = 0; i < len; i++) {
+			if (i + COUNTING_PREFETCH_DISTANCE < len)
+				counting_prefetch(&ctx[shard_ids[i + COUNTING_PREFETCH_DISTANCE]],
+						offsets[i + COUNTING_PREFETCH_DISTANCE]);
+
+			insert(&ctx[shard_ids[i]], offsets[i]);
+		}
+	}
+}
+
+/*
+ * The adaptive containers are updated under a per-container spinlock by the
+ * engines sharing the shards, the owned engine doesn't need it.
+ */
+static inline void count_number_adaptive(struct tree_owner *shard, uint32_t val_id_in_shard,
+		int shared) {
+	struct adaptive_container *container =
+		&shard->containers[val_id_in_shard >> ADAPTIVE_CHUNK_BITS];
+	int changed;
+
+	if (shared)
+		adaptive_lock(container);
+
+	changed = adaptive_insert(container, val_id_in_shard & ADAPTIVE_CHUNK_MASK);
+	if (changed)
+		COUNTING_MARK_STALE(shard);
+	COUNTING_STAT_PATH(changed);
+
+	if (shared)
+		adaptive_unlock(container);
+}
+
+/*
+ * Increments the counter of the value unless it's saturated already. Every
+ * engine sharing the shards updates it with a CAS, the rwlocks aren't needed.
+ */
+static inline void count_number_counter(struct tree_owner *shard, uint32_t val_id_in_shard,
+		int shared) {
+	uint32_t per_word_shift = COUNTING_COUNTERS_SHIFT(shard);
+	uint64_t *cell = &shard->added_once[val_id_in_shard >> per_word_shift];
+	uint32_t shift = (val_id_in_shard & ((1U << per_word_shift) - 1)) * shard->counter_bits;
+	uint64_t max = ((1ULL << shard->counter_bits) - 1) << shift;
+	uint64_t old;
+
+	if (shared) {
+		old = __atomic_load_n(cell, __ATOMIC_RELAXED);
+		do {
+			if ((old & max) == max) {
+				COUNTING_STAT_PATH(0);
+				return;
+			}
+		} while (!__atomic_compare_exchange_n(cell, &old, old + (1ULL << shift), 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	} else {
+		if ((*cell & max) == max) {
+			COUNTING_STAT_PATH(0);
+			return;
+		}
+		*cell += 1ULL << shift;
+	}
+
+	COUNTING_MARK_STALE(shard);
+	COUNTING_STAT_PATH(1);
+}
+
+static inline void count_number_locked(struct tree_owner *shard, uint32_t val_id_in_shard) {
+	uint32_t cell_id_in_array = COUNTING_CELL_ID(shard, val_id_in_shard);
+	uint32_t bit_id_in_cell = COUNTING_BIT_ID(shard, val_id_in_shard);
 	uint64_t exists;
-	struct tree_owner *shard;
 	int res;
 
+	if (shard->layout == COUNTING_LAYOUT_ADAPTIVE) {
+		count_number_adaptive(shard, val_id_in_shard, 1);
+		return;
+	}
+
+	if (shard->layout == COUNTING_LAYOUT_COUNTERS) {
+		count_number_counter(shard, val_id_in_shard, 1);
+		return;
+	}
+
+	counting_rwlock(shard, &shard->lock, 0);
 
-	for (i = 0; i < count; i++) {
-		shard = get_shard(ctx, arr[i]);
+	exists = COUNTING_VALUE_EXISTS(shard, cell_id_in_array, bit_id_in_cell);
 
-		uint32_t val_id_in_shard = arr[i] - shard->shard_range_min;
-		uint32_t cell_id_in_array = val_id_in_shard / 64;
-		uint32_t bit_id_in_cell = val_id_in_shard % 64;
+	res = pthread_rwlock_unlock(&shard->lock);
+	assert(res == 0);
 
-		res = pthread_rwlock_rdlock(&shard->lock);
+	if (exists != 0) {
+		counting_rwlock(shard, &shard->visited_lock, 0);
+
+		if (COUNTING_VALUE_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell)) {
+			res = pthread_rwlock_unlock(&shard->visited_lock);
+			assert(res == 0);
+			COUNTING_STAT_PATH(0);
+			return;
+		}
+		res = pthread_rwlock_unlock(&shard->visited_lock);
 		assert(res == 0);
 
-		exists = COUNTING_VALUE_EXISTS(shard, cell_id_in_array, bit_id_in_cell);
+		counting_rwlock(shard, &shard->visited_lock, 1);
 
-		res = pthread_rwlock_unlock(&shard->lock);
+		// Taking the write lock already makes it the slow path
+		if (COUNTING_VALUE_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell) == 0) {
+			COUNTING_MARK_STALE(shard);
+			COUNTING_FETCH_SET_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell);
+		}
+		res = pthread_rwlock_unlock(&shard->visited_lock);
 		assert(res == 0);
+		COUNTING_STAT_PATH(1);
+		return;
+	}
 
-		if (exists != 0) {
-			res = pthread_rwlock_rdlock(&shard->visited_lock);
-			assert(res == 0);
+	counting_rwlock(shard, &shard->lock, 1);
 
-			if (COUNTING_VALUE_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell)) {
-				res = pthread_rwlock_unlock(&shard->visited_lock);
-				assert(res == 0);
-				continue;
-			}
+	exists = COUNTING_VALUE_EXISTS(shard, cell_id_in_array, bit_id_in_cell);
+	if (exists != 0) {
+		counting_rwlock(shard, &shard->visited_lock, 0);
+		if (COUNTING_VALUE_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell) == 0) {
 			res = pthread_rwlock_unlock(&shard->visited_lock);
 			assert(res == 0);
 
-			res = pthread_rwlock_wrlock(&shard->visited_lock);
-			assert(res == 0);
+			counting_rwlock(shard, &shard->visited_lock, 1);
 
 			if (COUNTING_VALUE_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell) == 0) {
-				shard->repeated_elements++;
-				COUNTING_SET_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell);
+				COUNTING_MARK_STALE(shard);
+				COUNTING_FETCH_SET_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell);
 			}
+
+			res = pthread_rwlock_unlock(&shard->visited_lock);
+			assert(res == 0);
+		} else {
 			res = pthread_rwlock_unlock(&shard->visited_lock);
 			assert(res == 0);
-			continue;
 		}
-
-		res = pthread_rwlock_wrlock(&shard->lock);
+		// TODO Unlock earlier and test.
+		res = pthread_rwlock_unlock(&shard->lock);
 		assert(res == 0);
+		COUNTING_STAT_PATH(1);
+		return;
+	}
 
-		exists = COUNTING_VALUE_EXISTS(shard, cell_id_in_array, bit_id_in_cell);
-		if (exists != 0) {
-			res = pthread_rwlock_rdlock(&shard->visited_lock);
-			assert(res == 0);
-			if (COUNTING_VALUE_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell) == 0) {
-				res = pthread_rwlock_unlock(&shard->visited_lock);
-				assert(res == 0);
-
-				res = pthread_rwlock_wrlock(&shard->visited_lock);
-				assert(res == 0);
-
-				if (COUNTING_VALUE_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell) == 0) {
-					shard->repeated_elements++;
-					COUNTING_SET_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell);
-				}
-
-				res = pthread_rwlock_unlock(&shard->visited_lock);
-				assert(res == 0);
-			} else {
-				res = pthread_rwlock_unlock(&shard->visited_lock);
-				assert(res == 0);
+	COUNTING_MARK_STALE(shard);
+	COUNTING_FETCH_SET_EXISTS(shard, cell_id_in_array, bit_id_in_cell);
+
+	res = pthread_rwlock_unlock(&shard->lock);
+	assert(res == 0);
+	COUNTING_STAT_PATH(1);
+}
+
+int count_numbers(uint32_t *arr, int count, struct tree_owner ctx[]) {
+	counting_process(arr, count, ctx, count_number_locked);
+
+	return 0;
+}
+
+static inline void count_number_atomic(struct tree_owner *shard, uint32_t val_id_in_shard) {
+	uint32_t cell_id_in_array = COUNTING_CELL_ID(shard, val_id_in_shard);
+	uint32_t bit_id_in_cell = COUNTING_BIT_ID(shard, val_id_in_shard);
+	uint64_t exists_mask = COUNTING_EXISTS_MASK(shard, bit_id_in_cell);
+	uint64_t visited_mask = COUNTING_WAS_VISITED_MASK(shard, bit_id_in_cell);
+	uint64_t old;
+	uint64_t new;
+	uint64_t *cell;
+
+	if (shard->layout == COUNTING_LAYOUT_ADAPTIVE) {
+		count_number_adaptive(shard, val_id_in_shard, 1);
+		return;
+	}
+
+	if (shard->layout == COUNTING_LAYOUT_COUNTERS) {
+		count_number_counter(shard, val_id_in_shard, 1);
+		return;
+	}
+
+	if (shard->layout == COUNTING_LAYOUT_INTERLEAVED) {
+		// Both bits live in the same word, one CAS decides the transition
+		cell = &shard->added_once[cell_id_in_array];
+		old = __atomic_load_n(cell, __ATOMIC_RELAXED);
+		do {
+			if (old & visited_mask)
+				break;
+			new = old | ((old & exists_mask) ? visited_mask : exists_mask);
+		} while (!__atomic_compare_exchange_n(cell, &old, new, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+		if ((old & visited_mask) == 0)
+			COUNTING_MARK_STALE(shard);
+		COUNTING_STAT_PATH((old & visited_mask) == 0);
+		return;
+	}
+
+	// Most duplicates are already marked, don't dirty the cache line then
+	if (__atomic_load_n(&shard->added_twice[cell_id_in_array], __ATOMIC_RELAXED) & visited_mask) {
+		COUNTING_STAT_PATH(0);
+		return;
+	}
+
+	COUNTING_MARK_STALE(shard);
+	COUNTING_STAT_PATH(1);
+
+	old = COUNTING_FETCH_SET_EXISTS(shard, cell_id_in_array, bit_id_in_cell);
+	if (old & exists_mask)
+		COUNTING_FETCH_SET_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell);
+}
+
+/*
+ * Lock-free variant of count_numbers(). The bitmaps are updated with atomic
+ * fetch-or and the previous value of the word tells whether the number was
+ * seen for the first or the second time, so no rwlock is taken.
+ */
+int count_numbers_atomic(uint32_t *arr, int count, struct tree_owner ctx[]) {
+	counting_process(arr, count, ctx, count_number_atomic);
+
+	return 0;
+}
+
+static inline void count_number_owned(struct tree_owner *shard, uint32_t val_id_in_shard) {
+	uint32_t cell_id_in_array = COUNTING_CELL_ID(shard, val_id_in_shard);
+	uint32_t bit_id_in_cell = COUNTING_BIT_ID(shard, val_id_in_shard);
+
+	if (shard->layout == COUNTING_LAYOUT_ADAPTIVE) {
+		count_number_adaptive(shard, val_id_in_shard, 0);
+		return;
+	}
+
+	if (shard->layout == COUNTING_LAYOUT_COUNTERS) {
+		count_number_counter(shard, val_id_in_shard, 0);
+		return;
+	}
+
+	if (COUNTING_VALUE_EXISTS(shard, cell_id_in_array, bit_id_in_cell) == 0) {
+		COUNTING_MARK_STALE(shard);
+		COUNTING_SET_EXISTS(shard, cell_id_in_array, bit_id_in_cell);
+		COUNTING_STAT_PATH(1);
+	} else if (COUNTING_VALUE_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell) == 0) {
+		COUNTING_MARK_STALE(shard);
+		COUNTING_SET_WAS_VISITED(shard, cell_id_in_array, bit_id_in_cell);
+		COUNTING_STAT_PATH(1);
+	} else {
+		COUNTING_STAT_PATH(0);
+	}
+}
+
+/*
+ * Variant of count_numbers() for callers that guarantee that every shard
+ * touched by arr[] is updated by a single thread only, e.g. the shard-owned
+ * processing in main.c. Neither locks nor atomic operations are used.
+ */
+int count_numbers_owned(uint32_t *arr, int count, struct tree_owner ctx[]) {
+	counting_process(arr, count, ctx, count_number_owned);
+
+	return 0;
+}
+
+typedef int (*count_numbers_fn)(uint32_t *arr, int count, struct tree_owner ctx[]);
+
+enum counting_engine {
+	COUNTING_ENGINE_LOCKED,
+	COUNTING_ENGINE_ATOMIC,
+	COUNTING_ENGINE_MAX,
+};
+
+static const char *counting_engine_names[COUNTING_ENGINE_MAX] = {
+	[COUNTING_ENGINE_LOCKED] = "locked",
+	[COUNTING_ENGINE_ATOMIC] = "atomic",
+};
+
+static const count_numbers_fn counting_engines[COUNTING_ENGINE_MAX] = {
+	[COUNTING_ENGINE_LOCKED] = count_numbers,
+	[COUNTING_ENGINE_ATOMIC] = count_numbers_atomic,
+};
+
+const char *counting_engine_name(enum counting_engine engine) {
+	assert(engine < COUNTING_ENGINE_MAX);
+
+	return counting_engine_names[engine];
+}
+
+count_numbers_fn counting_engine_get(enum counting_engine engine) {
+	assert(engine < COUNTING_ENGINE_MAX);
+
+	return counting_engines[engine];
+}
+
+static const char *counting_layout_names[COUNTING_LAYOUT_MAX] = {
+	[COUNTING_LAYOUT_SPLIT] = "split",
+	[COUNTING_LAYOUT_INTERLEAVED] = "interleaved",
+	[COUNTING_LAYOUT_ADAPTIVE] = "adaptive",
+	[COUNTING_LAYOUT_COUNTERS] = "counters",
+};
+
+const char *counting_layout_name(enum counting_layout layout) {
+	assert(layout < COUNTING_LAYOUT_MAX);
+
+	return counting_layout_names[layout];
+}
+
+static const char *counting_alloc_names[COUNTING_ALLOC_MAX] = {
+	[COUNTING_ALLOC_CALLOC] = "calloc",
+	[COUNTING_ALLOC_THP] = "thp",
+	[COUNTING_ALLOC_HUGETLB] = "hugetlb",
+	[COUNTING_ALLOC_FILE] = "file",
+};
+
+const char *counting_alloc_name(enum counting_alloc alloc) {
+	assert(alloc < COUNTING_ALLOC_MAX);
+
+	return counting_alloc_names[alloc];
+}
+
+/* Returns COUNTING_ALLOC_MAX if there is no allocation strategy with the given name */
+enum counting_alloc counting_alloc_from_name(const char *name) {
+	int i;
+
+	for (i = 0; i < COUNTING_ALLOC_MAX; i++) {
+		if (i != COUNTING_ALLOC_FILE && strcmp(name, counting_alloc_names[i]) == 0)
+			return i;
+	}
+
+	return COUNTING_ALLOC_MAX;
+}
+
+/* Returns COUNTING_LAYOUT_MAX if there is no layout with the given name */
+enum counting_layout counting_layout_from_name(const char *name) {
+	int i;
+
+	for (i = 0; i < COUNTING_LAYOUT_MAX; i++) {
+		if (strcmp(name, counting_layout_names[i]) == 0)
+			return i;
+	}
+
+	return COUNTING_LAYOUT_MAX;
+}
+
+/* Returns COUNTING_ENGINE_MAX if there is no engine with the given name */
+enum counting_engine counting_engine_from_name(const char *name) {
+	int i;
+
+	for (i = 0; i < COUNTING_ENGINE_MAX; i++) {
+		if (strcmp(name, counting_engine_names[i]) == 0)
+			return i;
+	}
+
+	return COUNTING_ENGINE_MAX;
+}
+
+struct counting_finalize_part {
+	pthread_t thread;
+	struct tree_owner *ctx;
+	uint64_t shards;
+	uint32_t part_id;
+	uint32_t parts;
+	// Partial results, one per shard
+	uint64_t *present;
+	uint64_t *only_once;
+};
+
+/* Adds the histogram of the given words of the counters to the one of the shard */
+static void counting_finalize_counters(struct tree_owner *shard, uint64_t begin, uint64_t end,
+		uint64_t *present, uint64_t *only_once) {
+	uint64_t histogram[HISTOGRAM_MAX_BUCKETS] = {};
+	uint32_t k;
+
+	histogram_count(&shard->added_once[begin], end - begin, shard->counter_bits, histogram);
+
+	// The padding past shard_range_max is never counted, it stays in bucket 0
+	*present += (end - begin) * (64 / shard->counter_bits) - histogram[0];
+	*only_once += histogram[1];
+
+	for (k = 1; k < (1U << shard->counter_bits); k++)
+		__atomic_add_fetch(&shard->histogram[k], histogram[k], __ATOMIC_RELAXED);
+}
+
+/* Counts the part_id-th slice of the bitmaps of every stale shard */
+static void *counting_finalize_part(void *param) {
+	struct counting_finalize_part *part = param;
+	struct tree_owner *shard;
+	uint64_t cells, begin, end;
+	uint64_t i, j;
+
+	for (i = 0; i < part->shards; i++) {
+		shard = &part->ctx[i];
+		if (!shard->stale)
+			continue;
+
+		if (shard->layout == COUNTING_LAYOUT_ADAPTIVE) {
+			begin = shard->containers_count * part->part_id / part->parts;
+			end = shard->containers_count * (part->part_id + 1) / part->parts;
+
+			for (j = begin; j < end; j++) {
+				adaptive_count(&shard->containers[j], &part->present[i],
+						&part->only_once[i]);
 			}
-			// TODO Unlock earlier and test.
-			res = pthread_rwlock_unlock(&shard->lock);
+			continue;
+		}
+
+		cells = counting_cells(shard);
+		begin = cells * part->part_id / part->parts;
+		end = cells * (part->part_id + 1) / part->parts;
+
+		if (shard->layout == COUNTING_LAYOUT_COUNTERS) {
+			counting_finalize_counters(shard, begin, end, &part->present[i],
+					&part->only_once[i]);
+		} else if (shard->layout == COUNTING_LAYOUT_INTERLEAVED) {
+			popcount_interleaved(&shard->added_once[begin], end - begin,
+					&part->present[i], &part->only_once[i]);
+		} else {
+			popcount_split(&shard->added_once[begin], &shard->added_twice[begin],
+					end - begin, &part->present[i], &part->only_once[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Recomputes the counters of the shards modified since the last call from the
+ * bitmaps, splitting the work among the given number of threads. Must not run
+ * concurrently with counting.
+ */
+int counting_finalize(struct tree_owner ctx[], uint64_t shards, uint32_t threads) {
+	struct counting_finalize_part *parts;
+	uint64_t *results;
+	uint64_t i;
+	uint32_t j;
+	int ret = 0, res;
+
+	for (i = 0; i < shards; i++) {
+		if (ctx[i].stale)
+			break;
+	}
+	if (i == shards)
+		return 0;
+
+	if (threads == 0)
+		threads = 1;
+
+	parts = calloc(threads, sizeof(struct counting_finalize_part));
+	results = calloc(threads * shards * 2, sizeof(uint64_t));
+	if (!parts || !results) {
+		ret = 1;
+		goto end;
+	}
+
+	// The parts add their share to the histograms
+	for (i = 0; i < shards; i++) {
+		if (ctx[i].stale && ctx[i].histogram)
+			memset(ctx[i].histogram, 0, sizeof(uint64_t) << ctx[i].counter_bits);
+	}
+
+	for (j = 0; j < threads; j++) {
+		parts[j].ctx = ctx;
+		parts[j].shards = shards;
+		parts[j].part_id = j;
+		parts[j].parts = threads;
+		parts[j].present = &results[2 * j * shards];
+		parts[j].only_once = &results[(2 * j + 1) * shards];
+	}
+
+	// The calling thread takes the first part itself
+	for (j = 1; j < threads; j++) {
+		if (pthread_create(&parts[j].thread, NULL, counting_finalize_part, &parts[j]) != 0) {
+			// Do it ourselves then
+			counting_finalize_part(&parts[j]);
+			parts[j].thread = 0;
+		}
+	}
+	counting_finalize_part(&parts[0]);
+
+	for (j = 1; j < threads; j++) {
+		if (parts[j].thread != 0) {
+			res = pthread_join(parts[j].thread, NULL);
 			assert(res == 0);
+		}
+	}
+
+	for (i = 0; i < shards; i++) {
+		if (!ctx[i].stale)
 			continue;
+
+		ctx[i].elements_in_map = 0;
+		ctx[i].repeated_elements = 0;
+
+		for (j = 0; j < threads; j++) {
+			ctx[i].elements_in_map += parts[j].present[i];
+			ctx[i].repeated_elements += parts[j].present[i] - parts[j].only_once[i];
 		}
-		
-		COUNTING_SET_EXISTS(shard, cell_id_in_array, bit_id_in_cell);
-		shard->elements_in_map++;
 
-		res = pthread_rwlock_unlock(&shard->lock);
-		assert(res == 0);
+		ctx[i].stale = 0;
+	}
+
+end:
+	free(results);
+	free(parts);
+
+	return ret;
+}
+
+struct counting_sets_part {
+	pthread_t thread;
+	struct tree_owner **inputs;
+	uint32_t inputs_count;
+	uint64_t shards;
+	uint32_t part_id;
+	uint32_t parts;
+	struct counting_sets sets;
+};
+
+/* Combines the part_id-th slice of the bitmaps of every shard */
+static void *counting_sets_part(void *param) {
+	struct counting_sets_part *part = param;
+	const uint64_t *words[SETS_MAX_INPUTS];
+	struct tree_owner *shard;
+	uint64_t cells, begin, end;
+	uint32_t width, k;
+	uint64_t i;
+
+	for (i = 0; i < part->shards; i++) {
+		shard = &part->inputs[0][i];
+		width = shard->layout == COUNTING_LAYOUT_COUNTERS ? shard->counter_bits :
+			shard->layout == COUNTING_LAYOUT_INTERLEAVED ? 2 : 1;
+
+		// The "seen once" bitmap is enough in the split layout
+		cells = counting_cells(shard);
+		begin = cells * part->part_id / part->parts;
+		end = cells * (part->part_id + 1) / part->parts;
+
+		for (k = 0; k < part->inputs_count; k++)
+			words[k] = &part->inputs[k][i].added_once[begin];
+
+		sets_count(words, part->inputs_count, end - begin, width, &part->sets);
+	}
+
+	return NULL;
+}
+
+/*
+ * Cardinalities of the set operations over the values seen in every input,
+ * splitting the work among the given number of threads. The inputs must have
+ * the same shards and the same layout, other than adaptive. Returns 1 if they
+ * don't or the memory can't be allocated.
+ */
+int counting_sets(struct tree_owner *inputs[], uint32_t inputs_count, uint64_t shards,
+		uint32_t threads, struct counting_sets *sets) {
+	struct counting_sets_part *parts;
+	uint32_t j, k;
+	int res;
+
+	if (inputs_count < 1 || inputs_count > SETS_MAX_INPUTS ||
+			inputs[0][0].layout == COUNTING_LAYOUT_ADAPTIVE)
+		return 1;
+
+	for (k = 1; k < inputs_count; k++) {
+		if (inputs[k][0].layout != inputs[0][0].layout ||
+				inputs[k][0].counter_bits != inputs[0][0].counter_bits ||
+				inputs[k][0].index.shard_size != inputs[0][0].index.shard_size)
+			return 1;
+	}
+
+	if (threads == 0)
+		threads = 1;
+
+	parts = calloc(threads, sizeof(struct counting_sets_part));
+	if (!parts)
+		return 1;
+
+	for (j = 0; j < threads; j++) {
+		parts[j].inputs = inputs;
+		parts[j].inputs_count = inputs_count;
+		parts[j].shards = shards;
+		parts[j].part_id = j;
+		parts[j].parts = threads;
+	}
+
+	// The calling thread takes the first part itself
+	for (j = 1; j < threads; j++) {
+		if (pthread_create(&parts[j].thread, NULL, counting_sets_part, &parts[j]) != 0) {
+			counting_sets_part(&parts[j]);
+			parts[j].thread = 0;
+		}
+	}
+	counting_sets_part(&parts[0]);
+
+	memset(sets, 0, sizeof(*sets));
+	for (j = 0; j < threads; j++) {
+		if (j > 0 && parts[j].thread != 0) {
+			res = pthread_join(parts[j].thread, NULL);
+			assert(res == 0);
+		}
+
+		sets->union_count += parts[j].sets.union_count;
+		sets->intersection += parts[j].sets.intersection;
+		sets->difference += parts[j].sets.difference;
+		sets->symmetric_difference += parts[j].sets.symmetric_difference;
 	}
 
+	free(parts);
+
 	return 0;
 }
 
+/* Memory taken by the bitmaps and containers of the shards, in bytes */
+uint64_t counting_memory(struct tree_owner ctx[], uint64_t shards) {
+	uint64_t i, j;
+	uint64_t res = 0;
+
+	for (i = 0; i < shards; i++) {
+		if (ctx[i].layout != COUNTING_LAYOUT_ADAPTIVE) {
+			res += counting_words(&ctx[i]) * sizeof(uint64_t);
+			continue;
+		}
+
+		res += ctx[i].containers_count * sizeof(struct adaptive_container);
+		for (j = 0; j < ctx[i].containers_count; j++)
+			res += adaptive_memory(&ctx[i].containers[j]);
+	}
+
+	return res;
+}
+
+/*
+ * Sums up the histograms of the shards of the counters layout, histogram[k] is
+ * the number of values seen exactly k times and the last bucket the number of
+ * values seen at least that many times. Returns the number of buckets, 0 for
+ * the other layouts.
+ */
+uint32_t counting_histogram(struct tree_owner ctx[], uint64_t shards,
+		uint64_t histogram[HISTOGRAM_MAX_BUCKETS]) {
+	uint32_t buckets, k;
+	uint64_t i;
+
+	memset(histogram, 0, HISTOGRAM_MAX_BUCKETS * sizeof(uint64_t));
+
+	if (ctx[0].layout != COUNTING_LAYOUT_COUNTERS)
+		return 0;
+
+	if (counting_finalize(ctx, shards, 1) != 0)
+		return 0;
+
+	buckets = 1U << ctx[0].counter_bits;
+	for (i = 0; i < shards; i++) {
+		for (k = 1; k < buckets; k++)
+			histogram[k] += ctx[i].histogram[k];
+	}
+
+	return buckets;
+}
+
+/*
+ * Stores up to max_values values seen at least min_count times, in ascending
+ * order, and returns how many there are. Only for the counters layout, where
+ * min_count can't exceed the maximum of the counters.
+ */
+uint64_t counting_values_at_least(struct tree_owner ctx[], uint64_t shards, uint32_t min_count,
+		uint32_t *values, uint64_t max_values) {
+	uint64_t found = 0, i, cell, cells;
+	uint32_t bits, j;
+	uint64_t mask;
+
+	for (i = 0; i < shards; i++) {
+		if (ctx[i].layout != COUNTING_LAYOUT_COUNTERS)
+			return 0;
+
+		bits = ctx[i].counter_bits;
+		mask = (1ULL << bits) - 1;
+		assert(min_count >= 1 && min_count <= mask);
+
+		cells = counting_cells(&ctx[i]);
+		for (cell = 0; cell < cells; cell++) {
+			if (ctx[i].added_once[cell] == 0)
+				continue;
+
+			for (j = 0; j < 64 / bits; j++) {
+				if (((ctx[i].added_once[cell] >> (j * bits)) & mask) < min_count)
+					continue;
+
+				if (found < max_values)
+					values[found] = ctx[i].shard_range_min + cell * (64 / bits) + j;
+				found++;
+			}
+		}
+	}
+
+	return found;
+}
+
 uint64_t seen_only_once(struct tree_owner *owner) {
 	return owner->elements_in_map - owner->repeated_elements;
 }
 
 uint64_t aggregate_unique_numbers(struct tree_owner ctx[], uint64_t shards) {
 	uint64_t i;
-	int res = 0;
-	
+	uint64_t res = 0;
+	int ret;
+
+	ret = counting_finalize(ctx, shards, 1);
+	assert(ret == 0);
+
 	for (i = 0; i < shards; i++)
 		res += ctx[i].elements_in_map;
 
@@ -204,8 +1388,12 @@ uint64_t aggregate_unique_numbers(struct tree_owner ctx[], uint64_t shards) {
 
 uint64_t aggregate_seen_only_once(struct tree_owner ctx[], uint64_t shards) {
 	uint64_t i;
-	int res = 0;
-	
+	uint64_t res = 0;
+	int ret;
+
+	ret = counting_finalize(ctx, shards, 1);
+	assert(ret == 0);
+
 	for (i = 0; i < shards; i++) {
 		res += seen_only_once(&ctx[i]);
 		//printf("%d: seen numbers %u\n", i, seen_only_once(&ctx[i]));
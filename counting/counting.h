@@ -1,10 +1,61 @@
 #include "counting.c"
 
 int count_numbers(uint32_t *arr, int count, struct tree_owner ctx[]);
+int count_numbers_atomic(uint32_t *arr, int count, struct tree_owner ctx[]);
+int count_numbers_owned(uint32_t *arr, int count, struct tree_owner ctx[]);
 
-void prepare_shards(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size);
+const char *counting_engine_name(enum counting_engine engine);
+count_numbers_fn counting_engine_get(enum counting_engine engine);
+enum counting_engine counting_engine_from_name(const char *name);
+
+const char *counting_layout_name(enum counting_layout layout);
+enum counting_layout counting_layout_from_name(const char *name);
+
+const char *counting_alloc_name(enum counting_alloc alloc);
+enum counting_alloc counting_alloc_from_name(const char *name);
+
+int prepare_shards(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size);
+int prepare_shards_layout(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size,
+		enum counting_layout layout);
+int prepare_shards_alloc(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size,
+		enum counting_layout layout, enum counting_alloc alloc);
+int prepare_shards_counters(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size,
+		uint32_t counter_bits, enum counting_alloc alloc);
+int prepare_shards_region(struct tree_owner ctx[], uint64_t shards_count, uint64_t shard_size,
+		enum counting_layout layout, uint32_t counter_bits, void *region);
+uint64_t counting_region_size(struct tree_owner ctx[], uint64_t shards_count);
+int counting_first_touch(struct tree_owner ctx[], uint64_t shards, uint32_t threads);
 void destroy_shards(struct tree_owner ctx[], uint64_t shards_count);
 
+void index_params_init(struct index_params *params, uint64_t shards_count, uint64_t shard_size);
+void index_batch(const uint32_t *values, uint32_t count, const struct index_params *params,
+		uint32_t *shard_ids, uint32_t *offsets);
+int index_select(enum index_isa isa);
+enum index_isa index_get_isa(void);
+const char *index_isa_name(enum index_isa isa);
+enum index_isa index_isa_from_name(const char *name);
+
+uint64_t counting_cells(struct tree_owner *shard);
+int counting_finalize(struct tree_owner ctx[], uint64_t shards, uint32_t threads);
+int counting_sets(struct tree_owner *inputs[], uint32_t inputs_count, uint64_t shards,
+		uint32_t threads, struct counting_sets *sets);
+uint64_t counting_memory(struct tree_owner ctx[], uint64_t shards);
+uint32_t counting_histogram(struct tree_owner ctx[], uint64_t shards,
+		uint64_t histogram[HISTOGRAM_MAX_BUCKETS]);
+uint64_t counting_values_at_least(struct tree_owner ctx[], uint64_t shards, uint32_t min_count,
+		uint32_t *values, uint64_t max_values);
+
+int adaptive_insert(struct adaptive_container *container, uint32_t low);
+void adaptive_count(struct adaptive_container *container, uint64_t *present, uint64_t *only_once);
+void histogram_count(const uint64_t *cells, size_t words, uint32_t bits, uint64_t *histogram);
+
+uint64_t adaptive_memory(struct adaptive_container *container);
+void adaptive_free(struct adaptive_container *container);
+
+int counting_stats_init(struct counting_stats *stats, uint64_t shards_count);
+void counting_stats_deinit(struct counting_stats *stats);
+void counting_stats_attach(struct counting_stats *stats);
+
 uint64_t seen_only_once(struct tree_owner *owner);
 
 uint64_t aggregate_unique_numbers(struct tree_owner ctx[], uint64_t shards);
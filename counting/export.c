@@ -0,0 +1,431 @@
+#ifndef __EXPORT_C__
+#define __EXPORT_C__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "counting.h"
+
+/*
+ * Export of the values seen exactly once or more than once, in ascending
+ * order. The range is cut into pieces of EXPORT_PIECE_VALUES values taken by
+ * the workers in order, each one reduces every word of its piece to one bit
+ * per selected value and walks the set bits. The encoded pieces are written
+ * in turn, so the output may be a pipe. A delta of the varint format only
+ * depends on the previous value in the piece, the first one is encoded when
+ * the piece is written.
+ */
+
+#define EXPORT_PIECE_VALUES (1U << 18)
+// Longest encoding of a value, 10 digits and the newline
+#define EXPORT_MAX_ENCODED 11
+
+enum export_values {
+	EXPORT_VALUES_ONCE,
+	EXPORT_VALUES_REPEATED,
+	EXPORT_VALUES_MAX,
+};
+
+enum export_format {
+	// Native 32-bit numbers, as in the input
+	EXPORT_FORMAT_RAW,
+	// LEB128 differences from the previous value, the first one from 0
+	EXPORT_FORMAT_VARINT,
+	// One decimal number per line
+	EXPORT_FORMAT_TEXT,
+	EXPORT_FORMAT_MAX,
+};
+
+static const char *export_values_names[EXPORT_VALUES_MAX] = {
+	[EXPORT_VALUES_ONCE] = "once",
+	[EXPORT_VALUES_REPEATED] = "repeated",
+};
+
+static const char *export_format_names[EXPORT_FORMAT_MAX] = {
+	[EXPORT_FORMAT_RAW] = "raw",
+	[EXPORT_FORMAT_VARINT] = "varint",
+	[EXPORT_FORMAT_TEXT] = "text",
+};
+
+enum export_values export_values_from_name(const char *name) {
+	int i;
+
+	for (i = 0; i < EXPORT_VALUES_MAX; i++) {
+		if (strcmp(name, export_values_names[i]) == 0)
+			return i;
+	}
+
+	return EXPORT_VALUES_MAX;
+}
+
+enum export_format export_format_from_name(const char *name) {
+	int i;
+
+	for (i = 0; i < EXPORT_FORMAT_MAX; i++) {
+		if (strcmp(name, export_format_names[i]) == 0)
+			return i;
+	}
+
+	return EXPORT_FORMAT_MAX;
+}
+
+const char *export_format_name(enum export_format format) {
+	return export_format_names[format];
+}
+
+struct export_piece {
+	struct tree_owner *shard;
+	// Words of the bitmap, or containers of the adaptive layout
+	uint64_t begin;
+	uint64_t end;
+};
+
+struct export_ctx {
+	struct export_piece *pieces;
+	uint64_t pieces_count;
+	enum export_values values;
+	enum export_format format;
+	int fd;
+	// The next piece to be taken and to be written
+	uint64_t next;
+	uint64_t turn;
+	pthread_mutex_t lock;
+	pthread_cond_t written;
+	// Only touched by the worker whose turn it is
+	uint64_t last_value;
+	uint64_t exported;
+	int failed;
+};
+
+/* A piece encoded by a worker */
+struct export_buffer {
+	char *data;
+	char *end;
+	uint64_t count;
+	uint32_t first;
+	uint32_t last;
+};
+
+static inline char *export_varint(char *out, uint32_t delta) {
+	while (delta >= 0x80) {
+		*out++ = (delta & 0x7f) | 0x80;
+		delta >>= 7;
+	}
+	*out++ = delta;
+
+	return out;
+}
+
+static inline char *export_text(char *out, uint32_t value) {
+	char digits[10];
+	int count = 0;
+
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	while (count > 0)
+		*out++ = digits[--count];
+	*out++ = '\n';
+
+	return out;
+}
+
+static inline void export_value(struct export_buffer *buffer, enum export_format format,
+		uint32_t value) {
+	if (buffer->count++ == 0) {
+		// Its delta depends on the previous piece
+		buffer->first = buffer->last = value;
+		if (format == EXPORT_FORMAT_VARINT)
+			return;
+	}
+
+	if (format == EXPORT_FORMAT_RAW) {
+		memcpy(buffer->end, &value, sizeof(value));
+		buffer->end += sizeof(value);
+	} else if (format == EXPORT_FORMAT_VARINT) {
+		buffer->end = export_varint(buffer->end, value - buffer->last);
+	} else {
+		buffer->end = export_text(buffer->end, value);
+	}
+	buffer->last = value;
+}
+
+/*
+ * The lowest bit of every field of the given width is set if the value of the
+ * field is selected, see sets_presence(). The fields of the interleaved layout
+ * hold the "seen once" bit below the "seen twice" one, so they read as 2-bit
+ * counters.
+ */
+static inline uint64_t export_select(uint64_t word, uint32_t width, uint64_t mask,
+		enum export_values values) {
+	uint64_t repeated = sets_presence(word & ~mask, width, mask);
+
+	if (values == EXPORT_VALUES_REPEATED)
+		return repeated;
+
+	return sets_presence(word, width, mask) & ~repeated;
+}
+
+/* Walks the selected values of the words, word i starts at value base + i * 64 / width */
+static void export_words(struct export_buffer *buffer, struct export_ctx *ctx,
+		const uint64_t *words, uint64_t count, uint32_t width, uint64_t base) {
+	uint64_t mask = sets_presence_mask(width);
+	uint32_t shift = __builtin_ctz(width);
+	uint64_t selected, i;
+
+	for (i = 0; i < count; i++) {
+		if (words[i] == 0)
+			continue;
+
+		selected = export_select(words[i], width, mask, ctx->values);
+		while (selected) {
+			export_value(buffer, ctx->format,
+					base + ((i << 6) >> shift) + (__builtin_ctzll(selected) >> shift));
+			selected &= selected - 1;
+		}
+	}
+}
+
+static void export_split(struct export_buffer *buffer, struct export_ctx *ctx,
+		struct export_piece *piece) {
+	struct tree_owner *shard = piece->shard;
+	uint64_t selected, i;
+
+	for (i = piece->begin; i < piece->end; i++) {
+		if (ctx->values == EXPORT_VALUES_REPEATED)
+			selected = shard->added_twice[i];
+		else
+			selected = shard->added_once[i] & ~shard->added_twice[i];
+
+		while (selected) {
+			export_value(buffer, ctx->format,
+					shard->shard_range_min + (i << 6) + __builtin_ctzll(selected));
+			selected &= selected - 1;
+		}
+	}
+}
+
+static void export_adaptive(struct export_buffer *buffer, struct export_ctx *ctx,
+		struct export_piece *piece) {
+	struct adaptive_container *container;
+	uint64_t base, i;
+	uint32_t j, repeated;
+
+	for (i = piece->begin; i < piece->end; i++) {
+		container = &piece->shard->containers[i];
+		base = piece->shard->shard_range_min + (i << ADAPTIVE_CHUNK_BITS);
+
+		if (container->cells) {
+			export_words(buffer, ctx, container->cells, ADAPTIVE_DENSE_WORDS, 2, base);
+			continue;
+		}
+
+		// The entries are sorted by value
+		for (j = 0; j < container->count; j++) {
+			repeated = container->entries[j] & 1;
+			if (repeated == (ctx->values == EXPORT_VALUES_REPEATED))
+				export_value(buffer, ctx->format, base + (container->entries[j] >> 1));
+		}
+	}
+}
+
+static void export_piece(struct export_buffer *buffer, struct export_ctx *ctx,
+		struct export_piece *piece) {
+	struct tree_owner *shard = piece->shard;
+	uint32_t width;
+
+	buffer->end = buffer->data;
+	buffer->count = 0;
+
+	if (shard->layout == COUNTING_LAYOUT_ADAPTIVE) {
+		export_adaptive(buffer, ctx, piece);
+	} else if (shard->layout == COUNTING_LAYOUT_SPLIT) {
+		export_split(buffer, ctx, piece);
+	} else {
+		width = shard->layout == COUNTING_LAYOUT_COUNTERS ? shard->counter_bits : 2;
+		export_words(buffer, ctx, &shard->added_once[piece->begin], piece->end - piece->begin,
+				width, shard->shard_range_min + ((piece->begin << 6) / width));
+	}
+}
+
+static int export_write(int fd, struct iovec *iov, int count) {
+	ssize_t written;
+
+	while (count > 0) {
+		written = writev(fd, iov, count);
+		if (written < 0)
+			return 1;
+
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+/* Writes the encoded piece once all the previous ones were written */
+static void export_flush(struct export_ctx *ctx, struct export_buffer *buffer, uint64_t piece) {
+	char first[EXPORT_MAX_ENCODED];
+	struct iovec iov[2];
+	int count = 0, res;
+
+	res = pthread_mutex_lock(&ctx->lock);
+	assert(res == 0);
+	while (ctx->turn != piece) {
+		res = pthread_cond_wait(&ctx->written, &ctx->lock);
+		assert(res == 0);
+	}
+	res = pthread_mutex_unlock(&ctx->lock);
+	assert(res == 0);
+
+	if (buffer->count > 0 && !__atomic_load_n(&ctx->failed, __ATOMIC_RELAXED)) {
+		if (ctx->format == EXPORT_FORMAT_VARINT) {
+			iov[count].iov_base = first;
+			iov[count].iov_len = export_varint(first, buffer->first - ctx->last_value) - first;
+			count++;
+		}
+		iov[count].iov_base = buffer->data;
+		iov[count].iov_len = buffer->end - buffer->data;
+		count++;
+
+		if (export_write(ctx->fd, iov, count) != 0)
+			ctx->failed = 1;
+		ctx->last_value = buffer->last;
+		ctx->exported += buffer->count;
+	}
+
+	res = pthread_mutex_lock(&ctx->lock);
+	assert(res == 0);
+	ctx->turn++;
+	res = pthread_cond_broadcast(&ctx->written);
+	assert(res == 0);
+	res = pthread_mutex_unlock(&ctx->lock);
+	assert(res == 0);
+}
+
+static void *export_worker(void *param) {
+	struct export_ctx *ctx = param;
+	struct export_buffer buffer;
+	uint64_t piece;
+
+	buffer.data = malloc((uint64_t)EXPORT_PIECE_VALUES * EXPORT_MAX_ENCODED);
+	if (!buffer.data) {
+		__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	while ((piece = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->pieces_count) {
+		export_piece(&buffer, ctx, &ctx->pieces[piece]);
+		export_flush(ctx, &buffer, piece);
+	}
+
+	free(buffer.data);
+
+	return NULL;
+}
+
+/* Pieces of the shard, every one covers EXPORT_PIECE_VALUES values at most */
+static uint64_t export_shard_pieces(struct tree_owner *shard, struct export_piece *pieces) {
+	uint64_t units, per_piece, i, count = 0;
+
+	if (shard->layout == COUNTING_LAYOUT_ADAPTIVE) {
+		units = shard->containers_count;
+		per_piece = EXPORT_PIECE_VALUES >> ADAPTIVE_CHUNK_BITS;
+	} else {
+		units = counting_cells(shard);
+		per_piece = EXPORT_PIECE_VALUES / 64;
+		if (shard->layout == COUNTING_LAYOUT_INTERLEAVED)
+			per_piece *= 2;
+		else if (shard->layout == COUNTING_LAYOUT_COUNTERS)
+			per_piece *= shard->counter_bits;
+	}
+
+	for (i = 0; i < units; i += per_piece, count++) {
+		if (!pieces)
+			continue;
+		pieces[count].shard = shard;
+		pieces[count].begin = i;
+		pieces[count].end = i + per_piece < units ? i + per_piece : units;
+	}
+
+	return count;
+}
+
+/*
+ * Writes the selected values of the shards in ascending order to fd with the
+ * given number of threads and stores how many there were to *exported. The
+ * shards must not change until it returns. Returns 1 if the output can't be
+ * written.
+ */
+int counting_export(struct tree_owner ctx[], uint64_t shards, uint32_t threads,
+		enum export_values values, enum export_format format, int fd, uint64_t *exported) {
+	struct export_ctx export = {
+		.values = values,
+		.format = format,
+		.fd = fd,
+	};
+	pthread_t *workers;
+	uint64_t i;
+	uint32_t j, started = 0;
+	int res;
+
+	for (i = 0; i < shards; i++)
+		export.pieces_count += export_shard_pieces(&ctx[i], NULL);
+
+	export.pieces = calloc(export.pieces_count, sizeof(struct export_piece));
+	workers = calloc(threads, sizeof(pthread_t));
+	if (!export.pieces || !workers) {
+		free(export.pieces);
+		free(workers);
+		return 1;
+	}
+
+	export.pieces_count = 0;
+	for (i = 0; i < shards; i++)
+		export.pieces_count += export_shard_pieces(&ctx[i], &export.pieces[export.pieces_count]);
+
+	res = pthread_mutex_init(&export.lock, NULL);
+	assert(res == 0);
+	res = pthread_cond_init(&export.written, NULL);
+	assert(res == 0);
+
+	// The pieces go to whoever is free, the calling thread takes them too
+	for (j = 1; j < threads; j++) {
+		if (pthread_create(&workers[started], NULL, export_worker, &export) == 0)
+			started++;
+	}
+	export_worker(&export);
+
+	for (j = 0; j < started; j++) {
+		res = pthread_join(workers[j], NULL);
+		assert(res == 0);
+	}
+
+	res = pthread_mutex_destroy(&export.lock);
+	assert(res == 0);
+	res = pthread_cond_destroy(&export.written);
+	assert(res == 0);
+	free(export.pieces);
+	free(workers);
+
+	*exported = export.exported;
+
+	return export.failed || export.turn != export.pieces_count;
+}
+
+#endif
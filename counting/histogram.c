@@ -0,0 +1,96 @@
+#ifndef __HISTOGRAM_C__
+#define __HISTOGRAM_C__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <immintrin.h>
+
+/*
+ * Kernels building the histogram of packed counters, histogram[k] is the
+ * number of counters equal to k. The counters are 2, 4 or 8 bits wide, so a
+ * counter never crosses a byte. The AVX2 kernel handles the 2 and 4 bit wide
+ * ones, it's picked at runtime if the CPU supports it.
+ */
+
+#define HISTOGRAM_MAX_BUCKETS 256
+// Vector iterations before the byte lanes of the AVX2 kernel could overflow
+#define HISTOGRAM_AVX2_FLUSH 63
+
+static void histogram_scalar(const uint64_t *cells, size_t words, uint32_t bits,
+		uint64_t *histogram) {
+	uint64_t mask = (1ULL << bits) - 1;
+	uint64_t cell;
+	size_t i;
+	uint32_t j;
+
+	for (i = 0; i < words; i++) {
+		cell = cells[i];
+		for (j = 0; j < 64; j += bits)
+			histogram[(cell >> j) & mask]++;
+	}
+}
+
+/*
+ * Every counter is extracted into its own byte lane and compared with every
+ * non-zero value, the lanes count the matches. They are summed up into 64-bit
+ * totals before they can overflow, bucket 0 takes what's left.
+ */
+__attribute__((target("avx2")))
+static void histogram_avx2(const uint64_t *cells, size_t words, uint32_t bits,
+		uint64_t *histogram) {
+	const uint32_t buckets = 1U << bits;
+	const __m256i mask = _mm256_set1_epi8(buckets - 1);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i lanes[16], totals[16];
+	__m256i v, fields;
+	uint64_t sums[4];
+	size_t i, vectors = words / 4;
+	uint32_t k, shift, iterations = 0;
+
+	for (k = 1; k < buckets; k++) {
+		lanes[k] = zero;
+		totals[k] = zero;
+	}
+
+	for (i = 0; i < vectors; i++) {
+		v = _mm256_loadu_si256((const __m256i *)&cells[i * 4]);
+
+		for (shift = 0; shift < 8; shift += bits) {
+			fields = _mm256_and_si256(_mm256_srli_epi16(v, shift), mask);
+			for (k = 1; k < buckets; k++) {
+				lanes[k] = _mm256_sub_epi8(lanes[k],
+						_mm256_cmpeq_epi8(fields, _mm256_set1_epi8(k)));
+			}
+		}
+
+		if (++iterations == HISTOGRAM_AVX2_FLUSH || i + 1 == vectors) {
+			for (k = 1; k < buckets; k++) {
+				totals[k] = _mm256_add_epi64(totals[k], _mm256_sad_epu8(lanes[k], zero));
+				lanes[k] = zero;
+			}
+			iterations = 0;
+		}
+	}
+
+	histogram[0] += vectors * 4 * (64 / bits);
+	for (k = 1; k < buckets; k++) {
+		_mm256_storeu_si256((__m256i *)sums, totals[k]);
+		histogram[k] += sums[0] + sums[1] + sums[2] + sums[3];
+		histogram[0] -= sums[0] + sums[1] + sums[2] + sums[3];
+	}
+
+	histogram_scalar(&cells[vectors * 4], words - vectors * 4, bits, histogram);
+}
+
+/* Adds the counters of the words to histogram, which has 1 << bits buckets */
+void histogram_count(const uint64_t *cells, size_t words, uint32_t bits, uint64_t *histogram) {
+	__builtin_cpu_init();
+
+	if (bits <= 4 && __builtin_cpu_supports("avx2"))
+		histogram_avx2(cells, words, bits, histogram);
+	else
+		histogram_scalar(cells, words, bits, histogram);
+}
+
+#endif
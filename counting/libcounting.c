@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "counting.h"
+#include "libcounting.h"
+
+/*
+ * The library keeps the shards of the counting tool behind an rwlock: the
+ * batches are added under the read lock, so that any number of threads can
+ * count at once, the snapshots and the reset take the write lock because the
+ * bitmaps must not change while they are counted.
+ */
+
+// Numbers counted by the engine at once, it takes an int
+#define LIBCOUNTING_MAX_CALL (1 << 30)
+
+struct libcounting {
+	struct tree_owner *trees;
+	uint32_t shards_count;
+	uint32_t threads;
+	enum counting_layout layout;
+	uint32_t counter_bits;
+	enum counting_alloc alloc;
+	count_numbers_fn count_numbers;
+	uint64_t numbers;
+	pthread_rwlock_t lock;
+};
+
+/* Returns fresh shards, or NULL if the memory can't be allocated */
+static struct tree_owner *libcounting_prepare(struct libcounting *ctx) {
+	uint64_t shard_size = COUNTING_MAX_INPUT / ctx->shards_count;
+	struct tree_owner *trees;
+	int res;
+
+	trees = calloc(ctx->shards_count, sizeof(struct tree_owner));
+	if (!trees)
+		return NULL;
+
+	if (ctx->layout == COUNTING_LAYOUT_COUNTERS) {
+		res = prepare_shards_counters(trees, ctx->shards_count, shard_size, ctx->counter_bits,
+				ctx->alloc);
+	} else {
+		res = prepare_shards_alloc(trees, ctx->shards_count, shard_size, ctx->layout, ctx->alloc);
+	}
+
+	if (res != 0) {
+		free(trees);
+		return NULL;
+	}
+
+	return trees;
+}
+
+struct libcounting *libcounting_create(const struct libcounting_params *params) {
+	struct libcounting_params defaults = {};
+	enum counting_engine engine = COUNTING_ENGINE_LOCKED;
+	struct libcounting *ctx;
+
+	if (!params)
+		params = &defaults;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+
+	ctx->shards_count = params->shards ? params->shards : SHARDS;
+	ctx->threads = params->threads ? params->threads : THREAD_COUNT;
+	ctx->layout = params->layout ? counting_layout_from_name(params->layout) :
+		COUNTING_LAYOUT_SPLIT;
+	ctx->counter_bits = params->counter_bits ? params->counter_bits :
+		COUNTING_DEFAULT_COUNTER_BITS;
+	ctx->alloc = params->alloc ? counting_alloc_from_name(params->alloc) : COUNTING_ALLOC_CALLOC;
+	if (params->engine)
+		engine = counting_engine_from_name(params->engine);
+
+	// The containers of the adaptive layout grow while the batches are added
+	if (engine == COUNTING_ENGINE_MAX || ctx->layout == COUNTING_LAYOUT_MAX ||
+			ctx->layout == COUNTING_LAYOUT_ADAPTIVE ||
+			ctx->alloc == COUNTING_ALLOC_MAX || ctx->shards_count > COUNTING_MAX_SHARDS ||
+			(ctx->counter_bits != 2 && ctx->counter_bits != 4 && ctx->counter_bits != 8))
+		goto free_ctx;
+	ctx->count_numbers = counting_engine_get(engine);
+
+	ctx->trees = libcounting_prepare(ctx);
+	if (!ctx->trees)
+		goto free_ctx;
+
+	if (pthread_rwlock_init(&ctx->lock, NULL) != 0)
+		goto destroy_trees;
+
+	return ctx;
+
+destroy_trees:
+	destroy_shards(ctx->trees, ctx->shards_count);
+	free(ctx->trees);
+free_ctx:
+	free(ctx);
+	return NULL;
+}
+
+void libcounting_free(struct libcounting *ctx) {
+	int res;
+
+	if (!ctx)
+		return;
+
+	destroy_shards(ctx->trees, ctx->shards_count);
+	res = pthread_rwlock_destroy(&ctx->lock);
+	assert(res == 0);
+	free(ctx->trees);
+	free(ctx);
+}
+
+void libcounting_add_batch(struct libcounting *ctx, const uint32_t *values, size_t count) {
+	size_t done, len;
+	int res;
+
+	res = pthread_rwlock_rdlock(&ctx->lock);
+	assert(res == 0);
+
+	// The engines only read the numbers
+	for (done = 0; done < count; done += len) {
+		len = count - done < LIBCOUNTING_MAX_CALL ? count - done : LIBCOUNTING_MAX_CALL;
+		ctx->count_numbers((uint32_t *)&values[done], len, ctx->trees);
+	}
+	__atomic_add_fetch(&ctx->numbers, count, __ATOMIC_RELAXED);
+
+	res = pthread_rwlock_unlock(&ctx->lock);
+	assert(res == 0);
+}
+
+int libcounting_snapshot(struct libcounting *ctx, struct libcounting_snapshot *snapshot) {
+	int res, ret;
+
+	res = pthread_rwlock_wrlock(&ctx->lock);
+	assert(res == 0);
+
+	// Only the shards changed since the previous snapshot are counted again
+	ret = counting_finalize(ctx->trees, ctx->shards_count, ctx->threads);
+	if (ret == 0) {
+		snapshot->numbers = ctx->numbers;
+		snapshot->unique = aggregate_unique_numbers(ctx->trees, ctx->shards_count);
+		snapshot->seen_only_once = aggregate_seen_only_once(ctx->trees, ctx->shards_count);
+	}
+
+	res = pthread_rwlock_unlock(&ctx->lock);
+	assert(res == 0);
+
+	return ret;
+}
+
+int libcounting_reset(struct libcounting *ctx) {
+	struct tree_owner *trees;
+	int res;
+
+	// Before dropping the old ones, which are kept if there is no memory for new ones
+	trees = libcounting_prepare(ctx);
+	if (!trees)
+		return 1;
+
+	res = pthread_rwlock_wrlock(&ctx->lock);
+	assert(res == 0);
+
+	destroy_shards(ctx->trees, ctx->shards_count);
+	free(ctx->trees);
+	ctx->trees = trees;
+	ctx->numbers = 0;
+
+	res = pthread_rwlock_unlock(&ctx->lock);
+	assert(res == 0);
+
+	return 0;
+}
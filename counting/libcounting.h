@@ -0,0 +1,58 @@
+#ifndef __LIBCOUNTING_H__
+#define __LIBCOUNTING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Counting as a library, for callers holding the numbers in memory. Built as
+ * libcounting.a and libcounting.so by make, only the functions below are
+ * exported. Numbers may be added from any number of threads at once, the
+ * snapshots and the reset wait for the batches being added.
+ */
+
+#define LIBCOUNTING_API __attribute__((visibility("default")))
+
+struct libcounting;
+
+/*
+ * Runtime parameters, zeroed fields and NULL names take the defaults of the
+ * counting tool. The names are the ones of its -e, -l and -a options.
+ */
+struct libcounting_params {
+	// "locked" or "atomic"
+	const char *engine;
+	// "split", "interleaved" or "counters", the adaptive layout isn't supported
+	// because a batch may need memory and there is no way to report its failure
+	const char *layout;
+	// Of the counters layout, 2, 4 or 8
+	uint32_t counter_bits;
+	// "calloc", "thp" or "hugetlb"
+	const char *alloc;
+	uint32_t shards;
+	// Threads counting the bitmaps for a snapshot
+	uint32_t threads;
+};
+
+struct libcounting_snapshot {
+	uint64_t numbers;
+	uint64_t unique;
+	uint64_t seen_only_once;
+};
+
+/* Returns NULL if the parameters are invalid or the memory can't be allocated */
+LIBCOUNTING_API struct libcounting *libcounting_create(const struct libcounting_params *params);
+LIBCOUNTING_API void libcounting_free(struct libcounting *ctx);
+
+LIBCOUNTING_API void libcounting_add_batch(struct libcounting *ctx, const uint32_t *values,
+		size_t count);
+/* Returns 1 if the results can't be computed */
+LIBCOUNTING_API int libcounting_snapshot(struct libcounting *ctx,
+		struct libcounting_snapshot *snapshot);
+/*
+ * Forgets all the numbers added so far. Returns 1 if the memory for the new
+ * bitmaps can't be allocated, the numbers are kept then.
+ */
+LIBCOUNTING_API int libcounting_reset(struct libcounting *ctx);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <stdint.h>
@@ -6,127 +7,1874 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "counting.h"
+#include "scatter.c"
+#include "../common/uring_reader.c"
+#include "../common/autotune.c"
+#include "numa.c"
+#include "approx.c"
+#include "partition.c"
+#include "checkpoint.c"
+#include "stream.c"
+#include "export.c"
+#include "text.c"
+#include "block.c"
 #include "config.h"
 
-struct tree_owner trees[SHARDS] = {};
+struct tree_owner *trees;
+
+enum input_method {
+	INPUT_PREAD,
+	INPUT_MMAP,
+	INPUT_URING,
+	// Set with -f text, decimal numbers parsed from the mapped input
+	INPUT_TEXT,
+};
+
+// Set with -f, the last one given wins
+enum input_format {
+	FORMAT_BINARY,
+	FORMAT_TEXT,
+	FORMAT_BLOCK,
+};
+
+/*
+ * The input is split into small chunks handed out to the workers on demand, so
+ * that a slow worker doesn't hold up the others at the end of the run.
+ */
+struct chunk_queue {
+	uint64_t next;
+	uint64_t end;
+	uint64_t chunk_size;
+	// Bytes counted so far, for the progress log
+	uint64_t processed;
+};
 
 struct pthread_ctx {
-	uint32_t start_pos;
-	uint32_t end_pos;
+	// The chunk being counted
+	uint64_t start_pos;
+	uint64_t end_pos;
+	struct chunk_queue *queue;
+	uint32_t threads_count;
 	int file_descryptor;
 	int shard_id;
+	count_numbers_fn count_numbers;
+	struct scatter_ctx *scatter;
+	// Set with -e approx, the numbers only go to the sketch of the worker
+	struct approx_sketch *sketch;
+	// Set with -e partitioned, the numbers are spilled to the partitions
+	struct partition_worker *partition;
+	enum input_method input;
+	// With FORMAT_BLOCK, every batch read is a block decoded into decoded
+	enum input_format format;
+	uint32_t *decoded;
+	const uint32_t *mapped_file;
+	uint64_t file_size;
+	unsigned uring_depth;
+	// Set with -n, the worker is pinned to the CPU and its shards live on the node
+	struct numa_topology *numa;
+	int cpu;
+	uint32_t node;
+	uint32_t shards_count;
+	// Numbers counted and the sampled bitmap accesses hitting another node
+	uint64_t numbers;
+	uint64_t sampled;
+	uint64_t remote;
+	// Collected with -j, the time is split between reading and counting the batches
+	struct counting_stats *stats;
+	uint64_t input_ns;
+	uint64_t count_ns;
+	uint64_t last_batch_ns;
+};
+
+// Where -j writes the statistics, SIGUSR1 asks for a snapshot during the run
+static const char *stats_path;
+static int stats_requested;
+static struct pthread_ctx **stats_workers;
+// Set once every worker was started, requests wait for it until then
+static uint32_t stats_workers_count;
+// Held while a snapshot is written, they all go through the same temporary file
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Periodic checkpoints, see checkpoint.c. One is taken once every worker has
+ * finished its chunk and waits for the next one, at that point the counted
+ * input is exactly the chunks handed out so far, a prefix of the file.
+ */
+struct checkpoint_sync {
+	const char *path;
+	uint64_t interval_ns;
+	// When the next checkpoint is due, in ns since run_start
+	uint64_t next_ns;
+	pthread_mutex_t lock;
+	pthread_cond_t resumed;
+	// Workers still taking chunks and those of them waiting for the checkpoint
+	uint32_t active;
+	uint32_t paused;
+	uint64_t generation;
+	uint32_t shards_count;
+	uint64_t file_size;
+	struct chunk_queue *queue;
+};
+
+static struct checkpoint_sync checkpoint = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.resumed = PTHREAD_COND_INITIALIZER,
+};
+
+// Set with --export, the values are written once the results are counted
+static struct {
+	const char *path;
+	enum export_values values;
+	enum export_format format;
+} export_request = {
+	.values = EXPORT_VALUES_MAX,
+	.format = EXPORT_FORMAT_RAW,
 };
 
 #define MIN(__A, __B) (__A < __B ? __A : __B)
 
-#define READ_BATCH_SIZE 16384
-#define LOG_INTERVAL (READ_BATCH_SIZE * 256)
+// A batch is a block of -f block
+#define READ_BATCH_SIZE (BLOCK_BYTES / sizeof(uint32_t))
+#define LOG_INTERVAL (256ULL * 1024 * 1024)
+
+// In MB, a multiple of the page size and of the size of a number
+#define DEFAULT_CHUNK_SIZE 16
+#define MAX_CHUNK_SIZE 4096
+
+#define URING_DEFAULT_DEPTH 4
+// In seconds
+#define CHECKPOINT_DEFAULT_INTERVAL 60
+// In seconds, the snapshots of a stream
+#define STREAM_DEFAULT_INTERVAL 10
+// In MB, the memory cap of -e partitioned
+#define PARTITION_DEFAULT_MEMORY 64
+// Numbers of a batch checked for the node of their shard
+#define NUMA_SAMPLES_PER_BATCH 64
+
+#define MAX_THREADS 1024
+// Shards per worker picked by -s auto at least, keeps the rwlock contention low
+#define AUTO_SHARDS_PER_THREAD 4
+// Both bitmaps of the whole input range
+#define BITMAPS_SIZE (2 * (COUNTING_MAX_INPUT / 8 + 1))
+
+static struct timespec run_start;
+// When the first batch was counted, in ns since run_start
+static uint64_t first_value_ns;
+
+static uint64_t run_time_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - run_start.tv_sec) * 1000000000ULL + now.tv_nsec - run_start.tv_nsec;
+}
+
+/* Node of the worker owning the shard, which its bitmaps were bound to */
+static uint32_t shard_node(struct pthread_ctx *ctx, uint32_t shard) {
+	uint32_t owner = (uint64_t)shard * ctx->threads_count / ctx->shards_count;
+
+	return numa_worker_node(ctx->numa, owner, ctx->threads_count);
+}
+
+static void sample_remote(struct pthread_ctx *ctx, uint32_t *arr, int count) {
+	int step = count / NUMA_SAMPLES_PER_BATCH + 1;
+	uint32_t shard;
+	int i;
+
+	for (i = 0; i < count; i += step) {
+		shard = get_shard(trees, arr[i]) - trees;
+		ctx->remote += shard_node(ctx, shard) != ctx->node;
+		ctx->sampled++;
+	}
+}
+
+static void write_stats(int final);
+
+static void count_batch(struct pthread_ctx *ctx, struct scatter_worker *scatter_worker,
+		uint32_t *arr, int count) {
+	uint64_t none = 0;
+	uint64_t start = 0;
+
+	ctx->numbers += count;
+	if (ctx->numa)
+		sample_remote(ctx, arr, count);
+
+	if (ctx->stats) {
+		start = run_time_ns();
+		ctx->input_ns += start - ctx->last_batch_ns;
+	}
+
+	if (ctx->sketch) {
+		if (approx_add(ctx->sketch, arr, count) != 0) {
+			printf("Worker %d: failed to grow the sample of the sketch\n", ctx->shard_id);
+			exit(1);
+		}
+	} else if (ctx->partition)
+		partition_numbers(ctx->partition, arr, count);
+	else if (ctx->scatter)
+		scatter_numbers(scatter_worker, arr, count);
+	else
+		ctx->count_numbers(arr, count, trees);
+
+	if (ctx->stats) {
+		ctx->last_batch_ns = run_time_ns();
+		ctx->count_ns += ctx->last_batch_ns - start;
+
+		if (__atomic_load_n(&stats_requested, __ATOMIC_RELAXED) &&
+				__atomic_load_n(&stats_workers_count, __ATOMIC_ACQUIRE) &&
+				__atomic_exchange_n(&stats_requested, 0, __ATOMIC_RELAXED))
+			write_stats(0);
+	}
+
+	if (__atomic_load_n(&first_value_ns, __ATOMIC_RELAXED) == 0) {
+		__atomic_compare_exchange_n(&first_value_ns, &none, run_time_ns(), 0,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	}
+}
+
+/* Decodes a block of -f block, a corrupted one stops the run */
+static void count_block(struct pthread_ctx *ctx, struct scatter_worker *scatter_worker,
+		const char *block, uint64_t size, uint64_t offset) {
+	uint32_t count;
+
+	if (block_decode(block, size, ctx->decoded, &count) != 0) {
+		printf("Worker %d: invalid block at byte %lu of the input\n", ctx->shard_id, offset);
+		exit(1);
+	}
+
+	if (count > 0)
+		count_batch(ctx, scatter_worker, ctx->decoded, count);
+}
+
+static void advise_mapped_range(struct pthread_ctx *ctx, uint64_t begin, uint64_t end, int advice) {
+	uint64_t page_size = sysconf(_SC_PAGESIZE);
+
+	begin &= ~(page_size - 1);
+	end = MIN(end, ctx->file_size);
+	if (begin >= end)
+		return;
+
+	madvise((char *)ctx->mapped_file + begin, end - begin, advice);
+}
+
+/* Takes the next chunk of the input, returns 0 once the whole input was handed out */
+static int chunk_queue_next(struct chunk_queue *queue, uint64_t *start, uint64_t *end) {
+	uint64_t begin = __atomic_fetch_add(&queue->next, queue->chunk_size, __ATOMIC_RELAXED);
+
+	if (begin >= queue->end)
+		return 0;
+
+	*start = begin;
+	*end = MIN(begin + queue->chunk_size, queue->end);
+
+	return 1;
+}
+
+static void log_progress(struct pthread_ctx *ctx, uint64_t bytes) {
+	struct chunk_queue *queue = ctx->queue;
+	uint64_t processed = __atomic_add_fetch(&queue->processed, bytes, __ATOMIC_RELAXED);
+
+	if (processed / LOG_INTERVAL != (processed - bytes) / LOG_INTERVAL) {
+		printf("Worker %d: processed %.2f%% of the input\n", ctx->shard_id,
+				100 * ((float)processed / (float)queue->end));
+	}
+}
+
+static void pread_counting(struct pthread_ctx *ctx, struct scatter_worker *scatter_worker,
+		uint32_t *arr) {
+	uint64_t file_position = ctx->start_pos;
+	uint64_t read_size;
+	ssize_t read_bytes;
+
+	while (file_position < ctx->end_pos) {
+		read_size = MIN(READ_BATCH_SIZE * sizeof(uint32_t), ctx->end_pos - file_position);
+
+		read_bytes = pread(ctx->file_descryptor, arr, read_size, file_position);
+		if (read_bytes < 1) {
+			if (read_bytes < 0)
+				printf("Worker %d: failed to read the input\n", ctx->shard_id);
+			break;
+		}
+
+		if (ctx->format == FORMAT_BLOCK)
+			count_block(ctx, scatter_worker, (char *)arr, read_bytes, file_position);
+		else
+			count_batch(ctx, scatter_worker, arr, read_bytes / sizeof(uint32_t));
+
+		file_position += read_bytes;
+	}
+}
+
+/*
+ * Counts the numbers straight from the mapped input file. The chunk the worker
+ * will likely take next is read in ahead of time and the processed one is
+ * dropped from the mapping, so that inputs larger than RAM don't pressure the
+ * page cache.
+ */
+static void mapped_counting(struct pthread_ctx *ctx, struct scatter_worker *scatter_worker) {
+	uint64_t file_position = ctx->start_pos;
+	uint64_t ahead = ctx->start_pos + (uint64_t)ctx->threads_count * ctx->queue->chunk_size;
+	uint64_t read_size;
+
+	advise_mapped_range(ctx, ahead, ahead + ctx->queue->chunk_size, MADV_WILLNEED);
+
+	while (file_position + sizeof(uint32_t) <= ctx->end_pos) {
+		read_size = MIN(READ_BATCH_SIZE * sizeof(uint32_t), ctx->end_pos - file_position);
+
+		if (ctx->format == FORMAT_BLOCK) {
+			count_block(ctx, scatter_worker,
+					(const char *)ctx->mapped_file + file_position, read_size,
+					file_position);
+		} else {
+			count_batch(ctx, scatter_worker,
+					(uint32_t *)&ctx->mapped_file[file_position / sizeof(uint32_t)],
+					read_size / sizeof(uint32_t));
+		}
+
+		file_position += read_size;
+	}
+
+	advise_mapped_range(ctx, ctx->start_pos, ctx->end_pos, MADV_DONTNEED);
+}
+
+/* Parses the lines starting in the chunk, a malformed one stops the run */
+static void text_counting(struct pthread_ctx *ctx, struct scatter_worker *scatter_worker,
+		uint32_t *arr) {
+	uint64_t ahead = ctx->start_pos + (uint64_t)ctx->threads_count * ctx->queue->chunk_size;
+	struct text_parser parser;
+	uint32_t count;
+
+	advise_mapped_range(ctx, ahead, ahead + ctx->queue->chunk_size, MADV_WILLNEED);
+
+	text_parser_init(&parser, (const char *)ctx->mapped_file, ctx->file_size, ctx->start_pos,
+			ctx->end_pos);
+	do {
+		count = text_parse(&parser, arr, READ_BATCH_SIZE);
+		if (count > 0)
+			count_batch(ctx, scatter_worker, arr, count);
+	} while (count == READ_BATCH_SIZE);
+
+	if (parser.error != TEXT_OK) {
+		printf("Worker %d: %s at byte %lu of the input\n", ctx->shard_id,
+				text_error_name(parser.error), parser.position);
+		exit(1);
+	}
+
+	advise_mapped_range(ctx, ctx->start_pos, ctx->end_pos, MADV_DONTNEED);
+}
+
+/*
+ * Keeps several batches being read with io_uring while the current one is
+ * counted. The reader falls back to pread if io_uring isn't available.
+ */
+static void uring_counting(struct pthread_ctx *ctx, struct scatter_worker *scatter_worker,
+		struct uring_reader *reader) {
+	uint64_t file_position;
+	int64_t read_bytes;
+	char *buffer;
+
+	if (uring_reader_restart(reader, ctx->start_pos, ctx->end_pos) != 0) {
+		printf("Worker %d: failed to read the input\n", ctx->shard_id);
+		exit(1);
+	}
+
+	while ((read_bytes = uring_reader_next(reader, &buffer, &file_position)) > 0) {
+		if (ctx->format == FORMAT_BLOCK)
+			count_block(ctx, scatter_worker, buffer, read_bytes, file_position);
+		else
+			count_batch(ctx, scatter_worker, (uint32_t *)buffer, read_bytes / sizeof(uint32_t));
+	}
+
+	if (read_bytes < 0) {
+		printf("Worker %d: failed to read the input\n", ctx->shard_id);
+		exit(1);
+	}
+}
+
+/* Called with the lock held once every active worker waits */
+static void checkpoint_take(void) {
+	uint64_t consumed = MIN(checkpoint.queue->next, checkpoint.queue->end);
+	uint64_t start = run_time_ns();
+	int res;
+
+	if (checkpoint_save(checkpoint.path, trees, checkpoint.shards_count, checkpoint.file_size,
+				consumed) != 0) {
+		printf("Failed to write the checkpoint to %s\n", checkpoint.path);
+	} else {
+		printf("Checkpoint: %lu of %lu bytes counted, written in %.3f s\n", consumed,
+				checkpoint.file_size, (run_time_ns() - start) / 1e9);
+	}
+
+	checkpoint.paused = 0;
+	checkpoint.generation++;
+	__atomic_store_n(&checkpoint.next_ns, run_time_ns() + checkpoint.interval_ns,
+			__ATOMIC_RELAXED);
+	res = pthread_cond_broadcast(&checkpoint.resumed);
+	assert(res == 0);
+}
+
+/* Waits between chunks for the others if a checkpoint is due */
+static void checkpoint_pause(void) {
+	uint64_t generation;
+	int res;
+
+	if (run_time_ns() < __atomic_load_n(&checkpoint.next_ns, __ATOMIC_RELAXED))
+		return;
+
+	res = pthread_mutex_lock(&checkpoint.lock);
+	assert(res == 0);
+
+	// Unless it was taken while the lock was being acquired
+	if (run_time_ns() >= checkpoint.next_ns) {
+		checkpoint.paused++;
+		if (checkpoint.paused == checkpoint.active) {
+			checkpoint_take();
+		} else {
+			generation = checkpoint.generation;
+			while (generation == checkpoint.generation) {
+				res = pthread_cond_wait(&checkpoint.resumed, &checkpoint.lock);
+				assert(res == 0);
+			}
+		}
+	}
+
+	res = pthread_mutex_unlock(&checkpoint.lock);
+	assert(res == 0);
+}
+
+/* The workers won't take any more chunks, the checkpoint may be waiting for them */
+static void checkpoint_leave(uint32_t workers) {
+	int res;
+
+	res = pthread_mutex_lock(&checkpoint.lock);
+	assert(res == 0);
+
+	checkpoint.active -= workers;
+	if (checkpoint.paused > 0 && checkpoint.paused == checkpoint.active)
+		checkpoint_take();
+
+	res = pthread_mutex_unlock(&checkpoint.lock);
+	assert(res == 0);
+}
 
 void *sharded_counting(void *param) {
 	struct pthread_ctx *ctx = param;
-	uint32_t file_position = 0;
-	int read_bytes;
-	int read_size;
-	uint32_t arr[READ_BATCH_SIZE] = {};
-	uint32_t log_threshold = ctx->start_pos % LOG_INTERVAL;
+	uint32_t arr[READ_BATCH_SIZE];
+	struct scatter_worker scatter_worker;
+	struct uring_reader reader;
+	uint32_t chunks = 0;
+	cpu_set_t cpus;
+
+	if (ctx->numa && ctx->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(ctx->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+			printf("Worker %d: failed to pin to CPU %d\n", ctx->shard_id, ctx->cpu);
+	}
+
+	if (ctx->scatter && scatter_worker_init(&scatter_worker, ctx->scatter, ctx->shard_id) != 0) {
+		printf("Worker %d: failed to allocate the scatter buffers\n", ctx->shard_id);
+		exit(1);
+	}
+
+	if (ctx->format == FORMAT_BLOCK) {
+		ctx->decoded = malloc(BLOCK_MAX_VALUES * sizeof(uint32_t));
+		if (!ctx->decoded) {
+			printf("Worker %d: failed to allocate the decoded block\n", ctx->shard_id);
+			exit(1);
+		}
+	}
+
+	if (ctx->stats) {
+		counting_stats_attach(ctx->stats);
+		ctx->last_batch_ns = run_time_ns();
+	}
+
+	if (ctx->input == INPUT_URING) {
+		// Set up once, every chunk reuses the ring and the buffers
+		if (uring_reader_init(&reader, ctx->file_descryptor, 0, 0,
+					READ_BATCH_SIZE * sizeof(uint32_t), ctx->uring_depth) != 0) {
+			printf("Worker %d: failed to initialize the reader\n", ctx->shard_id);
+			exit(1);
+		}
+
+		if (!reader.use_uring)
+			printf("Worker %d: io_uring unavailable, reading with pread\n", ctx->shard_id);
+	}
 
 	printf("Worker %d: STARTED\n", ctx->shard_id);
-	file_position = ctx->start_pos;
 
 	while (1) {
-		read_size = MIN(sizeof(arr), ctx->end_pos - file_position);
+		if (checkpoint.path)
+			checkpoint_pause();
+		if (!chunk_queue_next(ctx->queue, &ctx->start_pos, &ctx->end_pos))
+			break;
+
+		if (ctx->input == INPUT_MMAP)
+			mapped_counting(ctx, &scatter_worker);
+		else if (ctx->input == INPUT_TEXT)
+			text_counting(ctx, &scatter_worker, arr);
+		else if (ctx->input == INPUT_URING)
+			uring_counting(ctx, &scatter_worker, &reader);
+		else
+			pread_counting(ctx, &scatter_worker, arr);
 
-		if (read_size < sizeof(arr))
-			memset(arr, 0, sizeof(arr));
+		chunks++;
+		log_progress(ctx, ctx->end_pos - ctx->start_pos);
+	}
 
-		read_bytes = pread(ctx->file_descryptor, arr, read_size, file_position);
-		if (read_bytes < 1)
+	if (checkpoint.path)
+		checkpoint_leave(1);
+
+	if (ctx->input == INPUT_URING) {
+		printf("Worker %d: waited %.3f s for I/O\n", ctx->shard_id, uring_reader_wait_time(&reader));
+		uring_reader_deinit(&reader);
+	}
+
+	if (ctx->scatter)
+		scatter_worker_finish(&scatter_worker);
+	if (ctx->partition)
+		partition_worker_finish(ctx->partition);
+
+	counting_stats_attach(NULL);
+	free(ctx->decoded);
+
+	printf("Worker %d: FINISHED, counted %u chunks\n", ctx->shard_id, chunks);
+
+	return NULL;
+}
+
+static double elapsed_seconds(struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Binds the bitmaps of every shard to the node of the worker owning it */
+static int numa_place_shards(struct numa_topology *numa, uint32_t shards_count,
+		uint32_t threads_count) {
+	uint32_t j, owner;
+
+	for (j = 0; j < shards_count; j++) {
+		owner = (uint64_t)j * threads_count / shards_count;
+		if (numa_bind(numa, trees[j].added_once, trees[j].mapping_size,
+					numa_worker_node(numa, owner, threads_count)) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Numbers counted by the workers of every node and the share of the sampled
+ * ones whose shard lives on another node. With owned shards the bitmaps are
+ * only accessed by their owners, so it's the share handed over across nodes.
+ */
+static void numa_report(struct numa_topology *numa, struct pthread_ctx **thread_params,
+		uint32_t threads_count, int owned_shards, double elapsed) {
+	uint64_t numbers, sampled, remote;
+	uint32_t node, i, workers;
+
+	for (node = 0; node < numa->nodes_count; node++) {
+		numbers = sampled = remote = workers = 0;
+
+		for (i = 0; i < threads_count; i++) {
+			if (!thread_params[i] || thread_params[i]->node != node)
+				continue;
+			workers++;
+			numbers += thread_params[i]->numbers;
+			sampled += thread_params[i]->sampled;
+			remote += thread_params[i]->remote;
+		}
+
+		printf("Node %u: %u workers, %lu numbers (%.2f M numbers/s), %.2f%% %s\n",
+				numa->node_ids[node], workers, numbers, numbers / elapsed / 1e6,
+				sampled ? 100.0 * remote / sampled : 0.0,
+				owned_shards ? "handed over to other nodes" : "remote bitmap accesses");
+	}
+}
+
+static void request_stats(int signal) {
+	(void)signal;
+	__atomic_store_n(&stats_requested, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Writes the statistics of every worker and every shard as JSON. Snapshots
+ * taken during the run read the counters of the other workers without any
+ * synchronization, so they may be slightly behind. The file is replaced
+ * atomically and the writers take turns, a reader never sees a partial one.
+ */
+static void write_stats(int final) {
+	struct counting_shard_stats shard, total = {};
+	struct pthread_ctx *worker;
+	uint64_t fast_path, slow_path, max_values = 0;
+	char tmp_path[4096];
+	uint32_t i, j;
+	FILE *file;
+	int res;
+
+	res = pthread_mutex_lock(&stats_lock);
+	assert(res == 0);
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_path);
+	file = fopen(tmp_path, "w");
+	if (!file) {
+		printf("Failed to write the statistics to %s\n", stats_path);
+		goto unlock;
+	}
+
+	fprintf(file, "{\"final\": %s, \"elapsed_s\": %.3f, \"threads\": %u, \"shards\": %lu,\n",
+			final ? "true" : "false", run_time_ns() / 1e9, stats_workers_count,
+			stats_workers[0]->stats->shards_count);
+
+	fprintf(file, "\"workers\": [\n");
+	for (i = 0; i < stats_workers_count; i++) {
+		worker = stats_workers[i];
+		memset(&shard, 0, sizeof(shard));
+		for (j = 0; j < worker->stats->shards_count; j++) {
+			shard.lock_acquisitions += worker->stats->shards[j].lock_acquisitions;
+			shard.lock_contended += worker->stats->shards[j].lock_contended;
+			shard.lock_wait_ns += worker->stats->shards[j].lock_wait_ns;
+		}
+
+		fprintf(file, "  {\"id\": %u, \"values\": %lu, \"input_s\": %.6f, \"count_s\": %.6f, "
+				"\"fast_path\": %lu, \"slow_path\": %lu, \"lock_acquisitions\": %lu, "
+				"\"lock_contended\": %lu, \"lock_wait_s\": %.6f}%s\n",
+				i, worker->numbers, worker->input_ns / 1e9, worker->count_ns / 1e9,
+				worker->stats->fast_path, worker->stats->slow_path,
+				shard.lock_acquisitions, shard.lock_contended, shard.lock_wait_ns / 1e9,
+				i + 1 < stats_workers_count ? "," : "");
+	}
+	fprintf(file, "],\n");
+
+	// The shard totals over all workers, with owned shards only the owner counts them
+	fprintf(file, "\"shards\": [\n");
+	fast_path = slow_path = 0;
+	for (j = 0; j < stats_workers[0]->stats->shards_count; j++) {
+		memset(&shard, 0, sizeof(shard));
+		for (i = 0; i < stats_workers_count; i++) {
+			shard.values += stats_workers[i]->stats->shards[j].values;
+			shard.lock_acquisitions += stats_workers[i]->stats->shards[j].lock_acquisitions;
+			shard.lock_contended += stats_workers[i]->stats->shards[j].lock_contended;
+			shard.lock_wait_ns += stats_workers[i]->stats->shards[j].lock_wait_ns;
+		}
+
+		total.values += shard.values;
+		if (shard.values > max_values)
+			max_values = shard.values;
+
+		fprintf(file, "  {\"id\": %u, \"values\": %lu, \"lock_acquisitions\": %lu, "
+				"\"lock_contended\": %lu, \"lock_wait_s\": %.6f}%s\n",
+				j, shard.values, shard.lock_acquisitions, shard.lock_contended,
+				shard.lock_wait_ns / 1e9,
+				j + 1 < stats_workers[0]->stats->shards_count ? "," : "");
+	}
+	fprintf(file, "],\n");
+
+	for (i = 0; i < stats_workers_count; i++) {
+		fast_path += stats_workers[i]->stats->fast_path;
+		slow_path += stats_workers[i]->stats->slow_path;
+	}
+
+	// Load of the busiest shard relative to the mean, 1 means perfectly even
+	fprintf(file, "\"fast_path\": %lu, \"slow_path\": %lu, \"shard_skew\": %.3f}\n",
+			fast_path, slow_path, total.values ?
+			(double)max_values * stats_workers[0]->stats->shards_count / total.values : 0.0);
+
+	if (fclose(file) != 0 || rename(tmp_path, stats_path) != 0)
+		printf("Failed to write the statistics to %s\n", stats_path);
+
+unlock:
+	res = pthread_mutex_unlock(&stats_lock);
+	assert(res == 0);
+}
+
+/* The histogram of the counters and the values seen at least min_count times, if given */
+static void print_histogram(uint32_t min_count, uint32_t shards_count) {
+	uint64_t histogram[HISTOGRAM_MAX_BUCKETS];
+	uint32_t buckets, k;
+	uint32_t *values;
+	uint64_t found, i;
+
+	buckets = counting_histogram(trees, shards_count, histogram);
+	for (k = 1; k + 1 < buckets; k++)
+		printf("Seen exactly %u times %lu\n", k, histogram[k]);
+	printf("Seen at least %u times %lu\n", buckets - 1, histogram[buckets - 1]);
+
+	if (min_count == 0)
+		return;
+
+	found = counting_values_at_least(trees, shards_count, min_count, NULL, 0);
+	values = malloc(found * sizeof(uint32_t) + 1);
+	if (!values) {
+		printf("Failed to allocate the values seen at least %u times\n", min_count);
+		return;
+	}
+
+	counting_values_at_least(trees, shards_count, min_count, values, found);
+	printf("Values seen at least %u times: %lu\n", min_count, found);
+	for (i = 0; i < found; i++)
+		printf("%u\n", values[i]);
+
+	free(values);
+}
+
+/* Merges the sketches of the workers and prints the estimates with their relative standard error */
+/* Returns 1 if the sketches can't be merged */
+static int print_estimates(struct approx_sketch *sketches, uint32_t threads_count) {
+	uint64_t unique, only_once, memory = 0;
+	double unique_error, only_once_error;
+	uint32_t i;
+
+	// The samples grow with the repeated values, every one by itself
+	for (i = 0; i < threads_count; i++)
+		memory += approx_memory(&sketches[i]);
+
+	for (i = 1; i < threads_count; i++) {
+		if (approx_merge(&sketches[0], &sketches[i]) != 0) {
+			printf("Failed to merge the sketches\n");
+			return 1;
+		}
+	}
+
+	approx_estimate(&sketches[0], &unique, &unique_error, &only_once, &only_once_error);
+
+	printf("Sketch memory %.1f MB\n", memory / 1e6);
+	printf("Unique numbers %lu (estimated, error %.2f%%)\n", unique, 100 * unique_error);
+	printf("Seen only once %lu (estimated, error %.2f%%)\n", only_once, 100 * only_once_error);
+
+	return 0;
+}
+
+static int export_results(uint32_t shards_count, uint32_t threads_count) {
+	struct timespec start_time;
+	uint64_t exported;
+	int fd, res;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	fd = open(export_request.path, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+	if (fd < 0) {
+		printf("Failed to open %s\n", export_request.path);
+		return 1;
+	}
+
+	res = counting_export(trees, shards_count, threads_count, export_request.values,
+			export_request.format, fd, &exported);
+	if (close(fd) != 0)
+		res = 1;
+
+	if (res != 0) {
+		printf("Failed to export the values to %s\n", export_request.path);
+		return 1;
+	}
+
+	printf("Exported %lu values seen %s to %s (%s) in %.3f s (%.2f M values/s)\n", exported,
+			export_request.values == EXPORT_VALUES_ONCE ? "only once" : "more than once",
+			export_request.path, export_format_name(export_request.format),
+			elapsed_seconds(&start_time), exported / elapsed_seconds(&start_time) / 1e6);
+
+	return 0;
+}
+
+/*
+ * Counts the whole input into the shards with the engine and the input method
+ * of config, for the inputs of the set operations. Returns 1 if the input
+ * can't be opened or no worker could be started.
+ */
+static int count_input(const char *path, struct tree_owner *shards, struct pthread_ctx *config,
+		uint32_t threads_count, uint64_t chunk_size) {
+	struct chunk_queue queue = {};
+	struct pthread_ctx *params;
+	uint32_t *mapped_file = NULL;
+	pthread_t *threads;
+	uint32_t i, started;
+	int fd, res;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 1;
+
+	queue.end = lseek(fd, 0L, SEEK_END);
+	queue.chunk_size = chunk_size;
+
+	if ((config->input == INPUT_MMAP || config->input == INPUT_TEXT) && queue.end > 0) {
+		mapped_file = mmap(NULL, queue.end, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+		if (mapped_file == MAP_FAILED) {
+			close(fd);
+			return 1;
+		}
+		madvise(mapped_file, queue.end, MADV_SEQUENTIAL);
+	}
+
+	params = calloc(threads_count, sizeof(struct pthread_ctx));
+	threads = calloc(threads_count, sizeof(pthread_t));
+	assert(params != NULL && threads != NULL);
+
+	trees = shards;
+	for (started = 0; started < threads_count; started++) {
+		params[started] = *config;
+		params[started].shard_id = started;
+		params[started].queue = &queue;
+		params[started].threads_count = threads_count;
+		params[started].file_descryptor = fd;
+		params[started].mapped_file = mapped_file;
+		params[started].file_size = queue.end;
+		// The started workers take the chunks of the missing ones
+		res = pthread_create(&threads[started], NULL, sharded_counting, &params[started]);
+		if (res != 0) {
+			printf("Failed to initialize thread %u\n", started);
 			break;
+		}
+	}
 
-		//printf("Start %u, end %u file pos %u, read size %u, read bytes %u\n",
-			//ctx->start_pos, ctx->end_pos, file_position, read_size, read_bytes);
+	for (i = 0; i < started; i++) {
+		res = pthread_join(threads[i], NULL);
+		assert(res == 0);
+	}
 
-		file_position += read_bytes;
-		
-		count_numbers(arr, read_bytes/sizeof(uint32_t), trees);
+	free(threads);
+	free(params);
+	if (mapped_file)
+		munmap(mapped_file, queue.end);
+	close(fd);
+
+	return started == 0;
+}
+
+/*
+ * Builds the bitmaps of every input, counted or mapped from a checkpoint of a
+ * whole input, and prints the cardinalities of the set operations over them.
+ * The first input decides the layout and the shards if it's a checkpoint.
+ */
+static int run_sets(char *paths[], uint32_t inputs_count, struct pthread_ctx *config,
+		enum counting_layout layout, uint32_t counter_bits, enum counting_alloc alloc,
+		uint32_t threads_count, uint32_t shards_count, uint64_t chunk_size) {
+	struct checkpoint_header header;
+	struct tree_owner **inputs;
+	struct counting_sets sets;
+	struct timespec start_time;
+	uint64_t bytes = 0, shards, i;
+	uint32_t k, loaded = 0;
+	int ret = 0, res;
+
+	inputs = calloc(inputs_count, sizeof(struct tree_owner *));
+	assert(inputs != NULL);
+
+	for (k = 0; k < inputs_count; k++) {
+		clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+		if (checkpoint_read_header(paths[k], &header) == 0) {
+			if (header.consumed != header.input_size) {
+				printf("Checkpoint %s doesn't cover the whole input\n", paths[k]);
+				ret = 1;
+				goto destroy;
+			}
+			if (k == 0) {
+				layout = header.layout;
+				counter_bits = header.counter_bits;
+				shards_count = header.shards_count;
+			}
+
+			inputs[k] = calloc(header.shards_count, sizeof(struct tree_owner));
+			assert(inputs[k] != NULL);
+			if (checkpoint_load(paths[k], &header, inputs[k]) != 0) {
+				printf("Failed to map the checkpoint %s\n", paths[k]);
+				free(inputs[k]);
+				inputs[k] = NULL;
+				ret = 1;
+				goto destroy;
+			}
+			loaded++;
+		} else {
+			inputs[k] = calloc(shards_count, sizeof(struct tree_owner));
+			assert(inputs[k] != NULL);
+			if (layout == COUNTING_LAYOUT_COUNTERS) {
+				res = prepare_shards_counters(inputs[k], shards_count,
+						COUNTING_MAX_INPUT / shards_count, counter_bits, alloc);
+			} else {
+				res = prepare_shards_alloc(inputs[k], shards_count,
+						COUNTING_MAX_INPUT / shards_count, layout, alloc);
+			}
+			if (res != 0) {
+				printf("Failed to allocate the bitmaps of %s\n", paths[k]);
+				free(inputs[k]);
+				inputs[k] = NULL;
+				ret = 1;
+				goto destroy;
+			}
+			loaded++;
+
+			if (count_input(paths[k], inputs[k], config, threads_count, chunk_size) != 0) {
+				printf("Failed to count %s\n", paths[k]);
+				ret = 1;
+				goto destroy;
+			}
+		}
+
+		shards = inputs[k][0].index.last_shard + 1;
+		if (counting_finalize(inputs[k], shards, threads_count) != 0) {
+			printf("Failed to finalize the results of %s\n", paths[k]);
+			ret = 1;
+			goto destroy;
+		}
+		printf("Input %u: %s, %s in %.3f s, unique numbers %lu, seen only once %lu\n", k,
+				paths[k], inputs[k][0].alloc == COUNTING_ALLOC_FILE ? "mapped" : "counted",
+				elapsed_seconds(&start_time), aggregate_unique_numbers(inputs[k], shards),
+				aggregate_seen_only_once(inputs[k], shards));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	if (counting_sets(inputs, inputs_count, shards_count, threads_count, &sets) != 0) {
+		printf("The inputs must have the same layout and shards\n");
+		ret = 1;
+		goto destroy;
+	}
+
+	for (i = 0; i < shards_count; i++)
+		bytes += counting_cells(&inputs[0][i]) * sizeof(uint64_t) * inputs_count;
+	printf("Combined %u inputs in %.3f s (%.2f GB/s)\n", inputs_count,
+			elapsed_seconds(&start_time), bytes / elapsed_seconds(&start_time) / 1e9);
+
+	printf("Union %lu\n", sets.union_count);
+	printf("Intersection %lu\n", sets.intersection);
+	printf("Difference %lu\n", sets.difference);
+	printf("Symmetric difference %lu\n", sets.symmetric_difference);
+
+destroy:
+	for (k = 0; k < loaded; k++) {
+		destroy_shards(inputs[k], inputs[k][0].index.last_shard + 1);
+		free(inputs[k]);
+	}
+	free(inputs);
+
+	return ret;
+}
+
+/*
+ * Prints a snapshot of the stream every interval seconds after the previous
+ * one and whenever SIGUSR1 is received, the signal is blocked in every thread
+ * and taken here. Stops once done is set and the signal is sent to the thread.
+ */
+struct stream_snapshots {
+	struct stream_ctx *stream;
+	uint64_t interval;
+	uint32_t threads_count;
+	int done;
+};
+
+static void *stream_snapshots(void *param) {
+	struct stream_snapshots *snapshots = param;
+	struct stream_snapshot snapshot;
+	struct timespec timeout = {.tv_sec = snapshots->interval};
+	sigset_t signals;
+	int res;
 
-		if (file_position % LOG_INTERVAL == log_threshold) {
-			printf("Worker %d: processed %.2f%%\n", ctx->shard_id,
-					100 * ((float)(file_position - ctx->start_pos)/(float)(ctx->end_pos - ctx->start_pos)));
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+
+	while (1) {
+		if (snapshots->interval > 0)
+			res = sigtimedwait(&signals, NULL, &timeout);
+		else
+			res = sigwaitinfo(&signals, NULL);
+
+		if (__atomic_load_n(&snapshots->done, __ATOMIC_RELAXED))
+			break;
+		if (res < 0 && errno != EAGAIN)
+			continue;
+
+		if (stream_snapshot(snapshots->stream, snapshots->threads_count, &snapshot) != 0) {
+			printf("Failed to take a snapshot\n");
+			continue;
 		}
+		printf("Snapshot after %.3f s: counted %lu numbers, %lu queued, unique numbers %lu, "
+				"seen only once %lu\n", run_time_ns() / 1e9, snapshot.counted_numbers,
+				snapshot.read_numbers - snapshot.counted_numbers, snapshot.unique,
+				snapshot.seen_only_once);
+		// Likely read by another program through a pipe
+		fflush(stdout);
 	}
-	printf("Worker %d: FINISHED\n", ctx->shard_id);
 
 	return NULL;
 }
 
+/*
+ * Counts an input which can't be seeked, stdin given as "-" or a FIFO, while
+ * it's being produced, see stream.c. The snapshots don't hold up the reading.
+ */
+static int run_stream(const char *path, count_numbers_fn count_numbers,
+		enum counting_layout layout, uint32_t counter_bits, enum counting_alloc alloc,
+		uint32_t min_count, uint32_t threads_count, uint32_t shards_count, uint64_t interval) {
+	struct stream_snapshots snapshots = {.interval = interval, .threads_count = threads_count};
+	struct stream_ctx stream;
+	struct timespec start_time;
+	pthread_t snapshot_thread;
+	pthread_t *threads;
+	sigset_t signals;
+	uint32_t i, started;
+	int fd, res, snapshots_started, ret = 0;
+
+	fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd < 0) {
+		printf("Failed to open file\n");
+		return 1;
+	}
+
+	trees = calloc(shards_count, sizeof(struct tree_owner));
+	threads = calloc(threads_count, sizeof(pthread_t));
+	if (!trees || !threads) {
+		printf("Failed to allocate the context\n");
+		ret = 1;
+		goto free_ctx;
+	}
+
+	if (layout == COUNTING_LAYOUT_COUNTERS) {
+		ret = prepare_shards_counters(trees, shards_count, COUNTING_MAX_INPUT / shards_count,
+				counter_bits, alloc);
+	} else {
+		ret = prepare_shards_alloc(trees, shards_count, COUNTING_MAX_INPUT / shards_count,
+				layout, alloc);
+	}
+	if (ret != 0) {
+		printf("Failed to allocate the bitmaps\n");
+		goto free_ctx;
+	}
+
+	if (stream_init(&stream, fd, trees, shards_count, count_numbers, threads_count) != 0) {
+		printf("Failed to allocate the stream buffers\n");
+		ret = 1;
+		goto destroy;
+	}
+	snapshots.stream = &stream;
+
+	if (layout == COUNTING_LAYOUT_COUNTERS)
+		printf("Layout: %u-bit counters\n", counter_bits);
+	else
+		printf("Layout: %s\n", counting_layout_name(layout));
+	printf("Threads: %u, shards: %u\n", threads_count, shards_count);
+	if (interval > 0)
+		printf("Streaming %s, snapshots every %lu s and on SIGUSR1\n", path, interval);
+	else
+		printf("Streaming %s, snapshots on SIGUSR1\n", path);
+	fflush(stdout);
+
+	// Inherited by the threads, only the snapshot one takes the signal
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	res = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	assert(res == 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	for (started = 0; started < threads_count; started++) {
+		res = pthread_create(&threads[started], NULL, stream_worker, &stream);
+		if (res != 0) {
+			printf("Failed to initialize thread %u\n", started);
+			break;
+		}
+	}
+	// Nobody would hand the buffers back to the reader
+	if (started == 0) {
+		ret = 1;
+		goto deinit;
+	}
+
+	// The stream is counted all the same, only without the snapshots
+	res = pthread_create(&snapshot_thread, NULL, stream_snapshots, &snapshots);
+	snapshots_started = res == 0;
+	if (!snapshots_started)
+		printf("Failed to initialize the snapshot thread\n");
+
+	if (stream_read(&stream) != 0) {
+		printf("Failed to read the stream\n");
+		ret = 1;
+	}
+
+	for (i = 0; i < started; i++) {
+		res = pthread_join(threads[i], NULL);
+		assert(res == 0);
+	}
+
+	if (snapshots_started) {
+		__atomic_store_n(&snapshots.done, 1, __ATOMIC_RELAXED);
+		res = pthread_kill(snapshot_thread, SIGUSR1);
+		assert(res == 0);
+		res = pthread_join(snapshot_thread, NULL);
+		assert(res == 0);
+	}
+
+	printf("Counted %lu numbers in %.3f s (%.2f M numbers/s)\n", stream.counted_numbers,
+			elapsed_seconds(&start_time),
+			stream.counted_numbers / elapsed_seconds(&start_time) / 1e6);
+
+	if (counting_finalize(trees, shards_count, threads_count) != 0) {
+		printf("Failed to finalize the results\n");
+		ret = 1;
+	} else {
+		printf("Unique numbers %lu\n", aggregate_unique_numbers(trees, shards_count));
+		printf("Seen only once %lu\n", aggregate_seen_only_once(trees, shards_count));
+
+		if (layout == COUNTING_LAYOUT_COUNTERS)
+			print_histogram(min_count, shards_count);
+		if (export_request.path && export_results(shards_count, threads_count) != 0)
+			ret = 1;
+	}
+
+deinit:
+	stream_deinit(&stream);
+destroy:
+	destroy_shards(trees, shards_count);
+free_ctx:
+	free(threads);
+	free(trees);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	return ret;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [-e locked|atomic|approx|partitioned] [-x error] [-M memory_MB] [-d tmp_dir] [--checkpoint path [--checkpoint-interval s] [--resume]] [--snapshot-interval s] [--export once|repeated --export-path path [--export-format raw|varint|text]] [-p shared|owned] [-l split|interleaved|adaptive|counters] [-b counter_bits] [-m min_count] [-i pread|mmap|uring] [-f binary|text|block] [-q depth] [-k scalar|sse4.2|avx2|avx512] [-t threads|auto] [-s shards|auto] [-a calloc|thp|hugetlb] [-z] [-n] [-c chunk_MB] [-j stats.json] <path> [<path>...]\n", name);
+}
+
 int main(int argc, char *argv[]) {	
-	int i;
+	uint32_t i;
 	int res;
-	char *inputfile_name = "random_numbers";
-	uint32_t file_size;
-	uint32_t file_chunk_size;
+	int ret = 0;
+	int opt;
+	uint64_t file_size;
+	uint32_t chunk_size = DEFAULT_CHUNK_SIZE;
+	struct chunk_queue queue = {};
+	enum counting_engine engine = COUNTING_ENGINE_LOCKED;
+	int approx = 0;
+	double approx_error = 0;
+	struct approx_sketch *sketches = NULL;
+	int partitioned = 0;
+	uint64_t partition_memory = 0;
+	const char *tmp_dir = NULL;
+	struct partition_ctx partitions;
+	struct partition_worker *partition_workers = NULL;
+	struct checkpoint_header resumed = {};
+	int resume = 0;
+	uint64_t checkpoint_interval = CHECKPOINT_DEFAULT_INTERVAL;
+	uint64_t snapshot_interval = STREAM_DEFAULT_INTERVAL;
+	struct stat input_stat;
+	static const struct option long_options[] = {
+		{"checkpoint", required_argument, NULL, 'C'},
+		{"checkpoint-interval", required_argument, NULL, 'I'},
+		{"resume", no_argument, NULL, 'R'},
+		{"snapshot-interval", required_argument, NULL, 'S'},
+		{"export", required_argument, NULL, 'E'},
+		{"export-path", required_argument, NULL, 'O'},
+		{"export-format", required_argument, NULL, 'F'},
+		{},
+	};
+	enum counting_layout layout = COUNTING_LAYOUT_SPLIT;
+	uint32_t counter_bits = COUNTING_DEFAULT_COUNTER_BITS;
+	uint32_t min_count = 0;
+	int owned_shards = 0;
+	enum input_method input = INPUT_PREAD;
+	unsigned uring_depth = URING_DEFAULT_DEPTH;
+	enum index_isa index_kernel;
+	uint32_t threads_count = THREAD_COUNT;
+	uint32_t shards_count = SHARDS;
+	enum counting_alloc alloc = COUNTING_ALLOC_CALLOC;
+	int first_touch = 0;
+	enum input_format format = FORMAT_BINARY;
+	uint64_t numbers;
+	int numa_placement = 0;
+	struct numa_topology numa;
+	struct counting_stats *worker_stats = NULL;
+	uint32_t *mapped_file = NULL;
+	struct scatter_ctx scatter = {};
+	struct timespec start_time;
+	double elapsed;
+
+	pthread_t *threads = NULL;
+	struct pthread_ctx **thread_params = NULL;
+
+	while ((opt = getopt_long(argc, argv, "e:x:M:d:p:l:b:m:i:f:q:k:t:s:a:znc:j:", long_options,
+					NULL)) != -1) {
+		switch (opt) {
+		case 'e':
+			if (strcmp(optarg, "approx") == 0) {
+				approx = 1;
+				break;
+			}
+			if (strcmp(optarg, "partitioned") == 0) {
+				partitioned = 1;
+				break;
+			}
+			engine = counting_engine_from_name(optarg);
+			if (engine == COUNTING_ENGINE_MAX) {
+				printf("Unknown engine %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'x':
+			approx_error = atof(optarg);
+			if (approx_error < APPROX_MIN_ERROR || approx_error > APPROX_MAX_ERROR) {
+				printf("Error must be between %g and %g\n", APPROX_MIN_ERROR, APPROX_MAX_ERROR);
+				return 1;
+			}
+			break;
+		case 'M':
+			partition_memory = atoi(optarg);
+			if (partition_memory < 1) {
+				printf("Memory cap must be at least 1 MB\n");
+				return 1;
+			}
+			break;
+		case 'd':
+			tmp_dir = optarg;
+			break;
+		case 'C':
+			checkpoint.path = optarg;
+			break;
+		case 'I':
+			checkpoint_interval = atoi(optarg);
+			if (checkpoint_interval < 1) {
+				printf("Checkpoint interval must be at least 1 s\n");
+				return 1;
+			}
+			break;
+		case 'R':
+			resume = 1;
+			break;
+		case 'S':
+			// 0 leaves only the snapshots on SIGUSR1
+			snapshot_interval = atoi(optarg);
+			break;
+		case 'E':
+			export_request.values = export_values_from_name(optarg);
+			if (export_request.values == EXPORT_VALUES_MAX) {
+				printf("Unknown values to export %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'O':
+			export_request.path = optarg;
+			break;
+		case 'F':
+			export_request.format = export_format_from_name(optarg);
+			if (export_request.format == EXPORT_FORMAT_MAX) {
+				printf("Unknown export format %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			if (strcmp(optarg, "owned") == 0) {
+				owned_shards = 1;
+			} else if (strcmp(optarg, "shared") != 0) {
+				printf("Unknown processing mode %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'l':
+			layout = counting_layout_from_name(optarg);
+			if (layout == COUNTING_LAYOUT_MAX) {
+				printf("Unknown layout %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'b':
+			counter_bits = atoi(optarg);
+			if (counter_bits != 2 && counter_bits != 4 && counter_bits != 8) {
+				printf("Counters must be 2, 4 or 8 bits wide\n");
+				return 1;
+			}
+			break;
+		case 'm':
+			min_count = atoi(optarg);
+			if (min_count < 1) {
+				printf("Minimum count must be at least 1\n");
+				return 1;
+			}
+			break;
+		case 'i':
+			if (strcmp(optarg, "pread") == 0) {
+				input = INPUT_PREAD;
+			} else if (strcmp(optarg, "mmap") == 0) {
+				input = INPUT_MMAP;
+			} else if (strcmp(optarg, "uring") == 0) {
+				input = INPUT_URING;
+			} else {
+				printf("Unknown input method %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'f':
+			if (strcmp(optarg, "binary") == 0) {
+				format = FORMAT_BINARY;
+			} else if (strcmp(optarg, "text") == 0) {
+				format = FORMAT_TEXT;
+			} else if (strcmp(optarg, "block") == 0) {
+				format = FORMAT_BLOCK;
+			} else {
+				printf("Unknown input format %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'q':
+			uring_depth = atoi(optarg);
+			if (uring_depth < 1 || uring_depth > URING_READER_MAX_DEPTH) {
+				printf("Queue depth must be between 1 and %d\n", URING_READER_MAX_DEPTH);
+				return 1;
+			}
+			break;
+		case 'k':
+			index_kernel = index_isa_from_name(optarg);
+			if (index_kernel == INDEX_ISA_MAX) {
+				printf("Unknown index kernel %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			if (index_select(index_kernel) != 0) {
+				printf("Index kernel %s isn't supported by the CPU\n", optarg);
+				return 1;
+			}
+			break;
+		case 't':
+			if (autotune_parse(optarg, &threads_count, MAX_THREADS) != 0) {
+				printf("Threads count must be auto or between 1 and %d\n", MAX_THREADS);
+				return 1;
+			}
+			break;
+		case 's':
+			if (autotune_parse(optarg, &shards_count, COUNTING_MAX_SHARDS) != 0) {
+				printf("Shards count must be auto or between 1 and %d\n", COUNTING_MAX_SHARDS);
+				return 1;
+			}
+			break;
+		case 'a':
+			alloc = counting_alloc_from_name(optarg);
+			if (alloc == COUNTING_ALLOC_MAX) {
+				printf("Unknown allocation strategy %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'z':
+			first_touch = 1;
+			break;
+		case 'n':
+			numa_placement = 1;
+			break;
+		case 'j':
+			stats_path = optarg;
+			break;
+		case 'c':
+			chunk_size = atoi(optarg);
+			if (chunk_size < 1 || chunk_size > MAX_CHUNK_SIZE) {
+				printf("Chunk size must be between 1 and %d MB\n", MAX_CHUNK_SIZE);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind < 1 || argc - optind > SETS_MAX_INPUTS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// Several inputs are combined with the plain engines, the bitmaps are kept as they are
+	if (argc - optind > 1 && (approx || partitioned || owned_shards ||
+				layout == COUNTING_LAYOUT_ADAPTIVE || min_count > 0 || first_touch ||
+				numa_placement || stats_path || checkpoint.path)) {
+		printf("Several inputs can't be combined with -e approx|partitioned, -p owned, "
+				"-l adaptive, -m, -z, -n, -j or --checkpoint\n");
+		return 1;
+	}
+
+	if (min_count > 0 && (layout != COUNTING_LAYOUT_COUNTERS ||
+				min_count >= (1U << counter_bits))) {
+		printf("-m needs the counters layout and a count below %u\n", 1U << counter_bits);
+		return 1;
+	}
+
+	if (approx_error > 0 && !approx) {
+		printf("-x needs -e approx\n");
+		return 1;
+	}
+
+	if ((partition_memory > 0 || tmp_dir) && !partitioned) {
+		printf("-M and -d need -e partitioned\n");
+		return 1;
+	}
 
-	pthread_t threads[THREAD_COUNT] = {};
-	struct pthread_ctx *thread_params[THREAD_COUNT] = {};
+	// The sketches and the partitions replace the bitmaps, none of their options apply
+	if ((approx || partitioned) && (owned_shards || layout != COUNTING_LAYOUT_SPLIT ||
+				min_count > 0 || first_touch || numa_placement)) {
+		printf("-e %s can't be combined with -p owned, -l, -m, -z or -n\n",
+				approx ? "approx" : "partitioned");
+		return 1;
+	}
+	if ((export_request.values == EXPORT_VALUES_MAX) != !export_request.path) {
+		printf("--export and --export-path need each other\n");
+		return 1;
+	}
+
+	// The values are only known with the bitmaps of a single input
+	if (export_request.path && (approx || partitioned || argc - optind > 1)) {
+		printf("--export can't be combined with -e approx|partitioned or several inputs\n");
+		return 1;
+	}
+
+	// The lines are parsed straight from the mapping, whatever their length
+	if (format == FORMAT_TEXT) {
+		if (input == INPUT_URING) {
+			printf("-f text reads the input through a mapping, it can't use -i uring\n");
+			return 1;
+		}
+		input = INPUT_TEXT;
+	}
+
+	if (resume && !checkpoint.path) {
+		printf("--resume needs --checkpoint\n");
+		return 1;
+	}
 
-	if (argc != 2) {
-		printf("Usage: %s <path>\n", argv[0]);
+	// Only the bitmaps counted in place up to a chunk boundary can be saved
+	if (checkpoint.path && (approx || partitioned || owned_shards ||
+				layout == COUNTING_LAYOUT_ADAPTIVE || first_touch || numa_placement)) {
+		printf("--checkpoint can't be combined with -e approx|partitioned, -p owned, "
+				"-l adaptive, -z or -n\n");
 		return 1;
 	}
 
-	int fd = open(argv[1], O_RDONLY);
-	if (fd == 0) {
+	if (approx && approx_error == 0)
+		approx_error = APPROX_DEFAULT_ERROR;
+	if (partitioned && partition_memory == 0)
+		partition_memory = PARTITION_DEFAULT_MEMORY;
+	if (partitioned && !tmp_dir)
+		tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+	clock_gettime(CLOCK_MONOTONIC, &run_start);
+
+	if (threads_count == 0)
+		threads_count = MIN(autotune_threads(), MAX_THREADS);
+	if (shards_count == 0) {
+		shards_count = autotune_shards(BITMAPS_SIZE, threads_count,
+				AUTO_SHARDS_PER_THREAD, COUNTING_MAX_SHARDS);
+	}
+
+	if (argc - optind > 1) {
+		struct pthread_ctx config = {
+			.count_numbers = counting_engine_get(engine),
+			.input = input,
+			.format = format,
+			.uring_depth = uring_depth,
+		};
+
+		printf("Engine: %s, threads: %u, shards: %u\n", counting_engine_name(engine),
+				threads_count, shards_count);
+
+		return run_sets(&argv[optind], argc - optind, &config, layout, counter_bits, alloc,
+				threads_count, shards_count, (uint64_t)chunk_size * 1024 * 1024);
+	}
+
+	// Neither can be seeked, the numbers are streamed to the workers as they come
+	if (strcmp(argv[optind], "-") == 0 || (stat(argv[optind], &input_stat) == 0 &&
+				!S_ISREG(input_stat.st_mode) && !S_ISBLK(input_stat.st_mode))) {
+		if (approx || partitioned || owned_shards || first_touch || numa_placement ||
+				stats_path || checkpoint.path || input != INPUT_PREAD ||
+				format != FORMAT_BINARY) {
+			printf("Streaming can't be combined with -e approx|partitioned, -p owned, "
+					"-z, -n, -j, --checkpoint, -i mmap|uring or -f text|block\n");
+			return 1;
+		}
+
+		printf("Engine: %s\n", counting_engine_name(engine));
+		return run_stream(argv[optind], counting_engine_get(engine), layout, counter_bits,
+				alloc, min_count, threads_count, shards_count, snapshot_interval);
+	}
+
+	if (numa_placement) {
+		if (layout == COUNTING_LAYOUT_ADAPTIVE) {
+			printf("NUMA placement needs the split or interleaved layout\n");
+			return 1;
+		}
+		if (numa_topology_init(&numa) != 0) {
+			printf("Failed to read the NUMA topology\n");
+			return 1;
+		}
+		// Only whole mappings can be bound to a node
+		if (alloc == COUNTING_ALLOC_CALLOC) {
+			printf("NUMA placement needs mapped bitmaps, allocating with thp\n");
+			alloc = COUNTING_ALLOC_THP;
+		}
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
 		printf("Failed to open file\n");
 		return 1;
 	}
 
  	file_size = lseek(fd, 0L, SEEK_END);
-	file_chunk_size = file_size / THREAD_COUNT;
-	file_chunk_size &= 0xffffff00;
 
-	prepare_shards(trees, SHARDS, SHARD_SIZE);
+	queue.end = file_size;
+	queue.chunk_size = (uint64_t)chunk_size * 1024 * 1024;
+
+	// The checkpoint decides the layout and the shards, the input must be the same
+	if (resume) {
+		if (checkpoint_read_header(checkpoint.path, &resumed) != 0) {
+			printf("Failed to read the checkpoint %s\n", checkpoint.path);
+			close(fd);
+			return 1;
+		}
+		if (resumed.input_size != file_size) {
+			printf("The checkpoint was taken of a %lu bytes long input\n", resumed.input_size);
+			close(fd);
+			return 1;
+		}
+		layout = resumed.layout;
+		counter_bits = resumed.counter_bits;
+		shards_count = resumed.shards_count;
+		queue.next = resumed.consumed;
+		printf("Resuming from %s, %lu of %lu bytes counted\n", checkpoint.path,
+				resumed.consumed, file_size);
+	}
+
+	if ((input == INPUT_MMAP || input == INPUT_TEXT) && file_size > 0) {
+		mapped_file = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+		if (mapped_file == MAP_FAILED) {
+			printf("Failed to map the input file\n");
+			close(fd);
+			return 1;
+		}
+		madvise(mapped_file, file_size, MADV_SEQUENTIAL);
+		// Only honoured by file systems supporting large folios, harmless otherwise
+		madvise(mapped_file, file_size, MADV_HUGEPAGE);
+	}
+
+	trees = calloc(shards_count, sizeof(struct tree_owner));
+	threads = calloc(threads_count, sizeof(pthread_t));
+	thread_params = calloc(threads_count, sizeof(struct pthread_ctx *));
+	if (!trees || !threads || !thread_params) {
+		printf("Failed to allocate the context\n");
+		ret = 1;
+		goto free_ctx;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	if (approx) {
+		sketches = calloc(threads_count, sizeof(struct approx_sketch));
+		for (i = 0; sketches && i < threads_count; i++) {
+			if (approx_init(&sketches[i], approx_error) != 0)
+				break;
+		}
+		if (!sketches || i < threads_count) {
+			printf("Failed to allocate the sketches\n");
+			ret = 1;
+			goto free_sketches;
+		}
+		goto allocated;
+	}
+
+	if (partitioned) {
+		// At least as many as it takes for a partition to fit in the cache share of a worker
+		if (partition_init(&partitions, tmp_dir, partition_memory * 1024 * 1024, threads_count,
+					autotune_shards(PARTITION_BITMAPS_SIZE, threads_count, 1,
+						PARTITION_MAX_PARTITIONS)) != 0) {
+			printf("Failed to set up the partitions, the memory cap may be too low\n");
+			ret = 1;
+			goto free_ctx;
+		}
+		partition_workers = calloc(threads_count, sizeof(struct partition_worker));
+		for (i = 0; partition_workers && i < threads_count; i++) {
+			if (partition_worker_init(&partition_workers[i], &partitions) != 0)
+				break;
+		}
+		if (!partition_workers || i < threads_count) {
+			printf("Failed to allocate the partition buffers\n");
+			ret = 1;
+			goto free_partitions;
+		}
+		printf("Partitions: %u in %s, %.1f MB to spill, %.1f MB to count\n",
+				partitions.partitions_count, tmp_dir,
+				partition_spill_memory(&partitions) / 1e6,
+				partition_count_memory(&partitions) / 1e6);
+		goto allocated;
+	}
+
+	if (resume) {
+		if (checkpoint_load(checkpoint.path, &resumed, trees) != 0) {
+			printf("Failed to map the checkpoint %s\n", checkpoint.path);
+			ret = 1;
+			goto free_ctx;
+		}
+	} else {
+		if (layout == COUNTING_LAYOUT_COUNTERS) {
+			ret = prepare_shards_counters(trees, shards_count,
+					COUNTING_MAX_INPUT / shards_count, counter_bits, alloc);
+		} else {
+			ret = prepare_shards_alloc(trees, shards_count, COUNTING_MAX_INPUT / shards_count,
+					layout, alloc);
+		}
+		if (ret != 0) {
+			printf("Failed to allocate the bitmaps\n");
+			goto free_ctx;
+		}
+	}
+
+	assert(trees[shards_count - 1].shard_range_max == COUNTING_MAX_INPUT);
+
+	// Before the first touch, the policy applies to pages faulted in afterwards
+	if (numa_placement && numa_place_shards(&numa, shards_count, threads_count) != 0) {
+		printf("Failed to bind the bitmaps to the NUMA nodes\n");
+		ret = 1;
+		goto destroy;
+	}
+
+	if (first_touch && counting_first_touch(trees, shards_count, threads_count) != 0) {
+		printf("Failed to touch the bitmaps\n");
+		ret = 1;
+		goto destroy;
+	}
+	// May differ from the requested one if there are no huge pages reserved
+	printf("Allocation: %s%s, set up in %.3f s\n", counting_alloc_name(trees[0].alloc),
+			first_touch ? " touched in parallel" : "", elapsed_seconds(&start_time));
+
+allocated:
+	if (stats_path) {
+		worker_stats = calloc(threads_count, sizeof(struct counting_stats));
+		for (i = 0; worker_stats && i < threads_count; i++) {
+			if (counting_stats_init(&worker_stats[i], shards_count) != 0)
+				break;
+		}
+		if (!worker_stats || i < threads_count) {
+			printf("Failed to allocate the statistics\n");
+			ret = 1;
+			goto free_stats;
+		}
+	}
+
+	if (owned_shards) {
+		res = scatter_init(&scatter, trees, shards_count, threads_count);
+		if (res != 0) {
+			printf("Failed to initialize shard owners\n");
+			ret = 1;
+			goto free_stats;
+		}
+		printf("Engine: owned shards\n");
+	} else if (approx) {
+		printf("Engine: approx, error %g\n", approx_error);
+	} else if (partitioned) {
+		printf("Engine: partitioned, memory cap %lu MB\n", partition_memory);
+	} else {
+		printf("Engine: %s\n", counting_engine_name(engine));
+	}
+	if (approx)
+		printf("Layout: sketches\n");
+	else if (partitioned)
+		printf("Layout: partition bitmaps\n");
+	else if (layout == COUNTING_LAYOUT_COUNTERS)
+		printf("Layout: %u-bit counters\n", counter_bits);
+	else
+		printf("Layout: %s\n", counting_layout_name(layout));
+	printf("Index kernel: %s\n", index_isa_name(index_get_isa()));
+	printf("Threads: %u, shards: %u\n", threads_count, shards_count);
+	if (numa_placement)
+		printf("NUMA nodes: %u, workers pinned\n", numa.nodes_count);
+	if (checkpoint.path) {
+		checkpoint.interval_ns = checkpoint_interval * 1000000000ULL;
+		checkpoint.next_ns = run_time_ns() + checkpoint.interval_ns;
+		checkpoint.active = threads_count;
+		checkpoint.shards_count = shards_count;
+		checkpoint.file_size = file_size;
+		checkpoint.queue = &queue;
+		printf("Checkpoints: every %lu s to %s\n", checkpoint_interval, checkpoint.path);
+	}
+	// Before the workers, a request arriving early waits for them to start
+	if (stats_path) {
+		stats_workers = thread_params;
+		signal(SIGUSR1, request_stats);
+	}
 
-	assert(trees[SHARDS - 1].shard_range_max == COUNTING_MAX_INPUT);
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
 
-	for (i = 0; i < THREAD_COUNT; i++) {
-		thread_params[i] = malloc(sizeof(struct pthread_ctx));
+	for (i = 0; i < threads_count; i++) {
+		thread_params[i] = calloc(1, sizeof(struct pthread_ctx));
 		if (thread_params[i] == NULL)
 			goto end;
 
 		thread_params[i]->shard_id = i;
 
-		thread_params[i]->start_pos = i * file_chunk_size;
-		if (i == THREAD_COUNT - 1) 
-			thread_params[i]->end_pos = file_size;
-		else
-			thread_params[i]->end_pos = file_chunk_size * (i + 1);
-			
+		thread_params[i]->queue = &queue;
+		thread_params[i]->threads_count = threads_count;
 		thread_params[i]->file_descryptor = fd;
+		thread_params[i]->count_numbers = counting_engine_get(engine);
+		thread_params[i]->scatter = owned_shards ? &scatter : NULL;
+		thread_params[i]->sketch = sketches ? &sketches[i] : NULL;
+		thread_params[i]->partition = partition_workers ? &partition_workers[i] : NULL;
+		thread_params[i]->input = input;
+		thread_params[i]->format = format;
+		thread_params[i]->uring_depth = uring_depth;
+		thread_params[i]->mapped_file = mapped_file;
+		thread_params[i]->file_size = file_size;
+		thread_params[i]->shards_count = shards_count;
+		thread_params[i]->stats = worker_stats ? &worker_stats[i] : NULL;
+		if (numa_placement) {
+			thread_params[i]->numa = &numa;
+			thread_params[i]->node = numa_worker_node(&numa, i, threads_count);
+			thread_params[i]->cpu = numa_worker_cpu(&numa, i, threads_count);
+		}
 
 		res = pthread_create(&threads[i], NULL, sharded_counting, thread_params[i]);
 		if (res != 0) {
-			printf("Failed to initialize thread %d\n", i);
+			printf("Failed to initialize thread %u\n", i);
 			goto end;
 		}
 	}
 end:
+	// Shards of a missing owner would never be counted and the others would wait for it
+	if (owned_shards && i < threads_count) {
+		printf("Not all shard owners started. Terminating\n");
+		exit(1);
+	}
 
-	for (i = 0; i < THREAD_COUNT; i++) {
+	// The workers which didn't start won't pause for the checkpoints
+	if (checkpoint.path && i < threads_count)
+		checkpoint_leave(threads_count - i);
+
+	if (stats_path)
+		__atomic_store_n(&stats_workers_count, i, __ATOMIC_RELEASE);
+
+	for (i = 0; i < threads_count; i++) {
 		if (threads[i] != 0) {
 			res = pthread_join(threads[i], NULL);
 			assert(res == 0);
 		}
+	}
 
+	elapsed = elapsed_seconds(&start_time);
+	numbers = (file_size - resumed.consumed) / sizeof(uint32_t);
+	// The lines have any length, the blocks any number of numbers
+	if (format != FORMAT_BINARY) {
+		for (numbers = 0, i = 0; i < threads_count; i++)
+			numbers += thread_params[i] ? thread_params[i]->numbers : 0;
+	}
+	printf("Counted %lu numbers in %.3f s (%.2f M numbers/s)\n", numbers, elapsed,
+			numbers / elapsed / 1e6);
+
+	if (numa_placement)
+		numa_report(&numa, thread_params, threads_count, owned_shards, elapsed);
+
+	// The last one covers the whole input, it can be given as an input of the set operations
+	if (checkpoint.path)
+		checkpoint_take();
+
+	if (stats_path) {
+		signal(SIGUSR1, SIG_IGN);
+		if (stats_workers_count > 0)
+			write_stats(1);
+	}
+
+	for (i = 0; i < threads_count; i++)
 		free(thread_params[i]);
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	if (approx) {
+		if (print_estimates(sketches, threads_count) != 0)
+			ret = 1;
+		printf("Estimated in %.3f s\n", elapsed_seconds(&start_time));
+		goto report;
 	}
 
-	printf("Unique numbers %lu\n", aggregate_unique_numbers(trees, SHARDS));
-	printf("Seen only once %lu\n", aggregate_seen_only_once(trees, SHARDS));
+	if (partitioned) {
+		res = partition_count(&partitions);
+		if (res != 0) {
+			printf("Failed to count the partitions\n");
+			ret = 1;
+		} else {
+			printf("Counted %u partitions in %.3f s, %.1f MB spilled\n",
+					partitions.partitions_count, elapsed_seconds(&start_time),
+					partition_spilled(&partitions) / 1e6);
+			printf("Unique numbers %lu\n", partitions.unique);
+			printf("Seen only once %lu\n", partitions.only_once);
+		}
+		goto report;
+	}
+
+	res = counting_finalize(trees, shards_count, threads_count);
+	if (res != 0) {
+		printf("Failed to finalize the results\n");
+		ret = 1;
+	} else {
+		printf("Finalized in %.3f s (%s popcount)\n", elapsed_seconds(&start_time),
+				popcount_isa_name(popcount_get_isa()));
+
+		printf("Bitmaps memory %.1f MB\n", counting_memory(trees, shards_count) / 1e6);
+		printf("Unique numbers %lu\n", aggregate_unique_numbers(trees, shards_count));
+		printf("Seen only once %lu\n", aggregate_seen_only_once(trees, shards_count));
+
+		if (layout == COUNTING_LAYOUT_COUNTERS)
+			print_histogram(min_count, shards_count);
+		if (export_request.path && export_results(shards_count, threads_count) != 0)
+			ret = 1;
+	}
 
-	destroy_shards(trees, SHARDS);
+report:
+	printf("First value counted after %.3f s, total %.3f s\n", first_value_ns / 1e9,
+			run_time_ns() / 1e9);
+
+	if (owned_shards)
+		scatter_deinit(&scatter);
+
+free_stats:
+	for (i = 0; worker_stats && i < threads_count; i++)
+		counting_stats_deinit(&worker_stats[i]);
+	free(worker_stats);
+free_sketches:
+	if (approx) {
+		for (i = 0; sketches && i < threads_count; i++)
+			approx_deinit(&sketches[i]);
+		free(sketches);
+		goto free_ctx;
+	}
+free_partitions:
+	if (partitioned) {
+		for (i = 0; partition_workers && i < threads_count; i++)
+			partition_worker_deinit(&partition_workers[i]);
+		free(partition_workers);
+		partition_deinit(&partitions);
+		goto free_ctx;
+	}
+destroy:
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	destroy_shards(trees, shards_count);
+	printf("Torn down in %.3f s\n", elapsed_seconds(&start_time));
+free_ctx:
+	free(thread_params);
+	free(threads);
+	free(trees);
+
+	if (mapped_file)
+		munmap(mapped_file, file_size);
 
 	close(fd);
+
+	return ret;
 }
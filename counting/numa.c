@@ -0,0 +1,144 @@
+#ifndef __NUMA_C__
+#define __NUMA_C__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/*
+ * NUMA topology of the CPUs the process may run on, read from sysfs. Workers
+ * are spread over the nodes in contiguous blocks, worker i runs on node
+ * i * nodes / workers, and the shards owned by a worker are bound to its node.
+ * Memory is bound with the raw mbind() system call, there is no libnuma
+ * dependency. Needs _GNU_SOURCE for the CPU set macros.
+ */
+
+#define NUMA_MAX_NODES 64
+#define NUMA_SYSFS_NODES "/sys/devices/system/node"
+
+struct numa_topology {
+	uint32_t nodes_count;
+	// Kernel ids of the nodes having any of the allowed CPUs
+	uint32_t node_ids[NUMA_MAX_NODES];
+	uint32_t cpus_count[NUMA_MAX_NODES];
+	cpu_set_t cpus[NUMA_MAX_NODES];
+};
+
+/* Parses a sysfs CPU list like "0-3,8,10-11" */
+static int numa_parse_cpulist(const char *list, cpu_set_t *set) {
+	unsigned long first, last;
+	char *end;
+
+	CPU_ZERO(set);
+
+	while (*list && *list != '\n') {
+		first = strtoul(list, &end, 10);
+		if (end == list)
+			return 1;
+
+		last = first;
+		if (*end == '-') {
+			list = end + 1;
+			last = strtoul(list, &end, 10);
+			if (end == list)
+				return 1;
+		}
+
+		for (; first <= last && first < CPU_SETSIZE; first++)
+			CPU_SET(first, set);
+
+		list = *end == ',' ? end + 1 : end;
+	}
+
+	return 0;
+}
+
+static void numa_add_node(struct numa_topology *topology, uint32_t node_id, cpu_set_t *cpus) {
+	uint32_t i = topology->nodes_count;
+
+	topology->node_ids[i] = node_id;
+	topology->cpus[i] = *cpus;
+	topology->cpus_count[i] = CPU_COUNT(cpus);
+	topology->nodes_count++;
+}
+
+/* Without sysfs all allowed CPUs are treated as node 0 */
+int numa_topology_init(struct numa_topology *topology) {
+	cpu_set_t allowed, node_cpus;
+	char path[128];
+	char list[4096];
+	uint32_t node_id;
+	FILE *file;
+	size_t length;
+
+	memset(topology, 0, sizeof(*topology));
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return 1;
+
+	for (node_id = 0; node_id < 1024 && topology->nodes_count < NUMA_MAX_NODES; node_id++) {
+		snprintf(path, sizeof(path), NUMA_SYSFS_NODES "/node%u/cpulist", node_id);
+
+		file = fopen(path, "r");
+		if (!file)
+			continue;
+
+		length = fread(list, 1, sizeof(list) - 1, file);
+		fclose(file);
+		list[length] = 0;
+
+		if (numa_parse_cpulist(list, &node_cpus) != 0)
+			continue;
+
+		CPU_AND(&node_cpus, &node_cpus, &allowed);
+		if (CPU_COUNT(&node_cpus) > 0)
+			numa_add_node(topology, node_id, &node_cpus);
+	}
+
+	if (topology->nodes_count == 0)
+		numa_add_node(topology, 0, &allowed);
+
+	return 0;
+}
+
+/* Index of the node, not the kernel id, the worker runs on */
+uint32_t numa_worker_node(struct numa_topology *topology, uint32_t worker, uint32_t workers) {
+	return (uint64_t)worker * topology->nodes_count / workers;
+}
+
+/* CPU for the worker, workers of a node take its CPUs round robin */
+int numa_worker_cpu(struct numa_topology *topology, uint32_t worker, uint32_t workers) {
+	uint32_t node = numa_worker_node(topology, worker, workers);
+	uint32_t first_worker = (node * workers + topology->nodes_count - 1) / topology->nodes_count;
+	uint32_t nth = (worker - first_worker) % topology->cpus_count[node];
+	int cpu;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &topology->cpus[node]))
+			continue;
+		if (nth-- == 0)
+			return cpu;
+	}
+
+	return -1;
+}
+
+/* Binds the page aligned range to the node given by its index */
+int numa_bind(struct numa_topology *topology, void *addr, uint64_t length, uint32_t node) {
+	unsigned long nodemask[NUMA_MAX_NODES * 16 / (8 * sizeof(unsigned long)) + 1] = {};
+	uint32_t node_id = topology->node_ids[node];
+
+	if (node_id >= 8 * sizeof(nodemask))
+		return 1;
+
+	nodemask[node_id / (8 * sizeof(unsigned long))] |= 1UL << (node_id % (8 * sizeof(unsigned long)));
+
+	return syscall(__NR_mbind, addr, length, MPOL_BIND, nodemask, 8 * sizeof(nodemask), 0) != 0;
+}
+
+#endif
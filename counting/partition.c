@@ -0,0 +1,301 @@
+#ifndef __PARTITION_C__
+#define __PARTITION_C__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "counting.h"
+
+/*
+ * External memory counting for hosts that can't spare the bitmaps of the whole
+ * range. The first pass splits the input by the top bits of the numbers into
+ * partitions, which are spilled to temporary files through small per-worker
+ * buffers. The second pass counts the partitions one by one, every worker with
+ * a bitmap of a single partition, small enough to stay in its cache share. The
+ * number of partitions and the buffers are sized to keep both passes under the
+ * memory cap. The spill files are unlinked right away, the space is released
+ * once a partition is counted or the process exits.
+ */
+
+#define PARTITION_MAX_PARTITIONS 512
+// Bytes of a spill buffer of a worker for a single partition
+#define PARTITION_MIN_BUFFER 4096
+#define PARTITION_MAX_BUFFER (1024 * 1024)
+// Bytes read at once by the second pass
+#define PARTITION_READ_SIZE (1024 * 1024)
+// Both bitmaps of the whole input range
+#define PARTITION_BITMAPS_SIZE (2 * (COUNTING_MAX_INPUT / 8 + 1))
+
+struct partition_ctx {
+	uint32_t partitions_count;
+	// The partition of a number is number >> shift
+	uint32_t shift;
+	uint32_t workers_count;
+	uint32_t buffer_values;
+	int *files;
+	// Bytes written to every spill file so far
+	uint64_t *sizes;
+	// The partition to be counted next by the second pass
+	uint32_t next;
+	uint64_t unique;
+	uint64_t only_once;
+	int failed;
+};
+
+/* Per worker state of the first pass, the buffers being filled for each partition */
+struct partition_worker {
+	struct partition_ctx *ctx;
+	uint32_t *buffers;
+	uint32_t *counts;
+};
+
+/* Memory taken by the state of the pass, in bytes */
+uint64_t partition_spill_memory(struct partition_ctx *ctx) {
+	return (uint64_t)ctx->workers_count * ctx->partitions_count * ctx->buffer_values *
+		sizeof(uint32_t);
+}
+
+uint64_t partition_count_memory(struct partition_ctx *ctx) {
+	return (uint64_t)ctx->workers_count *
+		(PARTITION_BITMAPS_SIZE / ctx->partitions_count + PARTITION_READ_SIZE);
+}
+
+/*
+ * Picks the number of partitions, a power of two not below min_partitions, and
+ * the size of the buffers for the memory cap and creates the spill files in
+ * tmp_dir. Returns 1 if the cap is too low or the files can't be created.
+ */
+int partition_init(struct partition_ctx *ctx, const char *tmp_dir, uint64_t memory_cap,
+		uint32_t workers_count, uint32_t min_partitions) {
+	char path[4096];
+	uint64_t buffer_size;
+	uint32_t i, bits = 0;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->workers_count = workers_count;
+
+	ctx->partitions_count = 1;
+	while ((ctx->partitions_count < min_partitions || partition_count_memory(ctx) > memory_cap) &&
+			ctx->partitions_count < PARTITION_MAX_PARTITIONS)
+		ctx->partitions_count *= 2;
+
+	buffer_size = memory_cap / ((uint64_t)workers_count * ctx->partitions_count);
+	if (buffer_size > PARTITION_MAX_BUFFER)
+		buffer_size = PARTITION_MAX_BUFFER;
+	if (partition_count_memory(ctx) > memory_cap || buffer_size < PARTITION_MIN_BUFFER)
+		return 1;
+	ctx->buffer_values = buffer_size / sizeof(uint32_t);
+
+	while ((1U << bits) < ctx->partitions_count)
+		bits++;
+	ctx->shift = 32 - bits;
+
+	ctx->files = malloc(ctx->partitions_count * sizeof(int));
+	ctx->sizes = calloc(ctx->partitions_count, sizeof(uint64_t));
+	if (!ctx->files || !ctx->sizes)
+		goto free_ctx;
+
+	for (i = 0; i < ctx->partitions_count; i++) {
+		snprintf(path, sizeof(path), "%s/counting.XXXXXX", tmp_dir);
+		ctx->files[i] = mkstemp(path);
+		if (ctx->files[i] < 0)
+			goto close_files;
+		unlink(path);
+	}
+
+	return 0;
+
+close_files:
+	while (i-- > 0)
+		close(ctx->files[i]);
+free_ctx:
+	free(ctx->files);
+	free(ctx->sizes);
+	return 1;
+}
+
+void partition_deinit(struct partition_ctx *ctx) {
+	uint32_t i;
+
+	for (i = 0; i < ctx->partitions_count; i++) {
+		if (ctx->files[i] >= 0)
+			close(ctx->files[i]);
+	}
+
+	free(ctx->files);
+	free(ctx->sizes);
+}
+
+/* Bytes spilled by the first pass */
+uint64_t partition_spilled(struct partition_ctx *ctx) {
+	uint64_t spilled = 0;
+	uint32_t i;
+
+	for (i = 0; i < ctx->partitions_count; i++)
+		spilled += ctx->sizes[i];
+
+	return spilled;
+}
+
+int partition_worker_init(struct partition_worker *worker, struct partition_ctx *ctx) {
+	worker->ctx = ctx;
+	worker->buffers = malloc((uint64_t)ctx->partitions_count * ctx->buffer_values *
+			sizeof(uint32_t));
+	worker->counts = calloc(ctx->partitions_count, sizeof(uint32_t));
+	if (!worker->buffers || !worker->counts) {
+		free(worker->buffers);
+		free(worker->counts);
+		return 1;
+	}
+
+	return 0;
+}
+
+void partition_worker_deinit(struct partition_worker *worker) {
+	free(worker->buffers);
+	free(worker->counts);
+}
+
+/* Appends the buffer to the spill file, every worker reserves its own range of the file */
+static void partition_flush(struct partition_worker *worker, uint32_t partition) {
+	struct partition_ctx *ctx = worker->ctx;
+	char *data = (char *)&worker->buffers[(uint64_t)partition * ctx->buffer_values];
+	uint64_t size = worker->counts[partition] * sizeof(uint32_t);
+	uint64_t offset = __atomic_fetch_add(&ctx->sizes[partition], size, __ATOMIC_RELAXED);
+	ssize_t written;
+
+	while (size > 0) {
+		written = pwrite(ctx->files[partition], data, size, offset);
+		if (written < 1) {
+			printf("Failed to write partition %u\n", partition);
+			__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		data += written;
+		offset += written;
+		size -= written;
+	}
+
+	worker->counts[partition] = 0;
+}
+
+/* First pass, distributes a batch of input numbers among the partitions */
+void partition_numbers(struct partition_worker *worker, const uint32_t *arr, int count) {
+	struct partition_ctx *ctx = worker->ctx;
+	uint32_t partition;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		partition = (uint64_t)arr[i] >> ctx->shift;
+
+		worker->buffers[(uint64_t)partition * ctx->buffer_values + worker->counts[partition]++] =
+			arr[i];
+		if (worker->counts[partition] == ctx->buffer_values)
+			partition_flush(worker, partition);
+	}
+}
+
+/* Spills the partially filled buffers once the worker has read its input */
+void partition_worker_finish(struct partition_worker *worker) {
+	uint32_t i;
+
+	for (i = 0; i < worker->ctx->partitions_count; i++) {
+		if (worker->counts[i] > 0)
+			partition_flush(worker, i);
+	}
+}
+
+/* Second pass, counts whole partitions until none is left */
+static void *partition_counting(void *param) {
+	struct partition_ctx *ctx = param;
+	uint64_t words = ((uint64_t)COUNTING_MAX_INPUT / ctx->partitions_count + 1 + 63) / 64;
+	uint64_t mask = (1ULL << ctx->shift) - 1;
+	uint64_t unique = 0, only_once = 0;
+	uint64_t *once, *twice, bit, word;
+	uint32_t *values, partition;
+	uint64_t position;
+	ssize_t read_bytes, i;
+
+	once = malloc(2 * words * sizeof(uint64_t));
+	values = malloc(PARTITION_READ_SIZE);
+	if (!once || !values) {
+		printf("Failed to allocate the partition bitmaps\n");
+		__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+		goto free_bitmaps;
+	}
+	twice = once + words;
+
+	while ((partition = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) <
+			ctx->partitions_count) {
+		memset(once, 0, 2 * words * sizeof(uint64_t));
+
+		for (position = 0; position < ctx->sizes[partition]; position += read_bytes) {
+			read_bytes = pread(ctx->files[partition], values, PARTITION_READ_SIZE, position);
+			if (read_bytes < 1) {
+				printf("Failed to read partition %u\n", partition);
+				__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+				break;
+			}
+
+			for (i = 0; i < read_bytes / (ssize_t)sizeof(uint32_t); i++) {
+				word = (values[i] & mask) / 64;
+				bit = 1ULL << (values[i] % 64);
+				twice[word] |= once[word] & bit;
+				once[word] |= bit;
+			}
+		}
+
+		popcount_split(once, twice, words, &unique, &only_once);
+
+		// Counted, the space of the spill file can be released
+		close(ctx->files[partition]);
+		ctx->files[partition] = -1;
+	}
+
+	__atomic_fetch_add(&ctx->unique, unique, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ctx->only_once, only_once, __ATOMIC_RELAXED);
+
+free_bitmaps:
+	free(once);
+	free(values);
+
+	return NULL;
+}
+
+/* Runs the second pass with the workers of the first one, returns 1 if any partition failed */
+int partition_count(struct partition_ctx *ctx) {
+	pthread_t *threads;
+	uint32_t i, started;
+	int res;
+
+	if (ctx->failed)
+		return 1;
+
+	threads = calloc(ctx->workers_count, sizeof(pthread_t));
+	if (!threads)
+		return 1;
+
+	for (started = 0; started < ctx->workers_count; started++) {
+		res = pthread_create(&threads[started], NULL, partition_counting, ctx);
+		if (res != 0) {
+			printf("Failed to initialize thread %u\n", started);
+			break;
+		}
+	}
+
+	for (i = 0; i < started; i++) {
+		res = pthread_join(threads[i], NULL);
+		assert(res == 0);
+	}
+
+	free(threads);
+
+	return started < ctx->workers_count || ctx->failed;
+}
+
+#endif
@@ -0,0 +1,274 @@
+#ifndef __POPCOUNT_C__
+#define __POPCOUNT_C__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <immintrin.h>
+
+/*
+ * Kernels counting the values present in the bitmaps and the values seen only
+ * once, in one pass over the memory. The best kernel for the CPU is chosen at
+ * runtime.
+ *
+ * Split layout: present = popcount(once), only_once = popcount(once & ~twice).
+ * Interleaved layout: the even bits are "seen once", the odd bits "seen twice".
+ */
+
+#define POPCOUNT_EVEN_BITS 0x5555555555555555ULL
+
+enum popcount_isa {
+	POPCOUNT_ISA_SCALAR,
+	POPCOUNT_ISA_POPCNT,
+	POPCOUNT_ISA_AVX2,
+	POPCOUNT_ISA_AVX512,
+	POPCOUNT_ISA_MAX,
+};
+
+typedef void (*popcount_split_fn)(const uint64_t *once, const uint64_t *twice, size_t words,
+		uint64_t *present, uint64_t *only_once);
+typedef void (*popcount_interleaved_fn)(const uint64_t *cells, size_t words,
+		uint64_t *present, uint64_t *only_once);
+
+static void popcount_split_scalar(const uint64_t *once, const uint64_t *twice, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	size_t i;
+
+	for (i = 0; i < words; i++) {
+		*present += __builtin_popcountll(once[i]);
+		*only_once += __builtin_popcountll(once[i] & ~twice[i]);
+	}
+}
+
+static void popcount_interleaved_scalar(const uint64_t *cells, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	size_t i;
+
+	for (i = 0; i < words; i++) {
+		*present += __builtin_popcountll(cells[i] & POPCOUNT_EVEN_BITS);
+		*only_once += __builtin_popcountll(cells[i] & ~(cells[i] >> 1) & POPCOUNT_EVEN_BITS);
+	}
+}
+
+__attribute__((target("popcnt")))
+static void popcount_split_popcnt(const uint64_t *once, const uint64_t *twice, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	size_t i;
+
+	for (i = 0; i < words; i++) {
+		*present += __builtin_popcountll(once[i]);
+		*only_once += __builtin_popcountll(once[i] & ~twice[i]);
+	}
+}
+
+__attribute__((target("popcnt")))
+static void popcount_interleaved_popcnt(const uint64_t *cells, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	size_t i;
+
+	for (i = 0; i < words; i++) {
+		*present += __builtin_popcountll(cells[i] & POPCOUNT_EVEN_BITS);
+		*only_once += __builtin_popcountll(cells[i] & ~(cells[i] >> 1) & POPCOUNT_EVEN_BITS);
+	}
+}
+
+/* Per-byte popcount with a nibble lookup table, summed up into four 64-bit lanes */
+__attribute__((target("avx2")))
+static inline __m256i popcount_avx2_vector(__m256i v) {
+	const __m256i lookup = _mm256_setr_epi8(
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_and_si256(v, low_mask);
+	__m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+	__m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+			_mm256_shuffle_epi8(lookup, hi));
+
+	return _mm256_sad_epu8(bytes, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static uint64_t popcount_avx2_sum(__m256i v) {
+	return _mm256_extract_epi64(v, 0) + _mm256_extract_epi64(v, 1) +
+		_mm256_extract_epi64(v, 2) + _mm256_extract_epi64(v, 3);
+}
+
+__attribute__((target("avx2,popcnt")))
+static void popcount_split_avx2(const uint64_t *once, const uint64_t *twice, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	__m256i present_acc = _mm256_setzero_si256();
+	__m256i only_once_acc = _mm256_setzero_si256();
+	__m256i a, b;
+	size_t i;
+
+	for (i = 0; i + 4 <= words; i += 4) {
+		a = _mm256_loadu_si256((const __m256i *)&once[i]);
+		b = _mm256_loadu_si256((const __m256i *)&twice[i]);
+
+		present_acc = _mm256_add_epi64(present_acc, popcount_avx2_vector(a));
+		only_once_acc = _mm256_add_epi64(only_once_acc,
+				popcount_avx2_vector(_mm256_andnot_si256(b, a)));
+	}
+
+	*present += popcount_avx2_sum(present_acc);
+	*only_once += popcount_avx2_sum(only_once_acc);
+
+	popcount_split_popcnt(&once[i], &twice[i], words - i, present, only_once);
+}
+
+__attribute__((target("avx2,popcnt")))
+static void popcount_interleaved_avx2(const uint64_t *cells, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	const __m256i even = _mm256_set1_epi64x(POPCOUNT_EVEN_BITS);
+	__m256i present_acc = _mm256_setzero_si256();
+	__m256i only_once_acc = _mm256_setzero_si256();
+	__m256i a;
+	size_t i;
+
+	for (i = 0; i + 4 <= words; i += 4) {
+		a = _mm256_loadu_si256((const __m256i *)&cells[i]);
+
+		present_acc = _mm256_add_epi64(present_acc,
+				popcount_avx2_vector(_mm256_and_si256(a, even)));
+		only_once_acc = _mm256_add_epi64(only_once_acc,
+				popcount_avx2_vector(_mm256_and_si256(
+						_mm256_andnot_si256(_mm256_srli_epi64(a, 1), a), even)));
+	}
+
+	*present += popcount_avx2_sum(present_acc);
+	*only_once += popcount_avx2_sum(only_once_acc);
+
+	popcount_interleaved_popcnt(&cells[i], words - i, present, only_once);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static void popcount_split_avx512(const uint64_t *once, const uint64_t *twice, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	__m512i present_acc = _mm512_setzero_si512();
+	__m512i only_once_acc = _mm512_setzero_si512();
+	__m512i a, b;
+	size_t i;
+
+	for (i = 0; i + 8 <= words; i += 8) {
+		a = _mm512_loadu_si512(&once[i]);
+		b = _mm512_loadu_si512(&twice[i]);
+
+		present_acc = _mm512_add_epi64(present_acc, _mm512_popcnt_epi64(a));
+		only_once_acc = _mm512_add_epi64(only_once_acc,
+				_mm512_popcnt_epi64(_mm512_andnot_si512(b, a)));
+	}
+
+	*present += _mm512_reduce_add_epi64(present_acc);
+	*only_once += _mm512_reduce_add_epi64(only_once_acc);
+
+	popcount_split_popcnt(&once[i], &twice[i], words - i, present, only_once);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+static void popcount_interleaved_avx512(const uint64_t *cells, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	const __m512i even = _mm512_set1_epi64(POPCOUNT_EVEN_BITS);
+	__m512i present_acc = _mm512_setzero_si512();
+	__m512i only_once_acc = _mm512_setzero_si512();
+	__m512i a;
+	size_t i;
+
+	for (i = 0; i + 8 <= words; i += 8) {
+		a = _mm512_loadu_si512(&cells[i]);
+
+		present_acc = _mm512_add_epi64(present_acc,
+				_mm512_popcnt_epi64(_mm512_and_si512(a, even)));
+		only_once_acc = _mm512_add_epi64(only_once_acc,
+				_mm512_popcnt_epi64(_mm512_and_si512(
+						_mm512_andnot_si512(_mm512_srli_epi64(a, 1), a), even)));
+	}
+
+	*present += _mm512_reduce_add_epi64(present_acc);
+	*only_once += _mm512_reduce_add_epi64(only_once_acc);
+
+	popcount_interleaved_popcnt(&cells[i], words - i, present, only_once);
+}
+
+static const char *popcount_isa_names[POPCOUNT_ISA_MAX] = {
+	[POPCOUNT_ISA_SCALAR] = "scalar",
+	[POPCOUNT_ISA_POPCNT] = "popcnt",
+	[POPCOUNT_ISA_AVX2] = "avx2",
+	[POPCOUNT_ISA_AVX512] = "avx512",
+};
+
+static const popcount_split_fn popcount_split_kernels[POPCOUNT_ISA_MAX] = {
+	[POPCOUNT_ISA_SCALAR] = popcount_split_scalar,
+	[POPCOUNT_ISA_POPCNT] = popcount_split_popcnt,
+	[POPCOUNT_ISA_AVX2] = popcount_split_avx2,
+	[POPCOUNT_ISA_AVX512] = popcount_split_avx512,
+};
+
+static const popcount_interleaved_fn popcount_interleaved_kernels[POPCOUNT_ISA_MAX] = {
+	[POPCOUNT_ISA_SCALAR] = popcount_interleaved_scalar,
+	[POPCOUNT_ISA_POPCNT] = popcount_interleaved_popcnt,
+	[POPCOUNT_ISA_AVX2] = popcount_interleaved_avx2,
+	[POPCOUNT_ISA_AVX512] = popcount_interleaved_avx512,
+};
+
+static enum popcount_isa popcount_selected_isa = POPCOUNT_ISA_MAX;
+
+int popcount_isa_supported(enum popcount_isa isa) {
+	__builtin_cpu_init();
+
+	switch (isa) {
+	case POPCOUNT_ISA_SCALAR:
+		return 1;
+	case POPCOUNT_ISA_POPCNT:
+		return __builtin_cpu_supports("popcnt");
+	case POPCOUNT_ISA_AVX2:
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+	case POPCOUNT_ISA_AVX512:
+		return __builtin_cpu_supports("avx512f") &&
+			__builtin_cpu_supports("avx512vpopcntdq");
+	default:
+		return 0;
+	}
+}
+
+/* Forces the given kernel, returns 1 if the CPU doesn't support it */
+int popcount_select(enum popcount_isa isa) {
+	if (isa >= POPCOUNT_ISA_MAX || !popcount_isa_supported(isa))
+		return 1;
+
+	popcount_selected_isa = isa;
+
+	return 0;
+}
+
+enum popcount_isa popcount_get_isa(void) {
+	int isa;
+
+	if (popcount_selected_isa != POPCOUNT_ISA_MAX)
+		return popcount_selected_isa;
+
+	for (isa = POPCOUNT_ISA_MAX - 1; isa > POPCOUNT_ISA_SCALAR; isa--) {
+		if (popcount_isa_supported(isa))
+			break;
+	}
+	popcount_selected_isa = isa;
+
+	return popcount_selected_isa;
+}
+
+const char *popcount_isa_name(enum popcount_isa isa) {
+	assert(isa < POPCOUNT_ISA_MAX);
+
+	return popcount_isa_names[isa];
+}
+
+void popcount_split(const uint64_t *once, const uint64_t *twice, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	popcount_split_kernels[popcount_get_isa()](once, twice, words, present, only_once);
+}
+
+void popcount_interleaved(const uint64_t *cells, size_t words,
+		uint64_t *present, uint64_t *only_once) {
+	popcount_interleaved_kernels[popcount_get_isa()](cells, words, present, only_once);
+}
+
+#endif
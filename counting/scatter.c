@@ -0,0 +1,295 @@
+#ifndef __SCATTER_C__
+#define __SCATTER_C__
+
+#include <stdint.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "counting.h"
+
+/*
+ * Shard-owned processing. Every worker owns a contiguous range of shards and
+ * is the only one writing to their bitmaps. Workers read the input as usual,
+ * but instead of counting the numbers themselves they scatter them into
+ * per-owner buffers, which are handed over to the owner once they are full.
+ */
+
+#define SCATTER_BUFFER_SIZE 4096
+#define SCATTER_MAX_PENDING 64
+
+struct scatter_buffer {
+	struct scatter_buffer *next;
+	uint32_t count;
+	uint32_t values[SCATTER_BUFFER_SIZE];
+};
+
+struct scatter_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct scatter_buffer *head;
+	struct scatter_buffer *tail;
+	uint32_t pending;
+	int closed;
+};
+
+struct scatter_ctx {
+	uint32_t owners_count;
+	uint32_t shards_count;
+	struct tree_owner *trees;
+	uint32_t *shard_owner;
+	struct scatter_queue *queues;
+	uint32_t active_readers;
+};
+
+/* Per worker state, the buffers being filled for each owner */
+struct scatter_worker {
+	struct scatter_ctx *ctx;
+	uint32_t owner_id;
+	struct scatter_buffer **filling;
+};
+
+int scatter_init(struct scatter_ctx *ctx, struct tree_owner trees[], uint32_t shards_count,
+		uint32_t owners_count) {
+	uint32_t i;
+	int res;
+
+	ctx->owners_count = owners_count;
+	ctx->shards_count = shards_count;
+	ctx->trees = trees;
+	ctx->active_readers = owners_count;
+
+	ctx->shard_owner = calloc(shards_count, sizeof(uint32_t));
+	if (!ctx->shard_owner)
+		return 1;
+
+	ctx->queues = calloc(owners_count, sizeof(struct scatter_queue));
+	if (!ctx->queues) {
+		free(ctx->shard_owner);
+		return 1;
+	}
+
+	for (i = 0; i < shards_count; i++)
+		ctx->shard_owner[i] = (uint64_t)i * owners_count / shards_count;
+
+	for (i = 0; i < owners_count; i++) {
+		res = pthread_mutex_init(&ctx->queues[i].lock, NULL);
+		assert(res == 0);
+		res = pthread_cond_init(&ctx->queues[i].cond, NULL);
+		assert(res == 0);
+	}
+
+	return 0;
+}
+
+void scatter_deinit(struct scatter_ctx *ctx) {
+	uint32_t i;
+	int res;
+
+	for (i = 0; i < ctx->owners_count; i++) {
+		assert(ctx->queues[i].head == NULL);
+		res = pthread_mutex_destroy(&ctx->queues[i].lock);
+		assert(res == 0);
+		res = pthread_cond_destroy(&ctx->queues[i].cond);
+		assert(res == 0);
+	}
+
+	free(ctx->queues);
+	free(ctx->shard_owner);
+}
+
+/* Returns NULL if the memory can't be allocated */
+static struct scatter_buffer *scatter_buffer_alloc(void) {
+	struct scatter_buffer *buffer = malloc(sizeof(struct scatter_buffer));
+
+	if (!buffer)
+		return NULL;
+	buffer->next = NULL;
+	buffer->count = 0;
+
+	return buffer;
+}
+
+static void scatter_push(struct scatter_queue *queue, struct scatter_buffer *buffer) {
+	int res;
+
+	buffer->next = NULL;
+
+	res = pthread_mutex_lock(&queue->lock);
+	assert(res == 0);
+
+	if (queue->tail)
+		queue->tail->next = buffer;
+	else
+		queue->head = buffer;
+	queue->tail = buffer;
+	queue->pending++;
+
+	res = pthread_cond_signal(&queue->cond);
+	assert(res == 0);
+	res = pthread_mutex_unlock(&queue->lock);
+	assert(res == 0);
+}
+
+/* No more buffers will be pushed, wakes up the owner if it waits for them */
+static void scatter_close(struct scatter_queue *queue) {
+	int res;
+
+	res = pthread_mutex_lock(&queue->lock);
+	assert(res == 0);
+
+	queue->closed = 1;
+
+	res = pthread_cond_signal(&queue->cond);
+	assert(res == 0);
+	res = pthread_mutex_unlock(&queue->lock);
+	assert(res == 0);
+}
+
+/* Detaches the whole list of buffers waiting in the queue */
+static struct scatter_buffer *scatter_pop_all(struct scatter_queue *queue, int wait) {
+	struct scatter_buffer *head;
+	int res;
+
+	res = pthread_mutex_lock(&queue->lock);
+	assert(res == 0);
+
+	while (wait && queue->head == NULL && !queue->closed) {
+		res = pthread_cond_wait(&queue->cond, &queue->lock);
+		assert(res == 0);
+	}
+
+	head = queue->head;
+	queue->head = NULL;
+	queue->tail = NULL;
+	queue->pending = 0;
+
+	res = pthread_mutex_unlock(&queue->lock);
+	assert(res == 0);
+
+	return head;
+}
+
+/* Counts everything that other workers handed over to this one */
+static uint64_t scatter_drain(struct scatter_worker *worker, int wait) {
+	struct scatter_ctx *ctx = worker->ctx;
+	struct scatter_buffer *buffer, *next;
+	uint64_t processed = 0;
+
+	buffer = scatter_pop_all(&ctx->queues[worker->owner_id], wait);
+
+	for (; buffer; buffer = next) {
+		next = buffer->next;
+		count_numbers_owned(buffer->values, buffer->count, ctx->trees);
+		processed += buffer->count;
+		free(buffer);
+	}
+
+	return processed;
+}
+
+static void scatter_hand_over(struct scatter_worker *worker, uint32_t owner_id) {
+	struct scatter_ctx *ctx = worker->ctx;
+	struct scatter_queue *queue = &ctx->queues[owner_id];
+
+	/*
+	 * Don't let a slow owner pile up unbounded amount of buffers. Making
+	 * progress on our own queue in the meantime guarantees that workers
+	 * waiting for each other can't deadlock.
+	 */
+	while (owner_id != worker->owner_id &&
+			__atomic_load_n(&queue->pending, __ATOMIC_RELAXED) > SCATTER_MAX_PENDING) {
+		if (scatter_drain(worker, 0) == 0)
+			sched_yield();
+	}
+
+	scatter_push(queue, worker->filling[owner_id]);
+	worker->filling[owner_id] = scatter_buffer_alloc();
+	// Buffers are handed over in the middle of a batch, there is no way back
+	if (!worker->filling[owner_id]) {
+		printf("Worker %u: failed to allocate a scatter buffer\n", worker->owner_id);
+		exit(1);
+	}
+}
+
+int scatter_worker_init(struct scatter_worker *worker, struct scatter_ctx *ctx, uint32_t owner_id) {
+	uint32_t i;
+
+	worker->ctx = ctx;
+	worker->owner_id = owner_id;
+	worker->filling = calloc(ctx->owners_count, sizeof(struct scatter_buffer *));
+	if (!worker->filling)
+		return 1;
+
+	for (i = 0; i < ctx->owners_count; i++) {
+		worker->filling[i] = scatter_buffer_alloc();
+		if (!worker->filling[i])
+			goto free_buffers;
+	}
+
+	return 0;
+
+free_buffers:
+	while (i-- > 0)
+		free(worker->filling[i]);
+	free(worker->filling);
+	return 1;
+}
+
+/* Distributes a batch of input numbers among the owners of their shards */
+void scatter_numbers(struct scatter_worker *worker, uint32_t *arr, int count) {
+	struct scatter_ctx *ctx = worker->ctx;
+	struct scatter_buffer *buffer;
+	uint32_t shard_ids[COUNTING_TILE_SIZE];
+	uint32_t offsets[COUNTING_TILE_SIZE];
+	uint32_t owner_id;
+	int i, base, len;
+
+	for (base = 0; base < count; base += len) {
+		len = count - base < COUNTING_TILE_SIZE ? count - base : COUNTING_TILE_SIZE;
+		index_batch(&arr[base], len, &ctx->trees[0].index, shard_ids, offsets);
+
+		for (i = 0; i < len; i++) {
+			owner_id = ctx->shard_owner[shard_ids[i]];
+
+			buffer = worker->filling[owner_id];
+			buffer->values[buffer->count++] = arr[base + i];
+
+			if (buffer->count == SCATTER_BUFFER_SIZE)
+				scatter_hand_over(worker, owner_id);
+		}
+	}
+
+	scatter_drain(worker, 0);
+}
+
+/*
+ * Flushes the partially filled buffers and keeps counting the numbers handed
+ * over by the others until every worker has finished reading its input.
+ */
+void scatter_worker_finish(struct scatter_worker *worker) {
+	struct scatter_ctx *ctx = worker->ctx;
+	uint32_t i;
+
+	for (i = 0; i < ctx->owners_count; i++) {
+		if (worker->filling[i]->count > 0)
+			scatter_push(&ctx->queues[i], worker->filling[i]);
+		else
+			free(worker->filling[i]);
+	}
+	free(worker->filling);
+	worker->filling = NULL;
+
+	if (__atomic_sub_fetch(&ctx->active_readers, 1, __ATOMIC_ACQ_REL) == 0) {
+		for (i = 0; i < ctx->owners_count; i++)
+			scatter_close(&ctx->queues[i]);
+	}
+
+	while (__atomic_load_n(&ctx->active_readers, __ATOMIC_ACQUIRE) > 0)
+		scatter_drain(worker, 1);
+
+	scatter_drain(worker, 0);
+}
+
+#endif
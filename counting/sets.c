@@ -0,0 +1,139 @@
+#ifndef __SETS_C__
+#define __SETS_C__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <immintrin.h>
+
+#include "popcount.c"
+
+/*
+ * Kernels combining the bitmaps of several inputs covering the same range.
+ * Every word is first reduced to one presence bit per value: the bitmaps hold
+ * "width" bits per value (1 for the "seen once" bitmap of the split layout, 2
+ * in the interleaved one, the counter width in the counters one) and a value
+ * is present if any of them is set. The AVX2 kernel is picked at runtime if
+ * the CPU supports it.
+ */
+
+#define SETS_MAX_INPUTS 64
+
+/*
+ * Cardinalities of the set operations over the inputs. The difference is the
+ * first input without all the others, the symmetric difference counts the
+ * values present in exactly one input.
+ */
+struct counting_sets {
+	uint64_t union_count;
+	uint64_t intersection;
+	uint64_t difference;
+	uint64_t symmetric_difference;
+};
+
+/* The lowest bit of every field of the given width */
+static inline uint64_t sets_presence_mask(uint32_t width) {
+	return ~0ULL / ((1ULL << width) - 1);
+}
+
+static inline uint64_t sets_presence(uint64_t word, uint32_t width, uint64_t mask) {
+	uint32_t shift;
+
+	for (shift = 1; shift < width; shift <<= 1)
+		word |= word >> shift;
+
+	return word & mask;
+}
+
+static void sets_count_scalar(const uint64_t *const *words, uint32_t inputs, size_t count,
+		uint32_t width, struct counting_sets *sets) {
+	uint64_t mask = sets_presence_mask(width);
+	uint64_t first, present, any, all, rest, twice;
+	size_t i;
+	uint32_t k;
+
+	for (i = 0; i < count; i++) {
+		first = any = all = sets_presence(words[0][i], width, mask);
+		rest = twice = 0;
+
+		for (k = 1; k < inputs; k++) {
+			present = sets_presence(words[k][i], width, mask);
+			twice |= any & present;
+			any |= present;
+			all &= present;
+			rest |= present;
+		}
+
+		sets->union_count += __builtin_popcountll(any);
+		sets->intersection += __builtin_popcountll(all);
+		sets->difference += __builtin_popcountll(first & ~rest);
+		sets->symmetric_difference += __builtin_popcountll(any & ~twice);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i sets_presence_avx2(__m256i v, uint32_t width, __m256i mask) {
+	uint32_t shift;
+
+	for (shift = 1; shift < width; shift <<= 1)
+		v = _mm256_or_si256(v, _mm256_srli_epi64(v, shift));
+
+	return _mm256_and_si256(v, mask);
+}
+
+__attribute__((target("avx2,popcnt")))
+static void sets_count_avx2(const uint64_t *const *words, uint32_t inputs, size_t count,
+		uint32_t width, struct counting_sets *sets) {
+	const __m256i mask = _mm256_set1_epi64x(sets_presence_mask(width));
+	__m256i union_acc = _mm256_setzero_si256();
+	__m256i intersection_acc = _mm256_setzero_si256();
+	__m256i difference_acc = _mm256_setzero_si256();
+	__m256i symmetric_acc = _mm256_setzero_si256();
+	__m256i first, present, any, all, rest, twice;
+	const uint64_t *tails[SETS_MAX_INPUTS];
+	size_t i;
+	uint32_t k;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		first = sets_presence_avx2(_mm256_loadu_si256((const __m256i *)&words[0][i]), width, mask);
+		any = all = first;
+		rest = twice = _mm256_setzero_si256();
+
+		for (k = 1; k < inputs; k++) {
+			present = sets_presence_avx2(_mm256_loadu_si256((const __m256i *)&words[k][i]),
+					width, mask);
+			twice = _mm256_or_si256(twice, _mm256_and_si256(any, present));
+			any = _mm256_or_si256(any, present);
+			all = _mm256_and_si256(all, present);
+			rest = _mm256_or_si256(rest, present);
+		}
+
+		union_acc = _mm256_add_epi64(union_acc, popcount_avx2_vector(any));
+		intersection_acc = _mm256_add_epi64(intersection_acc, popcount_avx2_vector(all));
+		difference_acc = _mm256_add_epi64(difference_acc,
+				popcount_avx2_vector(_mm256_andnot_si256(rest, first)));
+		symmetric_acc = _mm256_add_epi64(symmetric_acc,
+				popcount_avx2_vector(_mm256_andnot_si256(twice, any)));
+	}
+
+	sets->union_count += popcount_avx2_sum(union_acc);
+	sets->intersection += popcount_avx2_sum(intersection_acc);
+	sets->difference += popcount_avx2_sum(difference_acc);
+	sets->symmetric_difference += popcount_avx2_sum(symmetric_acc);
+
+	for (k = 0; k < inputs; k++)
+		tails[k] = &words[k][i];
+	sets_count_scalar(tails, inputs, count - i, width, sets);
+}
+
+/* Adds the cardinalities of count words of every input, at most SETS_MAX_INPUTS of them */
+void sets_count(const uint64_t *const *words, uint32_t inputs, size_t count, uint32_t width,
+		struct counting_sets *sets) {
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		sets_count_avx2(words, inputs, count, width, sets);
+	else
+		sets_count_scalar(words, inputs, count, width, sets);
+}
+
+#endif
@@ -0,0 +1,323 @@
+#ifndef __STREAM_C__
+#define __STREAM_C__
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "counting.h"
+
+/*
+ * Streaming of an input which can only be read once from the start, stdin or a
+ * FIFO. A single reader fills buffers from the stream and hands them out to the
+ * workers through a ring, the workers give them back through another one. The
+ * rings are lock-free, the semaphores only put a thread to sleep if there is
+ * nothing to take. The workers count every buffer under the read side of an
+ * rwlock, a snapshot takes the write side between two buffers while the reader
+ * keeps filling the free ones.
+ */
+
+// Numbers of a buffer
+#define STREAM_BATCH_SIZE 16384
+#define STREAM_BUFFERS_PER_WORKER 4
+// Handed out to every worker once the stream ends
+#define STREAM_END UINT32_MAX
+
+/* Bounded MPMC ring of buffer indices, every slot carries the sequence of its next use */
+struct stream_ring {
+	uint64_t *sequences;
+	uint32_t *slots;
+	uint64_t mask;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	// Indices pushed and not taken yet
+	sem_t items;
+};
+
+struct stream_ctx {
+	int fd;
+	struct tree_owner *trees;
+	uint32_t shards_count;
+	uint32_t workers_count;
+	count_numbers_fn count_numbers;
+	uint32_t *buffers;
+	// Numbers held by every buffer
+	uint32_t *counts;
+	uint32_t buffers_count;
+	struct stream_ring filled;
+	struct stream_ring free;
+	pthread_rwlock_t lock;
+	// Held by a snapshot, the workers wait on it instead of taking the read side again
+	pthread_mutex_t gate;
+	int snapshot_pending;
+	uint64_t read_numbers;
+	uint64_t counted_numbers;
+};
+
+struct stream_snapshot {
+	// Read from the stream and counted so far, the rest is queued
+	uint64_t read_numbers;
+	uint64_t counted_numbers;
+	uint64_t unique;
+	uint64_t seen_only_once;
+};
+
+/* The capacity must be a power of two */
+static int stream_ring_init(struct stream_ring *ring, uint64_t capacity) {
+	uint64_t i;
+	int res;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->sequences = malloc(capacity * sizeof(uint64_t));
+	ring->slots = malloc(capacity * sizeof(uint32_t));
+	if (!ring->sequences || !ring->slots) {
+		free(ring->sequences);
+		free(ring->slots);
+		return 1;
+	}
+
+	for (i = 0; i < capacity; i++)
+		ring->sequences[i] = i;
+	ring->mask = capacity - 1;
+	res = sem_init(&ring->items, 0, 0);
+	assert(res == 0);
+
+	return 0;
+}
+
+static void stream_ring_deinit(struct stream_ring *ring) {
+	int res;
+
+	res = sem_destroy(&ring->items);
+	assert(res == 0);
+	free(ring->sequences);
+	free(ring->slots);
+}
+
+/* The rings are sized for every index there is, a push never finds them full */
+static void stream_ring_push(struct stream_ring *ring, uint32_t value) {
+	uint64_t position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	uint64_t sequence;
+	int res;
+
+	while (1) {
+		sequence = __atomic_load_n(&ring->sequences[position & ring->mask], __ATOMIC_ACQUIRE);
+		assert(sequence >= position);
+
+		if (sequence == position && __atomic_compare_exchange_n(&ring->tail, &position,
+					position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+		if (sequence > position)
+			position = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+
+	ring->slots[position & ring->mask] = value;
+	__atomic_store_n(&ring->sequences[position & ring->mask], position + 1, __ATOMIC_RELEASE);
+	res = sem_post(&ring->items);
+	assert(res == 0);
+}
+
+static uint32_t stream_ring_pop(struct stream_ring *ring) {
+	uint64_t position, sequence;
+	uint32_t value;
+
+	while (sem_wait(&ring->items) != 0)
+		assert(errno == EINTR);
+
+	// The index is there, but a push of an earlier slot may not be finished yet
+	position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	while (1) {
+		sequence = __atomic_load_n(&ring->sequences[position & ring->mask], __ATOMIC_ACQUIRE);
+
+		if (sequence == position + 1 && __atomic_compare_exchange_n(&ring->head, &position,
+					position + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+		if (sequence > position + 1)
+			position = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+
+	value = ring->slots[position & ring->mask];
+	__atomic_store_n(&ring->sequences[position & ring->mask], position + ring->mask + 1,
+			__ATOMIC_RELEASE);
+
+	return value;
+}
+
+/* Counts the stream of fd into the prepared shards, returns 1 if it can't allocate the buffers */
+int stream_init(struct stream_ctx *ctx, int fd, struct tree_owner *trees, uint32_t shards_count,
+		count_numbers_fn count_numbers, uint32_t workers_count) {
+	uint64_t capacity = 1;
+	uint32_t i;
+	int res;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->fd = fd;
+	ctx->trees = trees;
+	ctx->shards_count = shards_count;
+	ctx->workers_count = workers_count;
+	ctx->count_numbers = count_numbers;
+	ctx->buffers_count = workers_count * STREAM_BUFFERS_PER_WORKER;
+
+	// The end of the stream takes a slot of every worker on top of the buffers
+	while (capacity < ctx->buffers_count + workers_count)
+		capacity *= 2;
+
+	ctx->buffers = malloc((uint64_t)ctx->buffers_count * STREAM_BATCH_SIZE * sizeof(uint32_t));
+	ctx->counts = calloc(ctx->buffers_count, sizeof(uint32_t));
+	if (!ctx->buffers || !ctx->counts)
+		goto free_buffers;
+
+	if (stream_ring_init(&ctx->filled, capacity) != 0)
+		goto free_buffers;
+	if (stream_ring_init(&ctx->free, capacity) != 0)
+		goto free_filled;
+
+	for (i = 0; i < ctx->buffers_count; i++)
+		stream_ring_push(&ctx->free, i);
+
+	res = pthread_rwlock_init(&ctx->lock, NULL);
+	assert(res == 0);
+	res = pthread_mutex_init(&ctx->gate, NULL);
+	assert(res == 0);
+
+	return 0;
+
+free_filled:
+	stream_ring_deinit(&ctx->filled);
+free_buffers:
+	free(ctx->buffers);
+	free(ctx->counts);
+	return 1;
+}
+
+void stream_deinit(struct stream_ctx *ctx) {
+	int res;
+
+	res = pthread_rwlock_destroy(&ctx->lock);
+	assert(res == 0);
+	res = pthread_mutex_destroy(&ctx->gate);
+	assert(res == 0);
+	stream_ring_deinit(&ctx->filled);
+	stream_ring_deinit(&ctx->free);
+	free(ctx->buffers);
+	free(ctx->counts);
+}
+
+/* Worker thread, counts the buffers until the end of the stream */
+void *stream_worker(void *param) {
+	struct stream_ctx *ctx = param;
+	uint32_t buffer;
+	int res;
+
+	while ((buffer = stream_ring_pop(&ctx->filled)) != STREAM_END) {
+		if (__atomic_load_n(&ctx->snapshot_pending, __ATOMIC_RELAXED)) {
+			res = pthread_mutex_lock(&ctx->gate);
+			assert(res == 0);
+			res = pthread_mutex_unlock(&ctx->gate);
+			assert(res == 0);
+		}
+
+		res = pthread_rwlock_rdlock(&ctx->lock);
+		assert(res == 0);
+		ctx->count_numbers(&ctx->buffers[(uint64_t)buffer * STREAM_BATCH_SIZE],
+				ctx->counts[buffer], ctx->trees);
+		__atomic_add_fetch(&ctx->counted_numbers, ctx->counts[buffer], __ATOMIC_RELAXED);
+		res = pthread_rwlock_unlock(&ctx->lock);
+		assert(res == 0);
+
+		stream_ring_push(&ctx->free, buffer);
+	}
+
+	return NULL;
+}
+
+/*
+ * Reads the stream until its end in the calling thread, then tells the workers
+ * to finish. The whole numbers read are handed out right away, a live producer
+ * may not fill a buffer for long, the bytes of a number split between two reads
+ * are carried over to the next buffer. Returns 1 if the stream can't be read.
+ */
+int stream_read(struct stream_ctx *ctx) {
+	uint32_t buffer = stream_ring_pop(&ctx->free);
+	uint64_t size = STREAM_BATCH_SIZE * sizeof(uint32_t);
+	uint64_t filled = 0, partial;
+	ssize_t read_bytes;
+	uint32_t next, i;
+	char *data;
+	int res = 0;
+
+	while (1) {
+		data = (char *)&ctx->buffers[(uint64_t)buffer * STREAM_BATCH_SIZE];
+
+		read_bytes = read(ctx->fd, data + filled, size - filled);
+		if (read_bytes < 0 && errno == EINTR)
+			continue;
+		if (read_bytes < 1) {
+			res = read_bytes < 0;
+			break;
+		}
+
+		filled += read_bytes;
+		if (filled < sizeof(uint32_t))
+			continue;
+
+		next = stream_ring_pop(&ctx->free);
+		partial = filled % sizeof(uint32_t);
+		memcpy(&ctx->buffers[(uint64_t)next * STREAM_BATCH_SIZE], data + filled - partial,
+				partial);
+
+		ctx->counts[buffer] = filled / sizeof(uint32_t);
+		__atomic_add_fetch(&ctx->read_numbers, ctx->counts[buffer], __ATOMIC_RELAXED);
+		stream_ring_push(&ctx->filled, buffer);
+
+		buffer = next;
+		filled = partial;
+	}
+
+	// Trailing bytes of an incomplete number are dropped, as with the files
+	stream_ring_push(&ctx->free, buffer);
+	for (i = 0; i < ctx->workers_count; i++)
+		stream_ring_push(&ctx->filled, STREAM_END);
+
+	return res;
+}
+
+/*
+ * Counts the results of the numbers counted so far with the given number of
+ * threads, only the shards changed since the previous snapshot are counted
+ * again. The workers wait until it's done, the reader doesn't. Returns 1 if
+ * the results can't be computed.
+ */
+int stream_snapshot(struct stream_ctx *ctx, uint32_t threads, struct stream_snapshot *snapshot) {
+	int res, ret;
+
+	res = pthread_mutex_lock(&ctx->gate);
+	assert(res == 0);
+	__atomic_store_n(&ctx->snapshot_pending, 1, __ATOMIC_RELAXED);
+	res = pthread_rwlock_wrlock(&ctx->lock);
+	assert(res == 0);
+
+	ret = counting_finalize(ctx->trees, ctx->shards_count, threads);
+	if (ret == 0) {
+		snapshot->read_numbers = __atomic_load_n(&ctx->read_numbers, __ATOMIC_RELAXED);
+		snapshot->counted_numbers = ctx->counted_numbers;
+		snapshot->unique = aggregate_unique_numbers(ctx->trees, ctx->shards_count);
+		snapshot->seen_only_once = aggregate_seen_only_once(ctx->trees, ctx->shards_count);
+	}
+
+	res = pthread_rwlock_unlock(&ctx->lock);
+	assert(res == 0);
+	__atomic_store_n(&ctx->snapshot_pending, 0, __ATOMIC_RELAXED);
+	res = pthread_mutex_unlock(&ctx->gate);
+	assert(res == 0);
+
+	return ret;
+}
+
+#endif
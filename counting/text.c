@@ -0,0 +1,194 @@
+#ifndef __TEXT_C__
+#define __TEXT_C__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <immintrin.h>
+
+/*
+ * Parser of decimal inputs, one number per line ending with '\n', the last
+ * line may lack it. A worker takes the lines starting in its chunk, the last
+ * one may end past it. The SSE4.1 kernel finds the newline among the 16 bytes
+ * at the start of a line, checks the digits, aligns them to the end of the
+ * vector and combines them pairwise into two 8-digit halves. Lines it can't
+ * load whole, near the end of the input or longer than 15 bytes, are parsed
+ * by the scalar kernel. The SSE4.1 kernel is picked at runtime if the CPU
+ * supports it.
+ */
+
+#define TEXT_VECTOR_SIZE 16
+
+enum text_error {
+	TEXT_OK,
+	// Empty, or holding something else than digits
+	TEXT_MALFORMED,
+	// Over 2^32 - 1
+	TEXT_OUT_OF_RANGE,
+};
+
+struct text_parser {
+	const char *data;
+	uint64_t size;
+	// Of the next line to be parsed
+	uint64_t position;
+	// Lines starting from here on belong to the next chunk
+	uint64_t end;
+	// Set once the parsing stopped, position is the start of the line
+	enum text_error error;
+};
+
+const char *text_error_name(enum text_error error) {
+	if (error == TEXT_OUT_OF_RANGE)
+		return "value over 4294967295";
+
+	return "malformed line";
+}
+
+/* The first line starting at or after position, lines start after a newline */
+static uint64_t text_line_start(const char *data, uint64_t size, uint64_t position) {
+	const char *newline;
+
+	if (position == 0 || position >= size)
+		return position < size ? position : size;
+
+	newline = memchr(&data[position - 1], '\n', size - position + 1);
+
+	return newline ? (uint64_t)(newline - data) + 1 : size;
+}
+
+/* Parses the lines starting in [begin, end) of the input of size bytes */
+void text_parser_init(struct text_parser *parser, const char *data, uint64_t size,
+		uint64_t begin, uint64_t end) {
+	parser->data = data;
+	parser->size = size;
+	parser->position = text_line_start(data, size, begin);
+	parser->end = end < size ? end : size;
+	parser->error = TEXT_OK;
+}
+
+/* Parses a single line, returns its length without the newline or -1 if it's invalid */
+static int64_t text_parse_scalar(struct text_parser *parser, uint32_t *value) {
+	const char *line = &parser->data[parser->position];
+	uint64_t length, limit = parser->size - parser->position;
+	uint64_t result = 0;
+
+	for (length = 0; length < limit && line[length] != '\n'; length++) {
+		if (line[length] < '0' || line[length] > '9') {
+			parser->error = TEXT_MALFORMED;
+			return -1;
+		}
+
+		result = result * 10 + (line[length] - '0');
+		if (result > UINT32_MAX) {
+			parser->error = TEXT_OUT_OF_RANGE;
+			return -1;
+		}
+	}
+
+	if (length == 0) {
+		parser->error = TEXT_MALFORMED;
+		return -1;
+	}
+
+	*value = result;
+
+	return length;
+}
+
+static uint32_t text_parse_lines_scalar(struct text_parser *parser, uint32_t *values,
+		uint32_t max_values) {
+	uint32_t count = 0;
+	int64_t length;
+
+	while (count < max_values && parser->position < parser->end) {
+		length = text_parse_scalar(parser, &values[count]);
+		if (length < 0)
+			break;
+
+		parser->position += length + 1;
+		count++;
+	}
+
+	return count;
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t text_parse_lines_sse41(struct text_parser *parser, uint32_t *values,
+		uint32_t max_values) {
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i zero_char = _mm_set1_epi8('0');
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	// Weights of the more significant digit of a pair, then of a pair of pairs and so on
+	const __m128i tens = _mm_set1_epi16(0x010a);
+	const __m128i hundreds = _mm_set1_epi32(0x00010064);
+	const __m128i ten_thousands = _mm_set1_epi32(0x00012710);
+	__m128i v, digits, shuffle, pairs, quads;
+	uint32_t count = 0, newlines, invalid, length;
+	int64_t scalar_length;
+
+	while (count < max_values && parser->position < parser->end) {
+		if (parser->size - parser->position < TEXT_VECTOR_SIZE)
+			goto scalar;
+
+		v = _mm_loadu_si128((const __m128i *)&parser->data[parser->position]);
+		newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(v, newline));
+		if (newlines == 0)
+			goto scalar;
+
+		length = __builtin_ctz(newlines);
+		digits = _mm_sub_epi8(v, zero_char);
+		// Bytes below '0' wrap around above 9
+		invalid = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(digits, nine), digits)) &
+			((1U << length) - 1);
+		if (length == 0 || invalid)
+			goto scalar;
+
+		// Negative indices, with the top bit set, zero the leading bytes
+		shuffle = _mm_add_epi8(iota, _mm_set1_epi8(length - TEXT_VECTOR_SIZE));
+		digits = _mm_shuffle_epi8(digits, shuffle);
+
+		pairs = _mm_maddubs_epi16(digits, tens);
+		quads = _mm_madd_epi16(pairs, hundreds);
+		quads = _mm_packus_epi32(quads, quads);
+		quads = _mm_madd_epi16(quads, ten_thousands);
+
+		// Up to 15 digits, the halves hold 7 and 8 of them
+		if ((uint64_t)_mm_cvtsi128_si32(quads) * 100000000 +
+				(uint32_t)_mm_extract_epi32(quads, 1) > UINT32_MAX)
+			goto scalar;
+
+		values[count++] = (uint64_t)_mm_cvtsi128_si32(quads) * 100000000 +
+			(uint32_t)_mm_extract_epi32(quads, 1);
+		parser->position += length + 1;
+		continue;
+
+scalar:
+		// Also finds out what's wrong with the line
+		scalar_length = text_parse_scalar(parser, &values[count]);
+		if (scalar_length < 0)
+			break;
+		parser->position += scalar_length + 1;
+		count++;
+	}
+
+	return count;
+}
+
+/*
+ * Parses up to max_values numbers of the lines of the chunk into values and
+ * returns how many there were. Once it returns less than max_values, either
+ * the chunk is done or parser->error tells what's wrong with the line at
+ * parser->position.
+ */
+uint32_t text_parse(struct text_parser *parser, uint32_t *values, uint32_t max_values) {
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse4.1"))
+		return text_parse_lines_sse41(parser, values, max_values);
+
+	return text_parse_lines_scalar(parser, values, max_values);
+}
+
+#endif
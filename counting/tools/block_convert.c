@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "../block.c"
+
+/*
+ * Converts an input of the counting tool into the compressed block format,
+ * see block.c, or back with -d. Every block but the last one is padded to
+ * BLOCK_BYTES bytes, so the counting tool can split the file anywhere on a
+ * multiple of it.
+ */
+
+static double elapsed_seconds(struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int write_all(int fd, const void *data, uint64_t size) {
+	const char *bytes = data;
+	ssize_t written;
+
+	while (size > 0) {
+		written = write(fd, bytes, size);
+		if (written < 1)
+			return 1;
+		bytes += written;
+		size -= written;
+	}
+
+	return 0;
+}
+
+static int encode(int in, int out, uint64_t *numbers, uint64_t *blocks) {
+	struct block_header *header;
+	uint64_t size, position = 0, packed = 0;
+	const uint32_t *values = NULL;
+	char *block;
+	int res = 0;
+
+	size = lseek(in, 0L, SEEK_END) / sizeof(uint32_t);
+	if (size > 0) {
+		values = mmap(NULL, size * sizeof(uint32_t), PROT_READ, MAP_PRIVATE, in, 0);
+		if (values == MAP_FAILED)
+			return 1;
+		madvise((void *)values, size * sizeof(uint32_t), MADV_SEQUENTIAL);
+	}
+
+	block = malloc(BLOCK_BYTES);
+	if (!block) {
+		res = 1;
+		goto unmap;
+	}
+	header = (struct block_header *)block;
+
+	*blocks = 0;
+	while (position < size) {
+		memset(block, 0, BLOCK_BYTES);
+		position += block_encode(&values[position], size - position, block);
+		packed += header->encoding == BLOCK_ENCODING_PACKED;
+		(*blocks)++;
+
+		// The last one isn't padded
+		if (write_all(out, block, position < size ? BLOCK_BYTES :
+					sizeof(*header) + header->payload_size) != 0) {
+			res = 1;
+			break;
+		}
+	}
+
+	printf("Blocks: %lu packed, %lu varint\n", packed, *blocks - packed);
+	*numbers = position;
+	free(block);
+unmap:
+	if (values)
+		munmap((void *)values, size * sizeof(uint32_t));
+
+	return res;
+}
+
+static int decode(int in, int out, uint64_t *numbers, uint64_t *blocks) {
+	uint32_t *values;
+	uint64_t position = 0;
+	uint32_t count;
+	ssize_t read_bytes;
+	char *block;
+	int res = 0;
+
+	block = malloc(BLOCK_BYTES);
+	values = malloc(BLOCK_MAX_VALUES * sizeof(uint32_t));
+	if (!block || !values) {
+		res = 1;
+		goto free_buffers;
+	}
+
+	*numbers = 0;
+	*blocks = 0;
+	while ((read_bytes = pread(in, block, BLOCK_BYTES, position)) > 0) {
+		if (block_decode(block, read_bytes, values, &count) != 0) {
+			printf("Invalid block at byte %lu\n", position);
+			res = 1;
+			break;
+		}
+		if (write_all(out, values, count * sizeof(uint32_t)) != 0) {
+			res = 1;
+			break;
+		}
+
+		position += read_bytes;
+		*numbers += count;
+		(*blocks)++;
+	}
+
+	if (read_bytes < 0)
+		res = 1;
+
+free_buffers:
+	free(block);
+	free(values);
+
+	return res;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [-d] <input> <output>\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	struct timespec start_time;
+	uint64_t numbers = 0, blocks = 0, in_size, out_size;
+	int decompress = 0;
+	int in, out, opt;
+	int ret = 0;
+	double elapsed;
+
+	while ((opt = getopt(argc, argv, "d")) != -1) {
+		switch (opt) {
+		case 'd':
+			decompress = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	in = open(argv[optind], O_RDONLY);
+	if (in < 0) {
+		printf("Failed to open %s\n", argv[optind]);
+		return 1;
+	}
+
+	out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		printf("Failed to open %s\n", argv[optind + 1]);
+		close(in);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	if (decompress)
+		ret = decode(in, out, &numbers, &blocks);
+	else
+		ret = encode(in, out, &numbers, &blocks);
+
+	if (ret != 0) {
+		printf("Failed to convert %s\n", argv[optind]);
+		goto close_files;
+	}
+
+	elapsed = elapsed_seconds(&start_time);
+	in_size = lseek(in, 0L, SEEK_END);
+	out_size = lseek(out, 0L, SEEK_END);
+	printf("Converted %lu numbers in %lu blocks in %.3f s (%.2f M numbers/s)\n", numbers,
+			blocks, elapsed, numbers / elapsed / 1e6);
+	printf("Size %.1f MB -> %.1f MB (%.2fx)\n", in_size / 1e6, out_size / 1e6,
+			out_size ? (double)in_size / out_size : 0.0);
+
+close_files:
+	close(in);
+	close(out);
+
+	return ret;
+}
@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "../counting.h"
+#include "../../common/autotune.c"
+
+/*
+ * Benchmark of count_numbers() and the other engines. A workload of the given
+ * distribution is generated once and counted for every combination of the
+ * engines, threads and shards counts, either straight from memory or read back
+ * from a file. Every run prints one JSON object per line, so the output can be
+ * compared between builds to catch regressions.
+ */
+
+#define READ_BATCH_SIZE 16384
+#define DEFAULT_VALUES (16 * 1024 * 1024)
+#define DEFAULT_REPEATS 3
+#define MAX_SWEEP 32
+
+// Distinct values the Zipfian workload draws from, ranked by popularity
+#define ZIPF_RANKS (1 << 20)
+#define ZIPF_EXPONENT 1.0
+// The clustered workload is made of dense ranges spread over the domain
+#define CLUSTERS 64
+#define CLUSTER_WIDTH (1 << 16)
+
+enum workload {
+	WORKLOAD_UNIFORM,
+	WORKLOAD_ZIPF,
+	WORKLOAD_SORTED,
+	WORKLOAD_CLUSTERED,
+	WORKLOAD_DUPLICATE,
+	WORKLOAD_UNIQUE,
+	WORKLOAD_MAX,
+};
+
+static const char *workload_names[WORKLOAD_MAX] = {
+	[WORKLOAD_UNIFORM] = "uniform",
+	[WORKLOAD_ZIPF] = "zipf",
+	[WORKLOAD_SORTED] = "sorted",
+	[WORKLOAD_CLUSTERED] = "clustered",
+	[WORKLOAD_DUPLICATE] = "duplicate",
+	[WORKLOAD_UNIQUE] = "unique",
+};
+
+enum source {
+	SOURCE_MEMORY,
+	SOURCE_FILE,
+};
+
+struct bench_worker {
+	pthread_t thread;
+	count_numbers_fn count_numbers;
+	struct tree_owner *trees;
+	// Slice of the workload, in numbers
+	const uint32_t *values;
+	uint64_t begin;
+	uint64_t end;
+	enum source source;
+	int fd;
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64*, the generated workloads don't depend on the libc */
+static uint64_t rng_next(void) {
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static int compare_values(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Values drawn by inverting the CDF of the Zipf distribution over ZIPF_RANKS ranks */
+static int generate_zipf(uint32_t *values, uint64_t count) {
+	double *cdf = malloc(ZIPF_RANKS * sizeof(double));
+	double sum = 0, u;
+	uint32_t begin, end, middle;
+	uint64_t i;
+
+	if (!cdf)
+		return 1;
+
+	for (i = 0; i < ZIPF_RANKS; i++) {
+		sum += 1.0 / pow(i + 1, ZIPF_EXPONENT);
+		cdf[i] = sum;
+	}
+
+	for (i = 0; i < count; i++) {
+		u = (rng_next() >> 11) * (1.0 / (1ULL << 53)) * sum;
+
+		begin = 0;
+		end = ZIPF_RANKS - 1;
+		while (begin < end) {
+			middle = (begin + end) / 2;
+			if (cdf[middle] < u)
+				begin = middle + 1;
+			else
+				end = middle;
+		}
+
+		// Scatters the popular ranks over the whole domain
+		values[i] = (begin + 1) * 2654435761U;
+	}
+
+	free(cdf);
+
+	return 0;
+}
+
+static int generate(uint32_t *values, uint64_t count, enum workload workload) {
+	uint32_t cluster_base[CLUSTERS];
+	uint32_t constant = rng_next();
+	uint64_t i;
+
+	switch (workload) {
+	case WORKLOAD_UNIFORM:
+	case WORKLOAD_SORTED:
+		for (i = 0; i < count; i++)
+			values[i] = rng_next() >> 32;
+		if (workload == WORKLOAD_SORTED)
+			qsort(values, count, sizeof(uint32_t), compare_values);
+		return 0;
+	case WORKLOAD_ZIPF:
+		return generate_zipf(values, count);
+	case WORKLOAD_CLUSTERED:
+		for (i = 0; i < CLUSTERS; i++)
+			cluster_base[i] = (rng_next() >> 32) % (COUNTING_MAX_INPUT - CLUSTER_WIDTH);
+		for (i = 0; i < count; i++)
+			values[i] = cluster_base[rng_next() % CLUSTERS] + rng_next() % CLUSTER_WIDTH;
+		return 0;
+	case WORKLOAD_DUPLICATE:
+		for (i = 0; i < count; i++)
+			values[i] = constant;
+		return 0;
+	case WORKLOAD_UNIQUE:
+		// Multiplying by an odd number is a bijection modulo 2^32
+		for (i = 0; i < count; i++)
+			values[i] = (uint32_t)(i + constant) * 2654435761U;
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+static void *bench_counting(void *param) {
+	struct bench_worker *worker = param;
+	uint32_t arr[READ_BATCH_SIZE];
+	uint64_t position = worker->begin;
+	uint32_t batch;
+	ssize_t read_bytes;
+
+	while (position < worker->end) {
+		batch = worker->end - position < READ_BATCH_SIZE ? worker->end - position :
+			READ_BATCH_SIZE;
+
+		if (worker->source == SOURCE_MEMORY) {
+			worker->count_numbers((uint32_t *)&worker->values[position], batch, worker->trees);
+		} else {
+			read_bytes = pread(worker->fd, arr, batch * sizeof(uint32_t),
+					position * sizeof(uint32_t));
+			if (read_bytes < (ssize_t)sizeof(uint32_t)) {
+				printf("Failed to read the workload file\n");
+				exit(1);
+			}
+			batch = read_bytes / sizeof(uint32_t);
+			worker->count_numbers(arr, batch, worker->trees);
+		}
+
+		position += batch;
+	}
+
+	return NULL;
+}
+
+static double elapsed_seconds(struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Counts the workload once, returns the time spent in the engine or a negative value on error */
+static double bench_run(const uint32_t *values, uint64_t count, int fd, enum source source,
+		enum counting_engine engine, enum counting_layout layout, uint32_t threads,
+		uint32_t shards, uint64_t *unique, uint64_t *only_once) {
+	struct tree_owner *trees = calloc(shards, sizeof(struct tree_owner));
+	struct bench_worker *workers = calloc(threads, sizeof(struct bench_worker));
+	struct timespec start_time;
+	double elapsed = -1;
+	uint32_t i, started;
+	int res;
+
+	if (!trees || !workers)
+		goto free_ctx;
+
+	if (prepare_shards_layout(trees, shards, COUNTING_MAX_INPUT / shards, layout) != 0)
+		goto free_ctx;
+
+	if (source == SOURCE_FILE)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	for (i = 0; i < threads; i++) {
+		workers[i].count_numbers = counting_engine_get(engine);
+		workers[i].trees = trees;
+		workers[i].values = values;
+		workers[i].begin = count * i / threads;
+		workers[i].end = count * (i + 1) / threads;
+		workers[i].source = source;
+		workers[i].fd = fd;
+
+		res = pthread_create(&workers[i].thread, NULL, bench_counting, &workers[i]);
+		if (res != 0) {
+			printf("Failed to initialize thread %u\n", i);
+			break;
+		}
+	}
+	started = i;
+
+	for (i = 0; i < started; i++) {
+		res = pthread_join(workers[i].thread, NULL);
+		assert(res == 0);
+	}
+
+	elapsed = elapsed_seconds(&start_time);
+
+	// A partial run doesn't measure the workload
+	if (started < threads || counting_finalize(trees, shards, threads) != 0) {
+		elapsed = -1;
+	} else {
+		*unique = aggregate_unique_numbers(trees, shards);
+		*only_once = aggregate_seen_only_once(trees, shards);
+	}
+
+	destroy_shards(trees, shards);
+free_ctx:
+	free(workers);
+	free(trees);
+
+	return elapsed;
+}
+
+/* Parses a comma separated list of numbers between 1 and max */
+static int parse_list(char *arg, uint32_t *list, uint32_t *count, uint32_t max) {
+	char *token, *saveptr;
+
+	*count = 0;
+
+	for (token = strtok_r(arg, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+		if (*count == MAX_SWEEP || autotune_parse(token, &list[*count], max) != 0 ||
+				list[*count] == 0)
+			return 1;
+		(*count)++;
+	}
+
+	return *count == 0;
+}
+
+static int parse_engines(char *arg, enum counting_engine *list, uint32_t *count) {
+	char *token, *saveptr;
+
+	*count = 0;
+
+	for (token = strtok_r(arg, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr)) {
+		if (*count == MAX_SWEEP)
+			return 1;
+		list[*count] = counting_engine_from_name(token);
+		if (list[*count] == COUNTING_ENGINE_MAX)
+			return 1;
+		(*count)++;
+	}
+
+	return *count == 0;
+}
+
+static enum workload workload_from_name(const char *name) {
+	int i;
+
+	for (i = 0; i < WORKLOAD_MAX; i++) {
+		if (strcmp(name, workload_names[i]) == 0)
+			return i;
+	}
+
+	return WORKLOAD_MAX;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [-w uniform|zipf|sorted|clustered|duplicate|unique] [-n values] [-f workload_file] [-e engines] [-l split|interleaved|adaptive] [-t threads] [-s shards] [-r repeats]\n", name);
+	printf("Engines, threads and shards are comma separated lists which are swept\n");
+}
+
+int main(int argc, char *argv[]) {
+	enum workload workload = WORKLOAD_UNIFORM;
+	enum counting_layout layout = COUNTING_LAYOUT_SPLIT;
+	enum counting_engine engines[MAX_SWEEP] = {COUNTING_ENGINE_LOCKED, COUNTING_ENGINE_ATOMIC};
+	uint32_t threads[MAX_SWEEP] = {1, THREAD_COUNT};
+	uint32_t shards[MAX_SWEEP] = {SHARDS};
+	uint32_t engines_count = 2, threads_count = 2, shards_count = 1;
+	uint64_t values_count = DEFAULT_VALUES;
+	uint32_t repeats = DEFAULT_REPEATS;
+	const char *file_path = NULL;
+	enum source source = SOURCE_MEMORY;
+	uint32_t *values = NULL;
+	uint64_t unique = 0, only_once = 0;
+	uint32_t e, t, s, r;
+	double best, elapsed;
+	int fd = -1;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:n:f:e:l:t:s:r:")) != -1) {
+		switch (opt) {
+		case 'w':
+			workload = workload_from_name(optarg);
+			if (workload == WORKLOAD_MAX) {
+				printf("Unknown workload %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'n':
+			values_count = strtoull(optarg, NULL, 10);
+			if (values_count == 0) {
+				printf("The workload needs at least one value\n");
+				return 1;
+			}
+			break;
+		case 'f':
+			file_path = optarg;
+			source = SOURCE_FILE;
+			break;
+		case 'e':
+			if (parse_engines(optarg, engines, &engines_count) != 0) {
+				printf("Invalid list of engines\n");
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'l':
+			layout = counting_layout_from_name(optarg);
+			if (layout == COUNTING_LAYOUT_MAX) {
+				printf("Unknown layout %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			if (parse_list(optarg, threads, &threads_count, 1024) != 0) {
+				printf("Threads counts must be between 1 and 1024\n");
+				return 1;
+			}
+			break;
+		case 's':
+			if (parse_list(optarg, shards, &shards_count, COUNTING_MAX_SHARDS) != 0) {
+				printf("Shards counts must be between 1 and %d\n", COUNTING_MAX_SHARDS);
+				return 1;
+			}
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			if (repeats < 1) {
+				printf("At least one repeat is needed\n");
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc != optind) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	values = malloc(values_count * sizeof(uint32_t));
+	if (!values) {
+		printf("Failed to allocate the workload\n");
+		return 1;
+	}
+
+	if (generate(values, values_count, workload) != 0) {
+		printf("Failed to generate the workload\n");
+		ret = 1;
+		goto free_values;
+	}
+
+	// The file backed runs read the workload back, so it has to be written out first
+	if (source == SOURCE_FILE) {
+		fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, values, values_count * sizeof(uint32_t)) !=
+				(ssize_t)(values_count * sizeof(uint32_t)) || fsync(fd) != 0) {
+			printf("Failed to write the workload file\n");
+			ret = 1;
+			goto close_file;
+		}
+	}
+
+	for (e = 0; e < engines_count; e++) {
+		for (t = 0; t < threads_count; t++) {
+			for (s = 0; s < shards_count; s++) {
+				best = 0;
+
+				for (r = 0; r < repeats; r++) {
+					elapsed = bench_run(values, values_count, fd, source, engines[e],
+							layout, threads[t], shards[s], &unique, &only_once);
+					if (elapsed < 0) {
+						printf("Failed to run the benchmark\n");
+						ret = 1;
+						goto close_file;
+					}
+					if (r == 0 || elapsed < best)
+						best = elapsed;
+				}
+
+				printf("{\"workload\": \"%s\", \"source\": \"%s\", \"engine\": \"%s\", "
+						"\"layout\": \"%s\", \"threads\": %u, \"shards\": %u, "
+						"\"values\": %lu, \"seconds\": %.6f, \"values_per_s\": %.0f, "
+						"\"ns_per_value\": %.3f, \"gb_per_s\": %.3f, "
+						"\"unique\": %lu, \"seen_only_once\": %lu}\n",
+						workload_names[workload],
+						source == SOURCE_FILE ? "file" : "memory",
+						counting_engine_name(engines[e]), counting_layout_name(layout),
+						threads[t], shards[s], values_count, best,
+						values_count / best, best * 1e9 / values_count,
+						values_count * sizeof(uint32_t) / best / 1e9,
+						unique, only_once);
+				fflush(stdout);
+			}
+		}
+	}
+
+close_file:
+	if (fd >= 0) {
+		close(fd);
+		unlink(file_path);
+	}
+free_values:
+	free(values);
+
+	return ret;
+}
@@ -1,66 +1,391 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <math.h>
 #include <time.h>
-#include <limits.h>
+#include <sys/mman.h>
 
-#define COUNT 1000000000
-#define LIMIT (1024*1024*1024)
+#include "../popcount.c"
 
-uint32_t gen32(void) {
-	return ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+/*
+ * Generates input files for the counting tool. Every worker generates and
+ * writes a contiguous range of blocks with pwrite(). Every block has its own
+ * PRNG seeded from the seed and the block number, so the file only depends on
+ * the seed and not on the number of workers. Unless -x is given, the exact
+ * number of unique values and of values seen only once is computed on the fly
+ * in a bitmap with two bits per value.
+ */
+
+#define DEFAULT_COUNT 1000000000ULL
+#define DEFAULT_THREADS 4
+// Numbers per block, 4 MB, a multiple of any O_DIRECT alignment
+#define BLOCK_NUMBERS (1024 * 1024)
+#define DIRECT_ALIGNMENT 4096
+
+// A duplicate repeats one of the last HISTORY_SIZE numbers of the block
+#define HISTORY_SIZE 4096
+
+#define ZIPF_RANKS (1 << 20)
+#define ZIPF_EXPONENT 1.0
+#define CLUSTERS 64
+#define CLUSTER_WIDTH (1 << 16)
+
+// Both bits of every 32-bit value, interleaved
+#define TRUTH_WORDS ((2ULL << 32) / 64)
+
+enum distribution {
+	DISTRIBUTION_UNIFORM,
+	DISTRIBUTION_ZIPF,
+	DISTRIBUTION_CLUSTERED,
+	DISTRIBUTION_UNIQUE,
+	DISTRIBUTION_MAX,
+};
+
+static const char *distribution_names[DISTRIBUTION_MAX] = {
+	[DISTRIBUTION_UNIFORM] = "uniform",
+	[DISTRIBUTION_ZIPF] = "zipf",
+	[DISTRIBUTION_CLUSTERED] = "clustered",
+	[DISTRIBUTION_UNIQUE] = "unique",
+};
+
+struct generator {
+	uint64_t count;
+	uint64_t seed;
+	enum distribution distribution;
+	// Probability of repeating a recent number instead of drawing a new one
+	double duplicates;
+	double *zipf_cdf;
+	uint32_t clusters[CLUSTERS];
+	uint64_t *truth;
+	int fd;
+	int direct;
+};
+
+struct gen_worker {
+	pthread_t thread;
+	struct generator *gen;
+	uint64_t first_block;
+	uint64_t end_block;
+	int failed;
+};
+
+/* splitmix64, derives independent states from the seed */
+static uint64_t splitmix(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+	return x ^ (x >> 31);
+}
+
+/* xorshift64* */
+static inline uint64_t rng_next(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static inline double rng_unit(uint64_t *state) {
+	return (rng_next(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static uint32_t zipf_draw(struct generator *gen, uint64_t *state) {
+	double u = rng_unit(state) * gen->zipf_cdf[ZIPF_RANKS - 1];
+	uint32_t begin = 0, end = ZIPF_RANKS - 1, middle;
+
+	while (begin < end) {
+		middle = (begin + end) / 2;
+		if (gen->zipf_cdf[middle] < u)
+			begin = middle + 1;
+		else
+			end = middle;
+	}
+
+	// Scatters the popular ranks over the whole domain
+	return (begin + 1) * 2654435761U;
+}
+
+static inline uint32_t draw(struct generator *gen, uint64_t *state, uint64_t index) {
+	switch (gen->distribution) {
+	case DISTRIBUTION_ZIPF:
+		return zipf_draw(gen, state);
+	case DISTRIBUTION_CLUSTERED:
+		return gen->clusters[rng_next(state) % CLUSTERS] + rng_next(state) % CLUSTER_WIDTH;
+	case DISTRIBUTION_UNIQUE:
+		// Multiplying by an odd number is a bijection modulo 2^32
+		return (uint32_t)(index + gen->seed) * 2654435761U;
+	default:
+		return rng_next(state) >> 32;
+	}
+}
+
+static inline void truth_record(uint64_t *truth, uint32_t num) {
+	uint64_t *cell = &truth[num >> 5];
+	uint64_t once = 1ULL << ((num & 31) * 2);
+
+	if (__atomic_fetch_or(cell, once, __ATOMIC_RELAXED) & once)
+		__atomic_fetch_or(cell, once << 1, __ATOMIC_RELAXED);
+}
+
+static void generate_block(struct generator *gen, uint64_t block, uint32_t *buffer, uint32_t count) {
+	uint32_t history[HISTORY_SIZE];
+	uint64_t state = splitmix(gen->seed ^ splitmix(block));
+	uint64_t index = block * BLOCK_NUMBERS;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		if (i > 0 && gen->duplicates > 0 && rng_unit(&state) < gen->duplicates)
+			buffer[i] = history[rng_next(&state) % (i < HISTORY_SIZE ? i : HISTORY_SIZE)];
+		else
+			buffer[i] = draw(gen, &state, index + i);
+
+		history[i % HISTORY_SIZE] = buffer[i];
+
+		if (gen->truth)
+			truth_record(gen->truth, buffer[i]);
+	}
+}
+
+static void *generate_part(void *param) {
+	struct gen_worker *worker = param;
+	struct generator *gen = worker->gen;
+	uint64_t block, numbers;
+	uint32_t *buffer;
+	size_t size;
+
+	if (posix_memalign((void **)&buffer, DIRECT_ALIGNMENT, BLOCK_NUMBERS * sizeof(uint32_t))) {
+		worker->failed = 1;
+		return NULL;
+	}
+
+	for (block = worker->first_block; block < worker->end_block; block++) {
+		numbers = gen->count - block * BLOCK_NUMBERS;
+		if (numbers > BLOCK_NUMBERS)
+			numbers = BLOCK_NUMBERS;
+
+		generate_block(gen, block, buffer, numbers);
+
+		// O_DIRECT needs aligned sizes, the file is truncated to the right size at the end
+		size = numbers * sizeof(uint32_t);
+		if (gen->direct)
+			size = (size + DIRECT_ALIGNMENT - 1) & ~(size_t)(DIRECT_ALIGNMENT - 1);
+
+		if (pwrite(gen->fd, buffer, size, block * BLOCK_NUMBERS * sizeof(uint32_t)) !=
+				(ssize_t)size) {
+			worker->failed = 1;
+			break;
+		}
+	}
+
+	free(buffer);
+
+	return NULL;
 }
 
-int main() {
-	char *inputfile_name = "random_numbers";
-	FILE *f = fopen(inputfile_name, "wb");
-	uint32_t i, num;
-	int ret;
-	//uint8_t array[LIMIT] = {};
-	srand((unsigned)time(NULL));
-	uint32_t seen_only_once = 0;
-	uint32_t unique_numbers = 0;
-	uint32_t curr_min = UINT_MAX;
-	uint32_t curr_max = 0;
-
-	if (f == NULL) {
+static enum distribution distribution_from_name(const char *name) {
+	int i;
+
+	for (i = 0; i < DISTRIBUTION_MAX; i++) {
+		if (strcmp(name, distribution_names[i]) == 0)
+			return i;
+	}
+
+	return DISTRIBUTION_MAX;
+}
+
+static int generator_init(struct generator *gen, int ground_truth) {
+	uint64_t state = splitmix(gen->seed);
+	double sum = 0;
+	uint32_t i;
+
+	if (gen->distribution == DISTRIBUTION_ZIPF) {
+		gen->zipf_cdf = malloc(ZIPF_RANKS * sizeof(double));
+		if (!gen->zipf_cdf)
+			return 1;
+
+		for (i = 0; i < ZIPF_RANKS; i++) {
+			sum += 1.0 / pow(i + 1, ZIPF_EXPONENT);
+			gen->zipf_cdf[i] = sum;
+		}
+	}
+
+	for (i = 0; i < CLUSTERS; i++)
+		gen->clusters[i] = (rng_next(&state) >> 32) % (UINT32_MAX - CLUSTER_WIDTH);
+
+	if (ground_truth) {
+		gen->truth = mmap(NULL, TRUTH_WORDS * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (gen->truth == MAP_FAILED) {
+			gen->truth = NULL;
+			free(gen->zipf_cdf);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void generator_deinit(struct generator *gen) {
+	if (gen->truth)
+		munmap(gen->truth, TRUTH_WORDS * sizeof(uint64_t));
+	free(gen->zipf_cdf);
+}
+
+static double elapsed_seconds(struct timespec *start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(const char *name) {
+	printf("Usage: %s [-n count] [-o path] [-t threads] [-s seed] [-d uniform|zipf|clustered|unique] [-r duplicate_ratio] [-D] [-x]\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	const char *inputfile_name = "random_numbers";
+	struct generator gen = {
+		.count = DEFAULT_COUNT,
+		.seed = time(NULL),
+		.distribution = DISTRIBUTION_UNIFORM,
+	};
+	uint32_t threads_count = DEFAULT_THREADS;
+	struct gen_worker *workers;
+	struct timespec start_time;
+	uint64_t blocks, unique = 0, only_once = 0;
+	int ground_truth = 1;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+	int ret = 0, res;
+	double elapsed;
+	uint32_t i, started;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:o:t:s:d:r:Dx")) != -1) {
+		switch (opt) {
+		case 'n':
+			gen.count = strtoull(optarg, NULL, 10);
+			break;
+		case 'o':
+			inputfile_name = optarg;
+			break;
+		case 't':
+			threads_count = atoi(optarg);
+			if (threads_count < 1 || threads_count > 1024) {
+				printf("Threads count must be between 1 and 1024\n");
+				return 1;
+			}
+			break;
+		case 's':
+			gen.seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			gen.distribution = distribution_from_name(optarg);
+			if (gen.distribution == DISTRIBUTION_MAX) {
+				printf("Unknown distribution %s\n", optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+			gen.duplicates = atof(optarg);
+			if (gen.duplicates < 0 || gen.duplicates > 1) {
+				printf("Duplicate ratio must be between 0 and 1\n");
+				return 1;
+			}
+			break;
+		case 'D':
+			gen.direct = 1;
+			flags |= O_DIRECT;
+			break;
+		case 'x':
+			ground_truth = 0;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc != optind) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	gen.fd = open(inputfile_name, flags, 0644);
+	if (gen.fd < 0) {
 		printf("Failed to open file\n");
 		return 1;
 	}
 
+	if (generator_init(&gen, ground_truth) != 0) {
+		printf("Failed to initialize the generator\n");
+		close(gen.fd);
+		return 1;
+	}
 
-	for (i = 0; i < COUNT; i++) {
-		num = gen32(); //% LIMIT;
-		if (num > curr_max)
-			curr_max = num;
-		if (num < curr_min)
-			curr_min = num;
+	workers = calloc(threads_count, sizeof(struct gen_worker));
+	if (!workers) {
+		printf("Failed to allocate the workers\n");
+		ret = 1;
+		goto deinit;
+	}
 
-		/*
-		if (array[num] == 0) {
-			unique_numbers += 1;
-			seen_only_once += 1;
-			array[num] = 1;
-		} else if (array[num] == 1) {
-			seen_only_once -= 1;
-			array[num] = 2;
-		}
-		*/
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	blocks = (gen.count + BLOCK_NUMBERS - 1) / BLOCK_NUMBERS;
+	for (i = 0; i < threads_count; i++) {
+		workers[i].gen = &gen;
+		workers[i].first_block = blocks * i / threads_count;
+		workers[i].end_block = blocks * (i + 1) / threads_count;
 
-		// I know it's slow to write every single number separately, but it's just helper code, so it doesn't matter
-		ret = fwrite(&num, sizeof(num), 1, f);		
-		if (ret != 1) {
-			printf("Failed to generate input file.\n");
-			goto end;
+		res = pthread_create(&workers[i].thread, NULL, generate_part, &workers[i]);
+		if (res != 0) {
+			printf("Failed to initialize thread %u\n", i);
+			ret = 1;
+			break;
 		}
 	}
+	started = i;
+
+	// The blocks of the missing workers are left out, the file is incomplete
+	for (i = 0; i < started; i++) {
+		res = pthread_join(workers[i].thread, NULL);
+		assert(res == 0);
+		if (workers[i].failed)
+			ret = 1;
+	}
+
+	if (ret != 0 || ftruncate(gen.fd, gen.count * sizeof(uint32_t)) != 0) {
+		printf("Failed to generate input file.\n");
+		ret = 1;
+		goto free_workers;
+	}
+
+	elapsed = elapsed_seconds(&start_time);
+	printf("Generated %lu %s numbers (seed %lu) in %.3f s (%.2f GB/s)\n", gen.count,
+			distribution_names[gen.distribution], gen.seed, elapsed,
+			gen.count * sizeof(uint32_t) / elapsed / 1e9);
+
+	if (gen.truth) {
+		popcount_interleaved(gen.truth, TRUTH_WORDS, &unique, &only_once);
+		printf("Unique numbers %lu\n", unique);
+		printf("Seen only once %lu\n", only_once);
+	}
 
-	printf("Unique numbers %u\n", unique_numbers);
-	printf("seen only once %u\n", seen_only_once);
-	printf("Curr min %u curr max %u\n", curr_min, curr_max);
+free_workers:
+	free(workers);
+deinit:
+	generator_deinit(&gen);
+	close(gen.fd);
 
-end:
-	fclose(f);
+	return ret;
 }
@@ -73,7 +73,7 @@ void counting_deinit(struct counting_ctx *ctx) {
 
 	for (i = 0; i < ctx->shards_count; i++) {
 		hashtable_deinit(&ctx->shards[i]);
-		assert(pthread_rwlock_destroy(ctx[i].locks) == 0);
+		assert(pthread_rwlock_destroy(&ctx->locks[i]) == 0);
 	}
 
 	free(ctx->locks);
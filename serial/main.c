@@ -7,6 +7,8 @@
 #include <stdlib.h>
 #include "counting.c"
 #include "parse_json.c"
+#include "../common/uring_reader.c"
+#include "../common/autotune.c"
 
 struct pthread_ctx {
 	uint64_t start_pos;
@@ -22,55 +24,89 @@ struct pthread_ctx {
 #define READ_BATCH_SIZE 16384UL
 #define LOG_INTERVAL (READ_BATCH_SIZE * READ_BATCH_SIZE * 8UL)
 
-#define THREAD_COUNT 2ULL
+#define URING_DEPTH 4
 
-#define SHARD_COUNT 4ul
+// Defaults, overridden with -t and -s
+#define THREAD_COUNT 2
+#define SHARD_COUNT 4
+#define MAX_THREADS 1024
+// Shards per worker picked by -s auto, keeps the rwlock contention low
+#define AUTO_SHARDS_PER_THREAD 4
 #define MAX_HASHES (2ul << 8)
+// Hash tables starting with less than 4 entries fill up before they grow
+#define MAX_SHARDS (MAX_HASHES / 4)
 
 void *sharded_counting(void *param) {
 	struct pthread_ctx *ctx = param;
 	uint64_t file_position = 0;
-	int read_bytes;
-	int read_size;
+	uint64_t read_offset;
+	int64_t read_bytes;
+	uint64_t available;
+	uint64_t carried = 0;
+	uint64_t processed;
+	uint64_t consumed;
 	int ret = 0;
-	char arr[READ_BATCH_SIZE] = {};
+	// The unfinished entry carried over from the previous batch and the next batch
+	static __thread char arr[2 * READ_BATCH_SIZE + 1];
+	char *buffer;
 	char* last_entry_end;
 	char* next_entry_begin;
 	uint64_t log_threshold = ctx->start_pos + LOG_INTERVAL;
+	struct uring_reader reader;
 
 	printf("Worker %d: STARTED\n", ctx->shard_id);
 	file_position = ctx->start_pos;
 
-	while (atomic_load(ctx->error) == 0) {
-		read_size = MIN(sizeof(arr), ctx->end_pos - file_position);
+	if (uring_reader_init(&reader, ctx->file_descryptor, ctx->start_pos, ctx->end_pos,
+				READ_BATCH_SIZE, URING_DEPTH) != 0) {
+		printf("Worker %d: failed to initialize the reader\n", ctx->shard_id);
+		atomic_store(ctx->error, 1);
+		return NULL;
+	}
 
-		if (read_size < sizeof(arr))
-			memset(arr, 0, sizeof(arr));
+	if (!reader.use_uring)
+		printf("Worker %d: io_uring unavailable, reading with pread\n", ctx->shard_id);
 
-		assert(file_position >= ctx->start_pos);
-		assert(file_position + read_size <= ctx->end_pos);
+	while (atomic_load(ctx->error) == 0) {
+		read_bytes = uring_reader_next(&reader, &buffer, &read_offset);
+		if (read_bytes < 0) {
+			printf("Worker %d: failed to read the input\n", ctx->shard_id);
+			ret = 1;
+			break;
+		}
 
-		read_bytes = pread(ctx->file_descryptor, arr, read_size, file_position);
-		if (read_bytes < 1)
+		if (read_bytes == 0 && carried == 0)
 			break;
 
-		next_entry_begin = memrchr(arr, '{', read_bytes);
+		assert(carried + read_bytes <= 2 * READ_BATCH_SIZE);
+
+		memcpy(arr + carried, buffer, read_bytes);
+		available = carried + read_bytes;
+		arr[available] = 0;
 
-		last_entry_end = memrchr(arr, '}', read_bytes);
+		next_entry_begin = memrchr(arr, '{', available);
+
+		processed = available;
+		last_entry_end = memrchr(arr, '}', available);
 		if (last_entry_end)
-			read_bytes = last_entry_end - arr;
+			processed = last_entry_end - arr;
 
-		if (read_bytes < 1)
+		if (processed < 1)
 			break;
 
-		ret = counting_models(ctx->hash_table, arr, read_bytes);
+		ret = counting_models(ctx->hash_table, arr, processed);
 		if (ret)
 			break;
 
+		consumed = processed;
 		if (next_entry_begin && last_entry_end && next_entry_begin > last_entry_end)
-			read_bytes = next_entry_begin - arr;
+			consumed = next_entry_begin - arr;
+
+		carried = available - consumed;
+		memmove(arr, arr + consumed, carried);
 
-		file_position += read_bytes;
+		if (read_bytes > 0)
+			file_position = read_offset + read_bytes - carried;
 
 		if (file_position > log_threshold) {
 			printf("Worker %d: processed %.2f%%\n", ctx->shard_id,
@@ -79,6 +115,10 @@ void *sharded_counting(void *param) {
 		}
 
 	}
+
+	printf("Worker %d: waited %.3f s for I/O\n", ctx->shard_id, uring_reader_wait_time(&reader));
+	uring_reader_deinit(&reader);
+
 	if (ret) {
 		printf("Worker %d error. Terminating\n", ctx->shard_id);
 		atomic_store(ctx->error, 1);
@@ -91,46 +131,85 @@ void *sharded_counting(void *param) {
 	return NULL;
 }
 
+static void usage(const char *name) {
+	printf("Usage: %s [-t threads|auto] [-s shards|auto] <path>\n", name);
+}
+
 int main(int argc, char *argv[]) {	
 	uint32_t i, j;
 	int res;
-	uint32_t file_size;
-	uint64_t file_chunk_size;
+	int opt;
+	uint32_t threads_count = THREAD_COUNT;
+	uint32_t shards_count = SHARD_COUNT;
 	struct counting_ctx ctx = {};
-	pthread_t threads[THREAD_COUNT] = {};
-	struct pthread_ctx *thread_params[THREAD_COUNT] = {};
-	uint64_t file_shards_beginings[THREAD_COUNT];
-	uint64_t file_shards_endings[THREAD_COUNT];
+	pthread_t *threads;
+	struct pthread_ctx **thread_params;
+	uint64_t *file_shards_beginings;
+	uint64_t *file_shards_endings;
 	atomic_ulong threads_error;
 
-	if (argc != 2) {
-		printf("Usage: %s <path>\n", argv[0]);
+	while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+		switch (opt) {
+		case 't':
+			if (autotune_parse(optarg, &threads_count, MAX_THREADS) != 0) {
+				printf("Threads count must be auto or between 1 and %d\n", MAX_THREADS);
+				return 1;
+			}
+			break;
+		case 's':
+			if (autotune_parse(optarg, &shards_count, MAX_SHARDS) != 0) {
+				printf("Shards count must be auto or between 1 and %lu\n", MAX_SHARDS);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 1) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	int fd = open(argv[1], O_RDONLY);
+	if (threads_count == 0)
+		threads_count = MIN(autotune_threads(), MAX_THREADS);
+	// The hash tables are small, only the contention matters
+	if (shards_count == 0)
+		shards_count = autotune_shards(0, threads_count, AUTO_SHARDS_PER_THREAD, MAX_SHARDS);
+
+	int fd = open(argv[optind], O_RDONLY);
 	if (fd == 0) {
 		printf("Failed to open file\n");
 		return 1;
 	}
 
- 	file_size = lseek(fd, 0L, SEEK_END);
-	file_chunk_size = file_size / THREAD_COUNT;
+	threads = calloc(threads_count, sizeof(pthread_t));
+	thread_params = calloc(threads_count, sizeof(struct pthread_ctx *));
+	file_shards_beginings = calloc(threads_count, sizeof(uint64_t));
+	file_shards_endings = calloc(threads_count, sizeof(uint64_t));
+	if (!threads || !thread_params || !file_shards_beginings || !file_shards_endings) {
+		printf("Failed to allocate the context\n");
+		res = 1;
+		goto free_ctx;
+	}
 
-	res = counting_init(&ctx, SHARD_COUNT, MAX_HASHES);
+	res = counting_init(&ctx, shards_count, MAX_HASHES);
 	if (res != 0) {
 		printf("Failed to initialize context\n");
-		close(fd);
-		return 1;
+		goto free_ctx;
 	}
 
-	assert(ctx.shards[SHARD_COUNT - 1].range_end == MAX_HASHES);
+	assert(ctx.shards[shards_count - 1].range_end == MAX_HASHES);
+
+	printf("Threads: %u, shards: %u\n", threads_count, shards_count);
 
 	atomic_init(&threads_error, 0);
 
-	json_shard_the_file(fd, file_shards_beginings, file_shards_endings, THREAD_COUNT);
+	json_shard_the_file(fd, file_shards_beginings, file_shards_endings, threads_count);
 
-	for (i = 0; i < THREAD_COUNT; i++) {
+	for (i = 0; i < threads_count; i++) {
 		thread_params[i] = malloc(sizeof(struct pthread_ctx));
 		if (thread_params[i] == NULL)
 			goto end;
@@ -151,7 +230,7 @@ int main(int argc, char *argv[]) {
 
 end:
 
-	for (i = 0; i < THREAD_COUNT; i++) {
+	for (i = 0; i < threads_count; i++) {
 		if (threads[i] != 0) {
 			res = pthread_join(threads[i], NULL);
 			assert(res == 0);
@@ -162,7 +241,7 @@ end:
 
 	if (atomic_load(&threads_error) == 0) {
 		printf("Occurances\tModel\n");
-		for (i = 0; i < SHARD_COUNT; i++) {
+		for (i = 0; i < shards_count; i++) {
 			struct hash_table_shard *shard = &ctx.shards[i];
 			for (j = 0; j < shard->curr_max_entries; j++) {
 				struct hash_table_entry* entry = &shard->entries[j];
@@ -176,9 +255,18 @@ end:
 		}
 	} else {
 		printf("Failed to parse the input file\n");
+		res = 1;
 	}
 
 	counting_deinit(&ctx);
 
+free_ctx:
+	free(file_shards_endings);
+	free(file_shards_beginings);
+	free(thread_params);
+	free(threads);
+
 	close(fd);
+
+	return res;
 }
@@ -1,6 +1,16 @@
 #include "counting.c"
+#include "scatter.c"
+#include "partition.c"
+#include "checkpoint.c"
+#include "libcounting.c"
+#include "stream.c"
+#include "export.c"
+#include "text.c"
+#include "block.c"
+#include "approx.c"
 #include "unity.h"
 #include <string.h>
+#include <sys/resource.h>
 
 static struct tree_owner *find_expected_shard(struct tree_owner ctx[], uint32_t number)
 {
@@ -153,7 +163,8 @@ void test_countint_1(void)
 	struct tree_owner ctx[SHARDS] = {};
 	prepare_shards(ctx, SHARDS, SHARD_SIZE);
 
-	uint32_t arr[1000];
+	// arr[995] isn't set below, it must not be left uninitialized
+	uint32_t arr[1000] = {0};
 
 	for (i = 0; i < 990; i++) {
 		arr[i] = i % 900;
@@ -270,6 +281,879 @@ void test_tree_api_handles_high_range_duplicates(void)
 	destroy_shards(ctx, SHARDS);
 }
 
+void test_counting_atomic_engine(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	uint32_t arr[1000];
+	uint32_t i;
+
+	prepare_shards(ctx, SHARDS, SHARD_SIZE);
+
+	for (i = 0; i < 1000; i++)
+		arr[i] = (i % 900) * (COUNTING_MAX_INPUT / 900);
+
+	TEST_ASSERT_EQUAL(count_numbers_atomic(arr, 1000, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT64(900, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(800, total_seen_once_numbers(ctx));
+
+	TEST_ASSERT_EQUAL(count_numbers_atomic(arr, 100, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT64(900, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(800, total_seen_once_numbers(ctx));
+
+	arr[0] = COUNTING_MAX_INPUT;
+	TEST_ASSERT_EQUAL(count_numbers_atomic(arr, 1, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT64(901, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(801, total_seen_once_numbers(ctx));
+
+	destroy_shards(ctx, SHARDS);
+}
+
+void test_counting_engine_lookup(void)
+{
+	TEST_ASSERT_EQUAL_PTR(count_numbers,
+		counting_engine_get(counting_engine_from_name("locked")));
+	TEST_ASSERT_EQUAL_PTR(count_numbers_atomic,
+		counting_engine_get(counting_engine_from_name("atomic")));
+	TEST_ASSERT_EQUAL(COUNTING_ENGINE_MAX, counting_engine_from_name("none"));
+}
+
+void test_counting_interleaved_layout(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	uint32_t arr[8] = {1, 2, 2, 3, 3, 4, 0xffffffff, 0xfffffffe};
+	uint32_t i;
+
+	prepare_shards_layout(ctx, SHARDS, SHARD_SIZE, COUNTING_LAYOUT_INTERLEAVED);
+
+	for (i = 0; i < SHARDS; i++)
+		TEST_ASSERT_EQUAL_PTR(ctx[i].added_once, ctx[i].added_twice);
+
+	TEST_ASSERT_EQUAL(count_numbers(arr, 8, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT64(6, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(4, total_seen_once_numbers(ctx));
+
+	TEST_ASSERT_EQUAL(count_numbers_atomic(arr, 8, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT64(6, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(0, total_seen_once_numbers(ctx));
+
+	// Both bits of 1 and 2 are in the same word, next to each other
+	TEST_ASSERT_EQUAL_UINT64(0x3cul, ctx[0].added_once[0] & 0x3cul);
+
+	destroy_shards(ctx, SHARDS);
+
+	prepare_shards_layout(ctx, SHARDS, SHARD_SIZE, COUNTING_LAYOUT_INTERLEAVED);
+
+	TEST_ASSERT_EQUAL(count_numbers_owned(arr, 8, ctx), 0);
+	TEST_ASSERT_EQUAL(count_numbers_atomic(arr, 1, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT64(6, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(3, total_seen_once_numbers(ctx));
+
+	destroy_shards(ctx, SHARDS);
+}
+
+void test_counting_adaptive_layout(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	static uint32_t arr[12000];
+	uint64_t split_memory;
+	uint32_t i;
+
+	// 6000 values in the first container, which turns it into a bitmap
+	for (i = 0; i < 6000; i++)
+		arr[i] = i * 3;
+	for (i = 6000; i < 8000; i++)
+		arr[i] = (i - 6000) * 3;
+	// Spread over the whole range, the containers stay sorted arrays
+	for (i = 8000; i < 12000; i++)
+		arr[i] = 0xffffffff - (i - 8000) * 1000003u;
+
+	prepare_shards(ctx, SHARDS, SHARD_SIZE);
+	split_memory = counting_memory(ctx, SHARDS);
+	destroy_shards(ctx, SHARDS);
+
+	prepare_shards_layout(ctx, SHARDS, SHARD_SIZE, COUNTING_LAYOUT_ADAPTIVE);
+	TEST_ASSERT_NULL(ctx[0].added_once);
+
+	TEST_ASSERT_EQUAL(count_numbers(arr, 12000, ctx), 0);
+
+	TEST_ASSERT_NOT_NULL(ctx[0].containers[0].cells);
+	TEST_ASSERT_NULL(ctx[SHARDS - 1].containers[ctx[SHARDS - 1].containers_count - 1].cells);
+	TEST_ASSERT_EQUAL_UINT64(10000, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(8000, total_seen_once_numbers(ctx));
+	TEST_ASSERT_TRUE(counting_memory(ctx, SHARDS) < split_memory / 100);
+
+	TEST_ASSERT_EQUAL(count_numbers_atomic(arr, 12000, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT64(10000, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(0, total_seen_once_numbers(ctx));
+
+	destroy_shards(ctx, SHARDS);
+
+	prepare_shards_layout(ctx, SHARDS, SHARD_SIZE, COUNTING_LAYOUT_ADAPTIVE);
+
+	TEST_ASSERT_EQUAL(count_numbers_owned(arr, 8000, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT64(6000, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(4000, total_seen_once_numbers(ctx));
+
+	destroy_shards(ctx, SHARDS);
+}
+
+void test_counting_mapped_allocation(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	uint32_t arr[8] = {1, 2, 2, 3, 3, 4, 0xffffffff, 0xfffffffe};
+	int layout;
+	uint32_t i;
+
+	for (layout = COUNTING_LAYOUT_SPLIT; layout <= COUNTING_LAYOUT_INTERLEAVED; layout++) {
+		prepare_shards_alloc(ctx, SHARDS, SHARD_SIZE, layout, COUNTING_ALLOC_HUGETLB);
+
+		for (i = 0; i < SHARDS; i++) {
+			// Without reserved huge pages the region comes from transparent ones
+			TEST_ASSERT_NOT_EQUAL(COUNTING_ALLOC_CALLOC, ctx[i].alloc);
+			TEST_ASSERT_EQUAL_UINT64(0, (uintptr_t)ctx[i].added_once % COUNTING_HUGE_PAGE_SIZE);
+			if (i > 0) {
+				TEST_ASSERT_EQUAL_PTR((char *)ctx[i - 1].added_once + ctx[i - 1].mapping_size,
+						ctx[i].added_once);
+			}
+		}
+
+		TEST_ASSERT_EQUAL(0, counting_first_touch(ctx, SHARDS, 3));
+		TEST_ASSERT_EQUAL(count_numbers_atomic(arr, 8, ctx), 0);
+
+		TEST_ASSERT_EQUAL_UINT64(6, total_unique_numbers(ctx));
+		TEST_ASSERT_EQUAL_UINT64(4, total_seen_once_numbers(ctx));
+
+		destroy_shards(ctx, SHARDS);
+	}
+}
+
+void test_popcount_kernels_agree(void)
+{
+	static uint64_t once[1027];
+	static uint64_t twice[1027];
+	uint64_t present, only_once;
+	uint64_t expected_present = 0, expected_only_once = 0;
+	uint64_t expected_present_interleaved = 0, expected_only_once_interleaved = 0;
+	uint64_t x = 0x9e3779b97f4a7c15ull;
+	int isa;
+	uint32_t i;
+
+	for (i = 0; i < 1027; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		once[i] = x;
+		twice[i] = x & (x >> 3);
+	}
+
+	popcount_split_scalar(once, twice, 1027, &expected_present, &expected_only_once);
+	popcount_interleaved_scalar(once, 1027, &expected_present_interleaved,
+			&expected_only_once_interleaved);
+
+	for (isa = 0; isa < POPCOUNT_ISA_MAX; isa++) {
+		if (popcount_select(isa) != 0)
+			continue;
+
+		present = 0;
+		only_once = 0;
+		popcount_split(once, twice, 1027, &present, &only_once);
+		TEST_ASSERT_EQUAL_UINT64(expected_present, present);
+		TEST_ASSERT_EQUAL_UINT64(expected_only_once, only_once);
+
+		present = 0;
+		only_once = 0;
+		popcount_interleaved(once, 1027, &present, &only_once);
+		TEST_ASSERT_EQUAL_UINT64(expected_present_interleaved, present);
+		TEST_ASSERT_EQUAL_UINT64(expected_only_once_interleaved, only_once);
+	}
+
+	popcount_selected_isa = POPCOUNT_ISA_MAX;
+}
+
+void test_counting_finalize_threads(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	uint32_t arr[4096];
+	uint32_t i;
+
+	prepare_shards_layout(ctx, SHARDS, SHARD_SIZE, COUNTING_LAYOUT_INTERLEAVED);
+
+	for (i = 0; i < 4096; i++)
+		arr[i] = (i % 3000) * 1398101u;
+
+	count_numbers_atomic(arr, 4096, ctx);
+
+	TEST_ASSERT_EQUAL(0, counting_finalize(ctx, SHARDS, 7));
+	for (i = 0; i < SHARDS; i++)
+		TEST_ASSERT_FALSE(ctx[i].stale);
+
+	TEST_ASSERT_EQUAL_UINT64(3000, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(3000 - 1096, total_seen_once_numbers(ctx));
+
+	destroy_shards(ctx, SHARDS);
+}
+
+void test_index_kernels_agree(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	// Not a multiple of any vector width, so the scalar tails run as well
+	uint32_t values[1027];
+	uint32_t shard_ids[1027];
+	uint32_t offsets[1027];
+	struct tree_owner *expected;
+	int isa;
+	uint32_t i;
+
+	prepare_shards(ctx, SHARDS, SHARD_SIZE);
+
+	for (i = 0; i < 1027; i++)
+		values[i] = i * 4182119u;
+	values[0] = COUNTING_MAX_INPUT;
+	values[1] = COUNTING_MAX_INPUT - 1;
+	values[2] = ctx[SHARDS - 1].shard_range_min;
+	values[3] = ctx[SHARDS - 1].shard_range_min - 1;
+	values[4] = SHARD_SIZE;
+	values[5] = SHARD_SIZE - 1;
+
+	for (isa = 0; isa < INDEX_ISA_MAX; isa++) {
+		if (index_select(isa) != 0)
+			continue;
+
+		memset(shard_ids, 0xff, sizeof(shard_ids));
+		index_batch(values, 1027, &ctx[0].index, shard_ids, offsets);
+
+		for (i = 0; i < 1027; i++) {
+			expected = get_shard(ctx, values[i]);
+			TEST_ASSERT_EQUAL_UINT32(expected - ctx, shard_ids[i]);
+			TEST_ASSERT_EQUAL_UINT32(values[i] - expected->shard_range_min, offsets[i]);
+		}
+	}
+
+	index_selected_isa = INDEX_ISA_MAX;
+
+	destroy_shards(ctx, SHARDS);
+}
+
+struct scatter_test_worker {
+	pthread_t thread;
+	struct scatter_worker worker;
+	uint32_t *arr;
+	int count;
+};
+
+static void *scatter_test_thread(void *param)
+{
+	struct scatter_test_worker *test_worker = param;
+
+	scatter_numbers(&test_worker->worker, test_worker->arr, test_worker->count);
+	scatter_worker_finish(&test_worker->worker);
+
+	return NULL;
+}
+
+void test_counting_owned_shards(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	struct scatter_ctx scatter = {};
+	struct scatter_test_worker workers[4] = {};
+	static uint32_t arr[4 * 2 * SCATTER_BUFFER_SIZE];
+	uint32_t i;
+
+	prepare_shards(ctx, SHARDS, SHARD_SIZE);
+	TEST_ASSERT_EQUAL(0, scatter_init(&scatter, ctx, SHARDS, 4));
+
+	/*
+	 * The first worker sees multiples of the step, the next two see every
+	 * third of them again and the same set of high numbers. The last one
+	 * sees the low numbers, where only 0 overlaps with the multiples.
+	 */
+	for (i = 0; i < 2 * SCATTER_BUFFER_SIZE; i++) {
+		arr[i] = i * (COUNTING_MAX_INPUT / (2 * SCATTER_BUFFER_SIZE));
+		arr[i + 2 * SCATTER_BUFFER_SIZE] = i % 3 ? 0xfffffffful - i : arr[i];
+		arr[i + 4 * SCATTER_BUFFER_SIZE] = arr[i + 2 * SCATTER_BUFFER_SIZE];
+		arr[i + 6 * SCATTER_BUFFER_SIZE] = i;
+	}
+
+	for (i = 0; i < 4; i++) {
+		workers[i].arr = &arr[i * 2 * SCATTER_BUFFER_SIZE];
+		workers[i].count = 2 * SCATTER_BUFFER_SIZE;
+		TEST_ASSERT_EQUAL(0, scatter_worker_init(&workers[i].worker, &scatter, i));
+		TEST_ASSERT_EQUAL(0, pthread_create(&workers[i].thread, NULL,
+					scatter_test_thread, &workers[i]));
+	}
+
+	for (i = 0; i < 4; i++)
+		TEST_ASSERT_EQUAL(0, pthread_join(workers[i].thread, NULL));
+
+	scatter_deinit(&scatter);
+
+	TEST_ASSERT_EQUAL_UINT64(2 * SCATTER_BUFFER_SIZE + 5461 + 8191,
+			total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(5461 + 8191, total_seen_once_numbers(ctx));
+
+	destroy_shards(ctx, SHARDS);
+}
+
+void test_counting_partitioned(void)
+{
+	struct partition_ctx partitions;
+	struct partition_worker workers[2];
+	static uint32_t arr[4 * 2 * SCATTER_BUFFER_SIZE];
+	uint32_t i;
+
+	// The same input as with the owned shards, spilled through two workers
+	for (i = 0; i < 2 * SCATTER_BUFFER_SIZE; i++) {
+		arr[i] = i * (COUNTING_MAX_INPUT / (2 * SCATTER_BUFFER_SIZE));
+		arr[i + 2 * SCATTER_BUFFER_SIZE] = i % 3 ? 0xfffffffful - i : arr[i];
+		arr[i + 4 * SCATTER_BUFFER_SIZE] = arr[i + 2 * SCATTER_BUFFER_SIZE];
+		arr[i + 6 * SCATTER_BUFFER_SIZE] = i;
+	}
+
+	TEST_ASSERT_EQUAL(0, partition_init(&partitions, "/tmp", 16 * 1024 * 1024, 2, 64));
+	for (i = 0; i < 2; i++) {
+		TEST_ASSERT_EQUAL(0, partition_worker_init(&workers[i], &partitions));
+		partition_numbers(&workers[i], &arr[i * 4 * SCATTER_BUFFER_SIZE],
+				4 * SCATTER_BUFFER_SIZE);
+		partition_worker_finish(&workers[i]);
+	}
+
+	TEST_ASSERT_EQUAL_UINT64(sizeof(arr), partition_spilled(&partitions));
+	TEST_ASSERT_EQUAL(0, partition_count(&partitions));
+	TEST_ASSERT_EQUAL_UINT64(2 * SCATTER_BUFFER_SIZE + 5461 + 8191, partitions.unique);
+	TEST_ASSERT_EQUAL_UINT64(5461 + 8191, partitions.only_once);
+
+	for (i = 0; i < 2; i++)
+		partition_worker_deinit(&workers[i]);
+	partition_deinit(&partitions);
+}
+
+void test_counting_approx(void)
+{
+	static uint32_t arr[1 << 20];
+	static uint8_t counts[1 << 22];
+	struct approx_sketch whole, first, second;
+	uint64_t unique, only_once, exact_unique = 0, exact_only_once = 0, merged_unique, merged_only_once;
+	double unique_error, only_once_error;
+	uint64_t state = 0x9e3779b97f4a7c15ULL;
+	uint32_t i;
+
+	memset(counts, 0, sizeof(counts));
+
+	// Skewed, the narrow ranges repeat most of their values and the wide ones few
+	for (i = 0; i < sizeof(arr) / sizeof(arr[0]); i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		arr[i] = (state >> 32) % (1U << (8 + state % 15));
+		if (counts[arr[i]] < 2)
+			counts[arr[i]]++;
+	}
+
+	for (i = 0; i < sizeof(counts); i++) {
+		exact_unique += counts[i] > 0;
+		exact_only_once += counts[i] == 1;
+	}
+
+	TEST_ASSERT_EQUAL(0, approx_init(&whole, 0.01));
+	TEST_ASSERT_EQUAL(0, approx_init(&first, 0.01));
+	TEST_ASSERT_EQUAL(0, approx_init(&second, 0.01));
+
+	TEST_ASSERT_EQUAL(0, approx_add(&whole, arr, sizeof(arr) / sizeof(arr[0])));
+	approx_estimate(&whole, &unique, &unique_error, &only_once, &only_once_error);
+
+	// The values seen once outnumber the sample, the estimate isn't exact
+	TEST_ASSERT_GREATER_THAN(0, whole.level);
+	TEST_ASSERT_TRUE(unique_error <= 0.01);
+	TEST_ASSERT_TRUE(only_once_error <= 0.01);
+	TEST_ASSERT_TRUE(fabs((double)unique - exact_unique) <= 3 * unique_error * exact_unique);
+	TEST_ASSERT_TRUE(fabs((double)only_once - exact_only_once) <=
+			3 * only_once_error * exact_only_once);
+
+	// Merging the sketches of both halves gives the sketch of the whole input
+	TEST_ASSERT_EQUAL(0, approx_add(&first, arr, sizeof(arr) / sizeof(arr[0]) / 2));
+	TEST_ASSERT_EQUAL(0, approx_add(&second, &arr[sizeof(arr) / sizeof(arr[0]) / 2],
+				sizeof(arr) / sizeof(arr[0]) / 2));
+	TEST_ASSERT_EQUAL(0, approx_merge(&first, &second));
+
+	TEST_ASSERT_EQUAL_MEMORY(whole.registers, first.registers, 1ULL << whole.precision);
+	if (first.level < whole.level)
+		TEST_ASSERT_EQUAL(0, approx_sample_rebuild(&first, whole.level, first.sample_slots));
+	if (whole.level < first.level)
+		TEST_ASSERT_EQUAL(0, approx_sample_rebuild(&whole, first.level, whole.sample_slots));
+
+	approx_estimate(&whole, &unique, &unique_error, &only_once, &only_once_error);
+	approx_estimate(&first, &merged_unique, &unique_error, &merged_only_once, &only_once_error);
+	TEST_ASSERT_EQUAL_UINT64(unique, merged_unique);
+	TEST_ASSERT_EQUAL_UINT64(only_once, merged_only_once);
+	TEST_ASSERT_EQUAL_UINT64(whole.sample_size, first.sample_size);
+
+	approx_deinit(&whole);
+	approx_deinit(&first);
+	approx_deinit(&second);
+
+	// The lowest error accepted is delivered by the registers
+	TEST_ASSERT_EQUAL(0, approx_init(&whole, APPROX_MIN_ERROR));
+	approx_estimate(&whole, &unique, &unique_error, &only_once, &only_once_error);
+	TEST_ASSERT_TRUE(unique_error <= APPROX_MIN_ERROR);
+	approx_deinit(&whole);
+}
+
+void test_counting_checkpoint(void)
+{
+	const char *path = "/tmp/counting_test.checkpoint";
+	struct tree_owner ctx[SHARDS] = {};
+	struct tree_owner resumed[SHARDS] = {};
+	struct checkpoint_header header;
+	static uint32_t arr[2 * 16384];
+	uint32_t i;
+
+	for (i = 0; i < 16384; i++) {
+		arr[i] = i * 262139;
+		arr[i + 16384] = i % 2 ? arr[i] : 0xfffffffful - i;
+	}
+
+	prepare_shards(ctx, SHARDS, SHARD_SIZE);
+	TEST_ASSERT_EQUAL(0, count_numbers(arr, 16384, ctx));
+	TEST_ASSERT_EQUAL(0, checkpoint_save(path, ctx, SHARDS, sizeof(arr), 16384 * sizeof(uint32_t)));
+
+	TEST_ASSERT_EQUAL(0, checkpoint_read_header(path, &header));
+	TEST_ASSERT_EQUAL_UINT64(16384 * sizeof(uint32_t), header.consumed);
+	TEST_ASSERT_EQUAL(0, checkpoint_load(path, &header, resumed));
+	unlink(path);
+
+	// The rest of the input counted into the resumed shards gives the same results
+	TEST_ASSERT_EQUAL(0, count_numbers(&arr[16384], 16384, ctx));
+	TEST_ASSERT_EQUAL(0, count_numbers(&arr[16384], 16384, resumed));
+	TEST_ASSERT_EQUAL_UINT64(16384 + 8192, aggregate_unique_numbers(resumed, SHARDS));
+	TEST_ASSERT_EQUAL_UINT64(aggregate_unique_numbers(ctx, SHARDS),
+			aggregate_unique_numbers(resumed, SHARDS));
+	TEST_ASSERT_EQUAL_UINT64(aggregate_seen_only_once(ctx, SHARDS),
+			aggregate_seen_only_once(resumed, SHARDS));
+
+	destroy_shards(ctx, SHARDS);
+	destroy_shards(resumed, SHARDS);
+}
+
+void test_counting_sets(void)
+{
+	struct tree_owner first[SHARDS] = {};
+	struct tree_owner second[SHARDS] = {};
+	struct tree_owner *inputs[3] = {first, second, first};
+	struct counting_sets sets;
+	static uint32_t arr[20000];
+	uint32_t i;
+
+	prepare_shards_layout(first, SHARDS, SHARD_SIZE, COUNTING_LAYOUT_INTERLEAVED);
+	prepare_shards_layout(second, SHARDS, SHARD_SIZE, COUNTING_LAYOUT_INTERLEAVED);
+
+	// 10000 values spread over the range, the second input shares half of them, twice
+	for (i = 0; i < 10000; i++)
+		arr[i] = i * 429497;
+	TEST_ASSERT_EQUAL(0, count_numbers(arr, 10000, first));
+
+	for (i = 0; i < 20000; i++)
+		arr[i] = (5000 + i % 10000) * 429497 + (i % 10000 >= 5000);
+	TEST_ASSERT_EQUAL(0, count_numbers(arr, 20000, second));
+
+	TEST_ASSERT_EQUAL(0, counting_sets(inputs, 2, SHARDS, 3, &sets));
+	TEST_ASSERT_EQUAL_UINT64(15000, sets.union_count);
+	TEST_ASSERT_EQUAL_UINT64(5000, sets.intersection);
+	TEST_ASSERT_EQUAL_UINT64(5000, sets.difference);
+	TEST_ASSERT_EQUAL_UINT64(10000, sets.symmetric_difference);
+
+	// The same input twice is in no difference
+	TEST_ASSERT_EQUAL(0, counting_sets(inputs, 3, SHARDS, 2, &sets));
+	TEST_ASSERT_EQUAL_UINT64(15000, sets.union_count);
+	TEST_ASSERT_EQUAL_UINT64(5000, sets.intersection);
+	TEST_ASSERT_EQUAL_UINT64(0, sets.difference);
+	TEST_ASSERT_EQUAL_UINT64(5000, sets.symmetric_difference);
+
+	destroy_shards(first, SHARDS);
+	destroy_shards(second, SHARDS);
+}
+
+struct library_test_worker {
+	pthread_t thread;
+	struct libcounting *ctx;
+	uint32_t arr[4096];
+};
+
+static void *library_test_thread(void *param)
+{
+	struct library_test_worker *worker = param;
+
+	libcounting_add_batch(worker->ctx, worker->arr, 4096);
+	libcounting_add_batch(worker->ctx, worker->arr, 2048);
+
+	return NULL;
+}
+
+void test_counting_library(void)
+{
+	struct libcounting_params params = {.layout = "interleaved", .shards = 8, .threads = 2};
+	struct libcounting_params invalid = {.engine = "owned"};
+	struct libcounting_params adaptive = {.layout = "adaptive"};
+	static struct library_test_worker workers[4];
+	struct libcounting_snapshot snapshot;
+	struct rlimit limit, low_limit;
+	struct libcounting *ctx;
+	unsigned long pages;
+	uint32_t i, j;
+	FILE *statm;
+
+	TEST_ASSERT_NULL(libcounting_create(&invalid));
+	TEST_ASSERT_NULL(libcounting_create(&adaptive));
+
+	ctx = libcounting_create(&params);
+	TEST_ASSERT_NOT_NULL(ctx);
+
+	// Every worker adds its own values, the first half of them twice
+	for (i = 0; i < 4; i++) {
+		workers[i].ctx = ctx;
+		for (j = 0; j < 4096; j++)
+			workers[i].arr[j] = j * 1048573 + i;
+		TEST_ASSERT_EQUAL(0, pthread_create(&workers[i].thread, NULL, library_test_thread,
+					&workers[i]));
+	}
+
+	for (i = 0; i < 4; i++)
+		TEST_ASSERT_EQUAL(0, pthread_join(workers[i].thread, NULL));
+
+	TEST_ASSERT_EQUAL(0, libcounting_snapshot(ctx, &snapshot));
+	TEST_ASSERT_EQUAL_UINT64(4 * 6144, snapshot.numbers);
+	TEST_ASSERT_EQUAL_UINT64(4 * 4096, snapshot.unique);
+	TEST_ASSERT_EQUAL_UINT64(4 * 2048, snapshot.seen_only_once);
+
+	// Without the memory for new bitmaps, the numbers are kept
+	TEST_ASSERT_EQUAL(0, getrlimit(RLIMIT_AS, &limit));
+	TEST_ASSERT_EQUAL(1, fscanf(statm = fopen("/proc/self/statm", "r"), "%lu", &pages));
+	fclose(statm);
+	low_limit = limit;
+	low_limit.rlim_cur = pages * sysconf(_SC_PAGESIZE) + 64 * 1024 * 1024;
+	TEST_ASSERT_EQUAL(0, setrlimit(RLIMIT_AS, &low_limit));
+	TEST_ASSERT_NULL(libcounting_create(NULL));
+	TEST_ASSERT_EQUAL(1, libcounting_reset(ctx));
+	TEST_ASSERT_EQUAL(0, setrlimit(RLIMIT_AS, &limit));
+	TEST_ASSERT_EQUAL(0, libcounting_snapshot(ctx, &snapshot));
+	TEST_ASSERT_EQUAL_UINT64(4 * 6144, snapshot.numbers);
+
+	TEST_ASSERT_EQUAL(0, libcounting_reset(ctx));
+	libcounting_add_batch(ctx, workers[0].arr, 10);
+	TEST_ASSERT_EQUAL(0, libcounting_snapshot(ctx, &snapshot));
+	TEST_ASSERT_EQUAL_UINT64(10, snapshot.numbers);
+	TEST_ASSERT_EQUAL_UINT64(10, snapshot.unique);
+
+	libcounting_free(ctx);
+}
+
+struct stream_test_writer {
+	pthread_t thread;
+	int fd;
+	uint32_t arr[60000];
+};
+
+/* Writes in pieces splitting the numbers, as a pipe may deliver them */
+static void *stream_test_thread(void *param)
+{
+	struct stream_test_writer *writer = param;
+	const char *data = (const char *)writer->arr;
+	size_t written = 0, size;
+
+	while (written < sizeof(writer->arr)) {
+		size = sizeof(writer->arr) - written < 4099 ? sizeof(writer->arr) - written : 4099;
+		TEST_ASSERT_EQUAL((ssize_t)size, write(writer->fd, data + written, size));
+		written += size;
+	}
+	close(writer->fd);
+
+	return NULL;
+}
+
+void test_counting_stream(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	static struct stream_test_writer writer;
+	struct stream_snapshot snapshot;
+	struct stream_ctx stream;
+	pthread_t workers[3];
+	int fds[2];
+	uint32_t i;
+
+	// 10000 values seen once and 25000 seen twice
+	for (i = 0; i < 60000; i++)
+		writer.arr[i] = (i < 10000 ? i : 10000 + (i - 10000) % 25000) * 65521u;
+
+	prepare_shards(ctx, SHARDS, SHARD_SIZE);
+	TEST_ASSERT_EQUAL(0, pipe(fds));
+	TEST_ASSERT_EQUAL(0, stream_init(&stream, fds[0], ctx, SHARDS, count_numbers, 3));
+
+	writer.fd = fds[1];
+	TEST_ASSERT_EQUAL(0, pthread_create(&writer.thread, NULL, stream_test_thread, &writer));
+	for (i = 0; i < 3; i++)
+		TEST_ASSERT_EQUAL(0, pthread_create(&workers[i], NULL, stream_worker, &stream));
+
+	// Taken at any point of the stream, it can't count more than was read
+	TEST_ASSERT_EQUAL(0, stream_snapshot(&stream, 2, &snapshot));
+	TEST_ASSERT_TRUE(snapshot.counted_numbers <= snapshot.read_numbers);
+	TEST_ASSERT_TRUE(snapshot.unique <= 35000);
+
+	TEST_ASSERT_EQUAL(0, stream_read(&stream));
+	for (i = 0; i < 3; i++)
+		TEST_ASSERT_EQUAL(0, pthread_join(workers[i], NULL));
+	TEST_ASSERT_EQUAL(0, pthread_join(writer.thread, NULL));
+
+	TEST_ASSERT_EQUAL(0, stream_snapshot(&stream, 2, &snapshot));
+	TEST_ASSERT_EQUAL_UINT64(60000, snapshot.read_numbers);
+	TEST_ASSERT_EQUAL_UINT64(60000, snapshot.counted_numbers);
+	TEST_ASSERT_EQUAL_UINT64(35000, snapshot.unique);
+	TEST_ASSERT_EQUAL_UINT64(10000, snapshot.seen_only_once);
+
+	stream_deinit(&stream);
+	close(fds[0]);
+	destroy_shards(ctx, SHARDS);
+}
+
+void test_counting_export(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	uint32_t arr[] = {7, 300, 7, 200000, 4294967295u, 1u << 31, 300, 7, 129};
+	uint32_t once[4];
+	char varint[16];
+	char path[] = "/tmp/counting_export.XXXXXX";
+	uint64_t exported;
+	int fd;
+
+	prepare_shards_layout(ctx, SHARDS, SHARD_SIZE, COUNTING_LAYOUT_INTERLEAVED);
+	TEST_ASSERT_EQUAL(count_numbers(arr, 9, ctx), 0);
+
+	fd = mkstemp(path);
+	TEST_ASSERT_TRUE(fd >= 0);
+	unlink(path);
+
+	// Sorted across the shards
+	TEST_ASSERT_EQUAL(0, counting_export(ctx, SHARDS, 3, EXPORT_VALUES_ONCE, EXPORT_FORMAT_RAW,
+				fd, &exported));
+	TEST_ASSERT_EQUAL_UINT64(4, exported);
+	TEST_ASSERT_EQUAL(sizeof(once), pread(fd, once, sizeof(once), 0));
+	TEST_ASSERT_EQUAL_UINT32(129, once[0]);
+	TEST_ASSERT_EQUAL_UINT32(200000, once[1]);
+	TEST_ASSERT_EQUAL_UINT32(1u << 31, once[2]);
+	TEST_ASSERT_EQUAL_UINT32(4294967295u, once[3]);
+
+	// 7, then 300 - 7 = 293 takes two bytes
+	TEST_ASSERT_EQUAL(0, ftruncate(fd, 0));
+	TEST_ASSERT_EQUAL(0, lseek(fd, 0, SEEK_SET));
+	TEST_ASSERT_EQUAL(0, counting_export(ctx, SHARDS, 2, EXPORT_VALUES_REPEATED,
+				EXPORT_FORMAT_VARINT, fd, &exported));
+	TEST_ASSERT_EQUAL_UINT64(2, exported);
+	TEST_ASSERT_EQUAL(3, pread(fd, varint, sizeof(varint), 0));
+	TEST_ASSERT_EQUAL_UINT8(7, varint[0]);
+	TEST_ASSERT_EQUAL_UINT8(0x80 | (293 & 0x7f), (uint8_t)varint[1]);
+	TEST_ASSERT_EQUAL_UINT8(293 >> 7, varint[2]);
+
+	close(fd);
+	destroy_shards(ctx, SHARDS);
+}
+
+void test_text_parser(void)
+{
+	static char data[128 * 1024];
+	static uint32_t expected[8192], parsed[8192], scalar[8192];
+	struct text_parser parser;
+	uint64_t size = 0, split;
+	uint32_t count, total, i;
+
+	// Every length, a few leading zeros and the largest values
+	for (i = 0; i < 8192; i++) {
+		expected[i] = i % 3 ? i * 2654435761u : (i % 2 ? 4294967295u - i : i % 1000);
+		size += sprintf(&data[size], i % 5 ? "%u\n" : "000%u\n", expected[i]);
+	}
+	// The last line may lack the newline
+	size--;
+
+	text_parser_init(&parser, data, size, 0, size);
+	TEST_ASSERT_EQUAL_UINT32(8192, text_parse_lines_scalar(&parser, scalar, 8192));
+	TEST_ASSERT_EQUAL_UINT32_ARRAY(expected, scalar, 8192);
+
+	// Two chunks split in the middle of a line, the numbers come in small batches
+	split = size / 2;
+	for (total = 0, i = 0; i < 2; i++) {
+		text_parser_init(&parser, data, size, i ? split : 0, i ? size : split);
+		while ((count = text_parse(&parser, &parsed[total], 100)) > 0)
+			total += count;
+		TEST_ASSERT_EQUAL(TEXT_OK, parser.error);
+	}
+	TEST_ASSERT_EQUAL_UINT32(8192, total);
+	TEST_ASSERT_EQUAL_UINT32_ARRAY(expected, parsed, 8192);
+
+	strcpy(data, "12\n4294967296\n7\n");
+	text_parser_init(&parser, data, strlen(data), 0, strlen(data));
+	TEST_ASSERT_EQUAL_UINT32(1, text_parse(&parser, parsed, 10));
+	TEST_ASSERT_EQUAL(TEXT_OUT_OF_RANGE, parser.error);
+	TEST_ASSERT_EQUAL_UINT64(3, parser.position);
+
+	strcpy(data, "12\n-3\n");
+	text_parser_init(&parser, data, strlen(data), 0, strlen(data));
+	TEST_ASSERT_EQUAL_UINT32(1, text_parse(&parser, parsed, 10));
+	TEST_ASSERT_EQUAL(TEXT_MALFORMED, parser.error);
+	TEST_ASSERT_EQUAL_UINT64(3, parser.position);
+}
+
+void test_block_format(void)
+{
+	static uint32_t values[300000], decoded[BLOCK_MAX_VALUES], scalar[BLOCK_MAX_VALUES];
+	static char block[BLOCK_BYTES];
+	struct block_header *header = (struct block_header *)block;
+	uint32_t i, count, total = 0, taken, packed = 0, varint = 0;
+
+	// A constant run, a sorted dense range, random values and sparse jumps backwards
+	for (i = 0; i < 300000; i++) {
+		if (i < 70000)
+			values[i] = 42;
+		else if (i < 200000)
+			values[i] = i * 3;
+		else if (i < 260000)
+			values[i] = i * 2654435761u;
+		else
+			values[i] = i % 97 ? values[i - 1] + 5 : values[i - 1] - 1000000;
+	}
+
+	while (total < 300000) {
+		taken = block_encode(&values[total], 300000 - total, block);
+		TEST_ASSERT_TRUE(taken > 0);
+		TEST_ASSERT_TRUE(sizeof(*header) + header->payload_size <= BLOCK_BYTES);
+		packed += header->encoding == BLOCK_ENCODING_PACKED;
+		varint += header->encoding == BLOCK_ENCODING_VARINT;
+
+		TEST_ASSERT_EQUAL(0, block_decode(block, sizeof(*header) + header->payload_size, decoded,
+					&count));
+		TEST_ASSERT_EQUAL_UINT32(taken, count);
+		TEST_ASSERT_EQUAL_UINT32_ARRAY(&values[total], decoded, count);
+
+		if (header->encoding == BLOCK_ENCODING_PACKED) {
+			block_unpack_scalar((const uint32_t *)(block + sizeof(*header)), header->count,
+					header->bits, header->base, scalar);
+			TEST_ASSERT_EQUAL_UINT32_ARRAY(decoded, scalar, count);
+		}
+		total += taken;
+	}
+	TEST_ASSERT_TRUE(packed > 0);
+	TEST_ASSERT_TRUE(varint > 0);
+
+	// A truncated payload or a wrong magic is rejected
+	block_encode(values, 1000, block);
+	TEST_ASSERT_EQUAL(1, block_decode(block, sizeof(*header) + header->payload_size - 1,
+				decoded, &count));
+	header->magic = 0;
+	TEST_ASSERT_EQUAL(1, block_decode(block, BLOCK_BYTES, decoded, &count));
+
+	// So is a flipped bit of the payload or of the base, caught by the checksum
+	block_encode(&values[70000], 1000, block);
+	block[sizeof(*header) + 100] ^= 4;
+	TEST_ASSERT_EQUAL(1, block_decode(block, BLOCK_BYTES, decoded, &count));
+	block_encode(&values[70000], 1000, block);
+	header->base ^= 1;
+	TEST_ASSERT_EQUAL(1, block_decode(block, BLOCK_BYTES, decoded, &count));
+
+	// The check value of CRC32C, both kernels agree
+	TEST_ASSERT_EQUAL_UINT32(0xe3069283, ~block_crc32c_scalar(UINT32_MAX,
+				(const uint8_t *)"123456789", 9));
+	TEST_ASSERT_EQUAL_UINT32(0xe3069283, ~block_crc32c_sse42(UINT32_MAX,
+				(const uint8_t *)"123456789", 9));
+	TEST_ASSERT_EQUAL_UINT32(block_crc32c_scalar(0, (const uint8_t *)values, 4001),
+			block_crc32c_sse42(0, (const uint8_t *)values, 4001));
+}
+
+void test_counting_stats(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	struct counting_stats stats;
+	uint32_t arr[3000];
+	uint64_t values = 0, acquisitions = 0;
+	uint32_t i;
+
+	// 1000 values three times, the third occurrence doesn't change anything
+	for (i = 0; i < 3000; i++)
+		arr[i] = (i % 1000) * 4294967u;
+
+	prepare_shards(ctx, SHARDS, SHARD_SIZE);
+	TEST_ASSERT_EQUAL(counting_stats_init(&stats, SHARDS), 0);
+
+	counting_stats_attach(&stats);
+	TEST_ASSERT_EQUAL(count_numbers(arr, 3000, ctx), 0);
+	counting_stats_attach(NULL);
+
+	TEST_ASSERT_EQUAL_UINT64(2000, stats.slow_path);
+	TEST_ASSERT_EQUAL_UINT64(1000, stats.fast_path);
+	for (i = 0; i < SHARDS; i++) {
+		values += stats.shards[i].values;
+		acquisitions += stats.shards[i].lock_acquisitions;
+		TEST_ASSERT_EQUAL_UINT64(0, stats.shards[i].lock_contended);
+	}
+	TEST_ASSERT_EQUAL_UINT64(3000, values);
+	TEST_ASSERT_TRUE(acquisitions >= 3000);
+
+	// Detached, nothing is recorded
+	TEST_ASSERT_EQUAL(count_numbers_atomic(arr, 3000, ctx), 0);
+	TEST_ASSERT_EQUAL_UINT64(1000, stats.fast_path);
+
+	counting_stats_deinit(&stats);
+	destroy_shards(ctx, SHARDS);
+}
+
+void test_counting_counters_layout(void)
+{
+	struct tree_owner ctx[SHARDS] = {};
+	uint64_t histogram[HISTOGRAM_MAX_BUCKETS];
+	static uint32_t arr[5500];
+	uint32_t values[8];
+	uint32_t i, k, n = 0;
+
+	// Value k * 1000003 appears k times, for k = 1..100
+	for (k = 1; k <= 100; k++) {
+		for (i = 0; i < k; i++)
+			arr[n++] = k * 1000003u;
+	}
+	TEST_ASSERT_EQUAL_UINT32(5050, n);
+
+	prepare_shards_counters(ctx, SHARDS, SHARD_SIZE, 4, COUNTING_ALLOC_CALLOC);
+
+	TEST_ASSERT_EQUAL(count_numbers(arr, 2000, ctx), 0);
+	TEST_ASSERT_EQUAL(count_numbers_atomic(&arr[2000], n - 2000, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT64(100, total_unique_numbers(ctx));
+	TEST_ASSERT_EQUAL_UINT64(1, total_seen_once_numbers(ctx));
+
+	TEST_ASSERT_EQUAL_UINT32(16, counting_histogram(ctx, SHARDS, histogram));
+	for (k = 1; k < 15; k++)
+		TEST_ASSERT_EQUAL_UINT64(1, histogram[k]);
+	TEST_ASSERT_EQUAL_UINT64(86, histogram[15]);
+
+	TEST_ASSERT_EQUAL_UINT64(88, counting_values_at_least(ctx, SHARDS, 13, values, 8));
+	TEST_ASSERT_EQUAL_UINT32(13 * 1000003u, values[0]);
+	TEST_ASSERT_EQUAL_UINT32(20 * 1000003u, values[7]);
+
+	destroy_shards(ctx, SHARDS);
+
+	prepare_shards_counters(ctx, SHARDS, SHARD_SIZE, 2, COUNTING_ALLOC_CALLOC);
+	TEST_ASSERT_EQUAL(count_numbers_owned(arr, n, ctx), 0);
+
+	TEST_ASSERT_EQUAL_UINT32(4, counting_histogram(ctx, SHARDS, histogram));
+	TEST_ASSERT_EQUAL_UINT64(1, histogram[1]);
+	TEST_ASSERT_EQUAL_UINT64(1, histogram[2]);
+	TEST_ASSERT_EQUAL_UINT64(98, histogram[3]);
+
+	destroy_shards(ctx, SHARDS);
+}
+
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(test_prepare_shards_cover_full_range);
@@ -277,6 +1161,26 @@ int main(void) {
     RUN_TEST(test_get_shard_returns_correct_shard);
     RUN_TEST(test_countint_1);
     RUN_TEST(test_countint_2);
+    RUN_TEST(test_counting_atomic_engine);
+    RUN_TEST(test_counting_engine_lookup);
+    RUN_TEST(test_counting_owned_shards);
+    RUN_TEST(test_counting_partitioned);
+    RUN_TEST(test_counting_approx);
+    RUN_TEST(test_counting_checkpoint);
+    RUN_TEST(test_counting_sets);
+    RUN_TEST(test_counting_library);
+    RUN_TEST(test_counting_stream);
+    RUN_TEST(test_counting_export);
+    RUN_TEST(test_text_parser);
+    RUN_TEST(test_block_format);
+    RUN_TEST(test_counting_interleaved_layout);
+    RUN_TEST(test_counting_adaptive_layout);
+    RUN_TEST(test_counting_mapped_allocation);
+    RUN_TEST(test_popcount_kernels_agree);
+    RUN_TEST(test_counting_finalize_threads);
+    RUN_TEST(test_index_kernels_agree);
+    RUN_TEST(test_counting_stats);
+    RUN_TEST(test_counting_counters_layout);
 
     return UNITY_END();
 }